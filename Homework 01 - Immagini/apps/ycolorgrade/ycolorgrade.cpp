@@ -29,13 +29,15 @@
 #include <yocto/yocto_cli.h>
 #include <yocto/yocto_image.h>
 #include <yocto/yocto_math.h>
+#include <yocto/yocto_parallel.h>
 #include <yocto/yocto_sceneio.h>
 #include <yocto_colorgrade/yocto_colorgrade.h>
 #include <yocto_gui/yocto_glview.h>
 using namespace yocto;
 
-void run_offline(
-    const string& filename, const string& output, const grade_params& params) {
+void run_offline(const string& filename, const string& output,
+    const grade_params& params, const string& pipelinename,
+    const string& loadlut, const string& savelut) {
   // load
   auto error = string{};
   auto image = image_data{};
@@ -44,8 +46,30 @@ void run_offline(
   // hack to convert to srgb on input since we handle corrections outselves
   image.linear = false;
 
+  // color lut, covering the whole range of the image
+  auto lut    = std::shared_ptr<const grade_lut>{};
+  auto domain = get_grade_lut_domain(image);
+  if (!loadlut.empty()) {
+    auto loaded = grade_lut{};
+    if (!load_grade_lut(loadlut, loaded, error)) print_fatal(error);
+    lut = std::make_shared<const grade_lut>(std::move(loaded));
+  } else if (params.lut != 0) {
+    lut = std::make_shared<const grade_lut>(
+        make_grade_lut(params, params.lut, domain));
+  }
+  if (!savelut.empty()) {
+    auto saved = lut != nullptr ? *lut : make_grade_lut(params, 33, domain);
+    if (!save_grade_lut(savelut, saved, error)) print_fatal(error);
+  }
+
+  // pipeline
+  auto pipeline = make_grade_pipeline(params, lut);
+  if (!pipelinename.empty()) {
+    if (!load_grade_pipeline(pipelinename, pipeline, error)) print_fatal(error);
+  }
+
   // corrections
-  auto graded = grade_image(image, params);
+  auto graded = grade_image(image, pipeline, params.noparallel);
 
   // save
   if (!save_image(output, graded, error)) print_fatal(error);
@@ -64,8 +88,119 @@ void run_interactively(
   // hack to convert to srgb on input since we handle corrections outselves
   image.linear = false;
 
-  // display image
-  auto display = grade_image(image, params);
+  // proxy for the first preview, built once for large images
+  const auto proxy_size  = 960;
+  auto       proxy_scale = min(
+      1.0f, (float)proxy_size / max(image.width, image.height));
+  auto proxy = image_data{};
+  if (proxy_scale < 1) {
+    proxy = resize_image(image, max((int)(image.width * proxy_scale), 1),
+        max((int)(image.height * proxy_scale), 1));
+  }
+
+  // color corrections are baked in a lut if requested, covering the whole
+  // range of the image; it is all that changes with them
+  const auto lut_domain = get_grade_lut_domain(image);
+  auto       lut        = std::shared_ptr<const grade_lut>{};
+
+  // graded image, refined in tiles, and proxy preview at full size, both
+  // allocated once and written only by the grading worker
+  auto graded  = make_image(image.width, image.height, image.linear);
+  auto preview = proxy.pixels.empty()
+                     ? image_data{}
+                     : make_image(image.width, image.height, image.linear);
+
+  // grading worker; the ui uploads the preview and then the finished tiles
+  const auto tile_size    = 256;
+  const auto tiles        = vec2i{(image.width + tile_size - 1) / tile_size,
+      (image.height + tile_size - 1) / tile_size};
+  const auto render_total = tiles.x * tiles.y;
+  auto       render_preview = false;
+  auto       render_tiles   = vector<int>{};
+  auto       render_current = atomic<int>{};
+  auto       render_mutex   = std::mutex{};
+  auto       render_worker  = future<void>{};
+  auto       render_stop    = atomic<bool>{};
+  auto       stop_render    = [&]() {
+    render_stop = true;
+    if (render_worker.valid()) render_worker.get();
+  };
+  auto tile_region = [&](int tile) {
+    auto start = vec2i{tile % tiles.x, tile / tiles.x} * tile_size;
+    auto end   = vec2i{min(start.x + tile_size, image.width),
+        min(start.y + tile_size, image.height)};
+    return pair{start, end};
+  };
+  auto reset_display = [&](bool rebake) {
+    // stop stale grading and drop its pending uploads
+    stop_render();
+    render_stop    = false;
+    render_current = 0;
+    render_preview = false;
+    render_tiles.clear();
+
+    // start grader with a copy of the params, so the ui can keep editing them
+    render_worker = run_async([&, params, rebake]() {
+      if (params.lut == 0) {
+        lut = nullptr;
+      } else if (rebake || lut == nullptr) {
+        lut = std::make_shared<const grade_lut>(
+            make_grade_lut(params, params.lut, lut_domain));
+      }
+
+      // preview on the proxy, with the pixel sizes scaled to match
+      if (!proxy.pixels.empty()) {
+        auto pparams = params;
+        if (params.mosaic != 0)
+          pparams.mosaic = max((int)(params.mosaic * proxy_scale), 1);
+        if (params.grid != 0)
+          pparams.grid = max((int)(params.grid * proxy_scale), 1);
+        pparams.sigma = params.sigma * proxy_scale;
+        auto graded_proxy = grade_image(proxy,
+            make_grade_pipeline(pparams, lut), params.noparallel, &render_stop);
+        for (auto j = 0; j < image.height; j++) {
+          if (render_stop) return;
+          auto pj = j * proxy.height / image.height;
+          for (auto i = 0; i < image.width; i++) {
+            preview[{i, j}] = graded_proxy[{i * proxy.width / image.width, pj}];
+          }
+        }
+        auto lock      = std::lock_guard{render_mutex};
+        render_preview = true;
+      }
+
+      // refine at full resolution, one tile at a time
+      auto pipeline = make_grade_pipeline(params, lut);
+      if (!is_region_gradable(pipeline)) {
+        // blur, crosshatching and global stages need the whole image
+        auto whole = grade_image(
+            image, pipeline, params.noparallel, &render_stop);
+        if (render_stop) return;
+        graded.pixels = std::move(whole.pixels);
+        auto lock     = std::lock_guard{render_mutex};
+        for (auto tile = 0; tile < render_total; tile++)
+          render_tiles.push_back(tile);
+        render_current = render_total;
+        return;
+      }
+      auto refine_tile = [&](int tile) {
+        if (render_stop) return;
+        auto [start, end] = tile_region(tile);
+        grade_region(graded, image, pipeline, start, end);
+        auto lock = std::lock_guard{render_mutex};
+        render_tiles.push_back(tile);
+        render_current += 1;
+      };
+      if (params.noparallel) {
+        for (auto tile = 0; tile < render_total; tile++) refine_tile(tile);
+      } else {
+        parallel_for(render_total, refine_tile);
+      }
+    });
+  };
+
+  // start grading
+  reset_display(true);
 
   // opengl image
   auto glimage  = glimage_state{};
@@ -79,12 +214,26 @@ void run_interactively(
   auto callbacks    = glwindow_callbacks{};
   callbacks.init_cb = [&](const glinput_state& input) {
     init_image(glimage);
-    set_image(glimage, display);
+    set_image(glimage, image);
   };
   callbacks.clear_cb = [&](const glinput_state& input) {
     clear_image(glimage);
   };
   callbacks.draw_cb = [&](const glinput_state& input) {
+    // upload the preview and the tiles graded since the last frame; the
+    // worker does not write them again until the next reset
+    auto upload_preview = false;
+    auto upload_tiles   = vector<int>{};
+    {
+      auto lock = std::lock_guard{render_mutex};
+      std::swap(upload_preview, render_preview);
+      std::swap(upload_tiles, render_tiles);
+    }
+    if (upload_preview) set_image(glimage, preview);
+    for (auto tile : upload_tiles) {
+      auto [start, end] = tile_region(tile);
+      set_image_region(glimage, graded, start, end);
+    }
     glparams.window                           = input.window_size;
     glparams.framebuffer                      = input.framebuffer_viewport;
     std::tie(glparams.center, glparams.scale) = camera_imview(glparams.center,
@@ -94,22 +243,25 @@ void run_interactively(
   };
   callbacks.widgets_cb = [&](const glinput_state& input) {
     draw_glcombobox("name", selected, names);
+    auto current = (int)render_current;
+    draw_glprogressbar("refine", current, render_total);
     if (begin_glheader("colorgrade")) {
-      auto edited = 0;
-      edited += draw_glslider("exposure", params.exposure, -5, 5);
-      edited += draw_glcheckbox("filmic", params.filmic);
-      edited += draw_glcheckbox("srgb", params.srgb);
-      edited += draw_glcoloredit("tint", params.tint);
-      edited += draw_glslider("contrast", params.contrast, 0, 1);
-      edited += draw_glslider("saturation", params.saturation, 0, 1);
-      edited += draw_glslider("vignette", params.vignette, 0, 1);
-      edited += draw_glslider("grain", params.grain, 0, 1);
-      edited += draw_glslider("mosaic", params.mosaic, 0, 64);
-      edited += draw_glslider("mosaic", params.grid, 0, 64);
+      auto edited = 0, color_edited = 0;
+      auto tparams = params;
+      color_edited += draw_glslider("exposure", tparams.exposure, -5, 5);
+      color_edited += draw_glcheckbox("filmic", tparams.filmic);
+      color_edited += draw_glcheckbox("srgb", tparams.srgb);
+      color_edited += draw_glcoloredit("tint", tparams.tint);
+      color_edited += draw_glslider("contrast", tparams.contrast, 0, 1);
+      color_edited += draw_glslider("saturation", tparams.saturation, 0, 1);
+      edited += draw_glslider("vignette", tparams.vignette, 0, 1);
+      edited += draw_glslider("grain", tparams.grain, 0, 1);
+      edited += draw_glslider("mosaic", tparams.mosaic, 0, 64);
+      edited += draw_glslider("grid", tparams.grid, 0, 64);
       end_glheader();
-      if (edited) {
-        display = grade_image(image, params);
-        set_image(glimage, display);
+      if (edited || color_edited) {
+        params = tparams;
+        reset_display(color_edited != 0);
       }
     }
     // draw_image_inspector(input, image, display, glparams);
@@ -117,6 +269,9 @@ void run_interactively(
 
   // run ui
   run_ui({1280 + 320, 720}, "yicolorgrade", callbacks);
+
+  // done
+  stop_render();
 }
 
 void run(const vector<string>& args) {
@@ -125,6 +280,9 @@ void run(const vector<string>& args) {
   auto output      = "out.png"s;
   auto filename    = "img.hdr"s;
   auto interactive = false;
+  auto pipeline    = ""s;
+  auto loadlut     = ""s;
+  auto savelut     = ""s;
 
   // parse command line
   auto error = string{};
@@ -149,12 +307,17 @@ void run(const vector<string>& args) {
   add_option(cli, "h-width", params.width, "Set Width of the crosshatching");
   add_option(cli, "h-density", params.density, "Set Density of the crosshatching");
   add_option(cli, "c-hatch-colors", params.color_hatches, "Use colors if set, grey-scaling otherwise");
+  add_option(cli, "noparallel", params.noparallel, "Grade on a single thread");
+  add_option(cli, "pipeline", pipeline, "Pipeline description file (offline)");
+  add_option(cli, "lut", params.lut, "Bake color corrections in a LUT of this size (33 or 65)");
+  add_option(cli, "load-lut", loadlut, "Load the color LUT from a .cube file");
+  add_option(cli, "save-lut", savelut, "Save the color LUT to a .cube file");
   if (!parse_cli(cli, args, error)) print_fatal(error);
 
   if (interactive) {
     run_interactively(filename, output, params);
   } else {
-    run_offline(filename, output, params);
+    run_offline(filename, output, params, pipeline, loadlut, savelut);
   }
 }
 
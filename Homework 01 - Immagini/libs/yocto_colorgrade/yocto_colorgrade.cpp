@@ -33,8 +33,14 @@
 #include "yocto_colorgrade.h"
 
 #include <yocto/yocto_color.h>
+#include <yocto/yocto_parallel.h>
 #include <yocto/yocto_sampling.h>
+#include <yocto/yocto_sceneio.h>
+
+#include <algorithm>
+#include <cstdlib>
 #include <list>
+#include <sstream>
 
 // -----------------------------------------------------------------------------
 // COLOR GRADING FUNCTIONS
@@ -116,37 +122,20 @@ namespace yocto {
 	}
 
 	/// <summary>
-	/// Applichiamo un effetto mosaico, spostando i pixel calcolati secondo una funzione data dalla traccia. 
+	/// Calcola il rumore del Film Grain di un pixel come hash (splitmix64) del seed e dell'indice del pixel.
+	/// Il valore non dipende dall'ordine di visita dei pixel, quindi il grain  lo stesso con qualsiasi numero di thread.
 	/// </summary>
-	/// <param name="params">Parametri di grading</param>
-	/// <param name="to_grade">Immagine su cui effettuare il grading</param>
-	void applyMosaicEffect(const grade_params& params, color_image& to_grade) {
-		for (auto i = 0; i < to_grade.width; i++) {
-			for (auto j = 0; j < to_grade.height; j++) {
-				vec2i index     = {i, j};
-				vec2i new_index = {i - (i % params.mosaic), j - (j % params.mosaic)};
-				auto rgb = xyz(to_grade[new_index]);
-				to_grade[index] = {rgb.x, rgb.y, rgb.z};
-            }
-        }
-    }
+	/// <param name="seed">Seed del rumore</param>
+	/// <param name="index">Indice del pixel nell'immagine</param>
+	/// <returns>Valore pseudo-casuale in [0, 1)</returns>
+	float grainNoise(uint64_t seed, uint64_t index) {
+		auto z = seed + (index + 1) * 0x9e3779b97f4a7c15ull;
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+		z = z ^ (z >> 31);
+		return (z >> 40) / (float)(1ull << 24);
+	}
 
-	/// <summary>
-	/// Applichiamo un effetto griglia, la trasformazione viene calcolata in base alla posizione attuale del canale pixel preso in esame.
-	/// </summary>
-	/// <param name="params">Parametri di grading</param>
-	/// <param name="to_grade">Immagine su cui effettuare il grading</param>
-	void applyGridEffect(const grade_params& params, color_image& to_grade) {
-      for (auto i = 0; i < to_grade.width; i++) {
-        for (auto j = 0; j < to_grade.height; j++) {
-          vec2i index = {i, j};
-          auto  rgb = xyz(to_grade[index]);
-          rgb = (0 == i % params.grid || 0 == j % params.grid) ? 0.5 * rgb : rgb;
-          to_grade[index] = {rgb.x, rgb.y, rgb.z};
-        }
-      }
-    }
-	
 	/// <summary>
 	/// Calcola un valore heat come definito su Shader Toy - Predator Thermal Vision III
 	/// </summary>
@@ -193,41 +182,204 @@ namespace yocto {
 	}
 
 	/// <summary>
-	/// Applica una funzione di Gaussian Blur all'immagine. La grandezza del kernel  di 6.
+	/// Costruisce una sola volta il kernel gaussiano 1-D normalizzato per il sigma dato. Il raggio  ceil(3 * sigma),
+	/// che include praticamente tutto il peso della gaussiana.
 	/// </summary>
-	/// <param name="to_grade">Immagine su cui applicare il Gaussian Blur</param>
-	/// <param name="to_grade_size">Size dell'immagine</param>
-	/// <param name="coords">Coordinate del pixel</param>
-	/// <param name="params">Parametri di grading</param>
-	/// <returns>Canale RGB modificato con le operazioni di Gaussian Bluring</returns>
-	vec3f gaussianBlur(const color_image& to_grade, vec2f to_grade_size, vec2f coords, const grade_params& params) {
-		//Dichiariamo prima alcune grandezze per il kernel
-		const int mSize = 11;
-        const int kernSize = (mSize - 1) / 2;
-		float Z = 0.0f;
-
-		//Creiamo il kernel 1 - D
-        float kernel[mSize];
-        for (auto j = 0; j <= kernSize; j++) {
-			kernel[kernSize + j] = normpdf(j, params.sigma);
-			kernel[kernSize - j] = normpdf(j, params.sigma);
+	/// <param name="sigma">Fattore di blurring</param>
+	/// <returns>Pesi del kernel, di grandezza 2 * raggio + 1</returns>
+	vector<float> makeGaussianKernel(float sigma) {
+		auto radius = max((int)ceil(3 * sigma), 1);
+		auto kernel = vector<float>(2 * radius + 1);
+		auto sum    = 0.0f;
+		for (auto k = -radius; k <= radius; k++) {
+			kernel[k + radius] = normpdf((float)k, sigma);
+			sum += kernel[k + radius];
+		}
+		for (auto& weight : kernel) weight /= sum;
+		return kernel;
+	}
+
+	/// <summary>
+	/// Calcola le grandezze di una cascata di n box filter equivalente a una gaussiana di deviazione sigma
+	/// (la varianza di un box di grandezza w  (w^2 - 1) / 12 e le varianze si sommano).
+	/// </summary>
+	/// <param name="sigma">Fattore di blurring</param>
+	/// <param name="n">Numero di box filter</param>
+	/// <returns>Grandezze dispari dei box filter</returns>
+	vector<int> makeBoxSizes(float sigma, int n) {
+		auto ideal = sqrt(12 * sigma * sigma / n + 1);
+		auto lower = (int)floor(ideal);
+		if (lower % 2 == 0) lower--;
+		auto upper = lower + 2;
+		auto m     = (int)round((12 * sigma * sigma - n * lower * lower - 4 * n * lower - 3 * n) / (-4.0f * lower - 4));
+		auto sizes = vector<int>(n);
+		for (auto i = 0; i < n; i++) sizes[i] = i < m ? lower : upper;
+		return sizes;
+	}
+
+	/// <summary>
+	/// Esegue func(j) per ogni riga dell'immagine, in parallelo se richiesto. Le righe non ancora iniziate vengono saltate
+	/// quando stop diventa true.
+	/// </summary>
+	/// <param name="height">Numero di righe</param>
+	/// <param name="noparallel">Disabilita il parallelismo</param>
+	/// <param name="func">Funzione da eseguire per ogni riga</param>
+	/// <param name="stop">Flag di interruzione, opzionale</param>
+	template <typename Func>
+	void forEachRow(int height, bool noparallel, Func&& func, const std::atomic<bool>* stop = nullptr) {
+		auto row = [&](int j) {
+			if (stop == nullptr || !*stop) func(j);
+		};
+		if (noparallel) {
+			for (auto j = 0; j < height; j++) row(j);
+		} else {
+			parallel_for(height, row);
 		}
+	}
+
+	/// <summary>
+	/// Esegue func(start, end, strip) per ogni striscia di colonne [start, end) dell'immagine, passando una copia delle colonne
+	/// della striscia, riga per riga. I filtri verticali leggono la copia e scrivono in place senza un'immagine di appoggio.
+	/// </summary>
+	/// <param name="image">Immagine da elaborare</param>
+	/// <param name="noparallel">Disabilita il parallelismo</param>
+	/// <param name="func">Funzione da eseguire per ogni striscia</param>
+	/// <param name="stop">Flag di interruzione, opzionale</param>
+	template <typename Func>
+	void forEachStrip(const color_image& image, bool noparallel, Func&& func, const std::atomic<bool>* stop = nullptr) {
+		const int strip_size = 64;
+		auto strips = (image.width + strip_size - 1) / strip_size;
+		forEachRow(strips, noparallel, [&](int strip_idx) {
+			auto start = strip_idx * strip_size, end = min(start + strip_size, image.width);
+			auto strip = vector<vec4f>((size_t)(end - start) * image.height);
+			for (auto j = 0; j < image.height; j++) {
+				auto row = image.pixels.data() + (size_t)j * image.width;
+				std::copy(row + start, row + end, strip.data() + (size_t)j * (end - start));
+			}
+			func(start, end, strip);
+		}, stop);
+	}
+
+	/// <summary>
+	/// Convoluzione orizzontale in place di ogni riga con il kernel, con i bordi estesi. Ogni riga viene copiata in un buffer di linea;
+	/// i pixel lontani dai bordi evitano il clamp degli indici, cos il ciclo interno lavora solo su vec4f contigui e viene vettorizzato su RGBA.
+	/// </summary>
+	/// <param name="image">Immagine da filtrare</param>
+	/// <param name="kernel">Kernel normalizzato</param>
+	/// <param name="noparallel">Disabilita il parallelismo</param>
+	/// <param name="stop">Flag di interruzione, opzionale</param>
+	void convolveRows(color_image& image, const vector<float>& kernel, bool noparallel, const std::atomic<bool>* stop = nullptr) {
+		auto radius = (int)kernel.size() / 2;
+		forEachRow(image.height, noparallel, [&](int j) {
+			auto out  = image.pixels.data() + (size_t)j * image.width;
+			auto line = vector<vec4f>(out, out + image.width);
+			auto row  = line.data();
+			for (auto i = 0; i < image.width; i++) {
+				auto sum = vec4f{0, 0, 0, 0};
+				if (i >= radius && i + radius < image.width) {
+					auto start = row + i - radius;
+					for (auto k = 0; k < (int)kernel.size(); k++) sum += kernel[k] * start[k];
+				} else {
+					for (auto k = 0; k < (int)kernel.size(); k++) sum += kernel[k] * row[clamp(i + k - radius, 0, image.width - 1)];
+				}
+				out[i] = sum;
+			}
+		}, stop);
+	}
+
+	/// <summary>
+	/// Convoluzione verticale in place con il kernel, con i bordi estesi. Ogni riga della striscia accumula intere righe
+	/// della copia, cos gli accessi restano sequenziali.
+	/// </summary>
+	/// <param name="image">Immagine da filtrare</param>
+	/// <param name="kernel">Kernel normalizzato</param>
+	/// <param name="noparallel">Disabilita il parallelismo</param>
+	/// <param name="stop">Flag di interruzione, opzionale</param>
+	void convolveColumns(color_image& image, const vector<float>& kernel, bool noparallel, const std::atomic<bool>* stop = nullptr) {
+		auto radius = (int)kernel.size() / 2;
+		forEachStrip(image, noparallel, [&](int start, int end, const vector<vec4f>& strip) {
+			auto size = end - start;
+			for (auto j = 0; j < image.height; j++) {
+				auto out = image.pixels.data() + (size_t)j * image.width + start;
+				for (auto i = 0; i < size; i++) out[i] = {0, 0, 0, 0};
+				for (auto k = 0; k < (int)kernel.size(); k++) {
+					auto weight = kernel[k];
+					auto row    = strip.data() + (size_t)clamp(j + k - radius, 0, image.height - 1) * size;
+					for (auto i = 0; i < size; i++) out[i] += weight * row[i];
+				}
+			}
+		}, stop);
+	}
+
+	/// <summary>
+	/// Box filter orizzontale in place con somma scorrevole, con costo costante per pixel rispetto alla grandezza del box.
+	/// </summary>
+	/// <param name="image">Immagine da filtrare</param>
+	/// <param name="radius">Raggio del box</param>
+	/// <param name="noparallel">Disabilita il parallelismo</param>
+	/// <param name="stop">Flag di interruzione, opzionale</param>
+	void boxRows(color_image& image, int radius, bool noparallel, const std::atomic<bool>* stop = nullptr) {
+		auto scale = 1.0f / (2 * radius + 1);
+		forEachRow(image.height, noparallel, [&](int j) {
+			auto out  = image.pixels.data() + (size_t)j * image.width;
+			auto line = vector<vec4f>(out, out + image.width);
+			auto sum  = vec4f{0, 0, 0, 0};
+			for (auto k = -radius; k <= radius; k++) sum += line[clamp(k, 0, image.width - 1)];
+			for (auto i = 0; i < image.width; i++) {
+				out[i] = sum * scale;
+				sum += line[min(i + radius + 1, image.width - 1)] - line[max(i - radius, 0)];
+			}
+		}, stop);
+	}
 
-		//Otteniamo il fattore di normalizzazione
-        for (auto j = 0; j < mSize; j++) 
-			Z += kernel[j];
+	/// <summary>
+	/// Box filter verticale in place con somma scorrevole, per strisce di colonne.
+	/// </summary>
+	/// <param name="image">Immagine da filtrare</param>
+	/// <param name="radius">Raggio del box</param>
+	/// <param name="noparallel">Disabilita il parallelismo</param>
+	/// <param name="stop">Flag di interruzione, opzionale</param>
+	void boxColumns(color_image& image, int radius, bool noparallel, const std::atomic<bool>* stop = nullptr) {
+		auto scale = 1.0f / (2 * radius + 1);
+		forEachStrip(image, noparallel, [&](int start, int end, const vector<vec4f>& strip) {
+			auto size = end - start;
+			auto sum  = vector<vec4f>(size, {0, 0, 0, 0});
+			auto row  = [&](int j) { return strip.data() + (size_t)clamp(j, 0, image.height - 1) * size; };
+			for (auto k = -radius; k <= radius; k++) {
+				auto in = row(k);
+				for (auto i = 0; i < size; i++) sum[i] += in[i];
+			}
+			for (auto j = 0; j < image.height; j++) {
+				auto out = image.pixels.data() + (size_t)j * image.width + start;
+				auto add = row(j + radius + 1), sub = row(j - radius);
+				for (auto i = 0; i < size; i++) {
+					out[i] = sum[i] * scale;
+					sum[i] += add[i] - sub[i];
+				}
+			}
+		}, stop);
+	}
 
-		//Applichiamo il blur in base al kernel calcolato prima
-        vec4f final_color = {0.0f};
-        for (auto i = -kernSize; i <= kernSize; i++)
-          for (auto j = -kernSize; j <= kernSize; j++) {
-            vec2f flIJ = {i, j};
-            final_color += kernel[kernSize + j] * kernel[kernSize + i] * eval_image(to_grade, (coords + flIJ) / to_grade_size);
-          }
-		//Estraiamo l'rgb dal colore finale calcolato e restituiamolo in output
-        final_color /= Z * Z;
-        vec3f rgb = {final_color.x, final_color.y, final_color.z};
-        return rgb;
+	/// <summary>
+	/// Applica il Gaussian Blur in place all'intera immagine con due passaggi separabili, orizzontale e verticale. Per sigma grandi il
+	/// kernel diventa troppo largo e usiamo invece una cascata di tre box filter, con costo costante per pixel. La memoria extra 
+	/// solo quella dei buffer di linea e delle strisce di colonne.
+	/// </summary>
+	/// <param name="image">Immagine da sfocare, modificata in place</param>
+	/// <param name="sigma">Fattore di blurring</param>
+	/// <param name="noparallel">Disabilita il parallelismo</param>
+	/// <param name="stop">Flag di interruzione, opzionale</param>
+	void gaussianBlur(color_image& image, float sigma, bool noparallel, const std::atomic<bool>* stop = nullptr) {
+		if (sigma <= 8) {
+			auto kernel = makeGaussianKernel(sigma);
+			convolveRows(image, kernel, noparallel, stop);
+			convolveColumns(image, kernel, noparallel, stop);
+		} else {
+			for (auto size : makeBoxSizes(sigma, 3)) {
+				boxRows(image, (size - 1) / 2, noparallel, stop);
+				boxColumns(image, (size - 1) / 2, noparallel, stop);
+			}
+		}
 	}
 
 	//------------------------------------------------------------------------------------
@@ -357,49 +509,628 @@ namespace yocto {
         return res;
 	}
 
+	//------------------------------------------------------------------------------------
+	//FUNZIONI PER LE 3D LUT
+	//------------------------------------------------------------------------------------
+
+	/// <summary>
+	/// Cuoce in una LUT le operazioni sul colore che non dipendono dalla posizione del pixel, valutandole una sola volta sui punti
+	/// delle tabelle invece che su ogni pixel dell'immagine. Il tonemap, che  per canale e molto ripido vicino al nero per la
+	/// correzione sRGB, va nello shaper 1D con campioni uniformi nella radice quadrata del valore, fitti vicino al nero anche per
+	/// domini HDR grandi; tint, saturation e contrast nella 3D, sul dominio [0, 1] del tonemap.
+	/// </summary>
+	/// <param name="params">Parametri di grading</param>
+	/// <param name="size">Numero di campioni per canale della 3D</param>
+	/// <param name="domain_max">Valore massimo dei canali in input</param>
+	/// <returns>LUT delle operazioni sul colore</returns>
+	grade_lut make_grade_lut(const grade_params& params, int size, float domain_max) {
+		const int shaper_size = 8192;
+		auto lut         = grade_lut{};
+		lut.shaper_range = {0, domain_max};
+		lut.shaper_root  = true;
+		lut.shaper.resize(shaper_size);
+		for (auto idx = 0; idx < shaper_size; idx++) {
+			auto t          = idx / (float)(shaper_size - 1);
+			auto value      = domain_max * (t * t);
+			lut.shaper[idx] = applyToneMapping({value, value, value}, params);
+		}
+		lut.size = max(size, 2);
+		lut.values.resize((size_t)lut.size * lut.size * lut.size);
+		auto scale = (lut.domain_max - lut.domain_min) / (float)(lut.size - 1);
+		forEachRow(lut.size, params.noparallel, [&](int b) {
+			for (auto g = 0; g < lut.size; g++) {
+				for (auto r = 0; r < lut.size; r++) {
+					auto rgb = lut.domain_min + vec3f{(float)r, (float)g, (float)b} * scale;
+					rgb = applyColorTint(rgb, params);
+					rgb = applySaturation(rgb, params);
+					rgb = applyContrast(rgb, params);
+					lut.values[((size_t)b * lut.size + g) * lut.size + r] = rgb;
+				}
+			}
+		});
+		return lut;
+	}
+
+	/// <summary>
+	/// Calcola il dominio della LUT per un'immagine: il massimo dei canali RGB, e almeno 1 perch le immagini LDR usino
+	/// l'intervallo standard.
+	/// </summary>
+	/// <param name="image">Immagine da correggere</param>
+	/// <returns>Valore massimo dei canali in input</returns>
+	float get_grade_lut_domain(const color_image& image) {
+		auto domain = 1.0f;
+		for (auto& pixel : image.pixels) domain = max(domain, max(xyz(pixel)));
+		return domain;
+	}
+
+	/// <summary>
+	/// Valuta lo shaper di un canale con interpolazione lineare tra i campioni, uniformi nella radice quadrata se shaper_root.
+	/// </summary>
+	/// <param name="lut">LUT con lo shaper</param>
+	/// <param name="value">Valore del canale</param>
+	/// <param name="channel">Indice del canale</param>
+	/// <returns>Valore del canale dopo lo shaper</returns>
+	float evalShaper(const grade_lut& lut, float value, int channel) {
+		auto n   = (int)lut.shaper.size();
+		auto t   = clamp((value - lut.shaper_range.x) / (lut.shaper_range.y - lut.shaper_range.x), 0.0f, 1.0f);
+		auto u   = (lut.shaper_root ? sqrt(t) : t) * (n - 1);
+		auto idx = min((int)u, n - 2);
+		auto f   = u - idx;
+		return lut.shaper[idx][channel] * (1 - f) + lut.shaper[idx + 1][channel] * f;
+	}
+
+	/// <summary>
+	/// Valuta la LUT: prima lo shaper, se presente, poi la 3D con interpolazione tetraedrica. La cella viene divisa in sei tetraedri
+	/// lungo la diagonale principale e il colore interpola i quattro vertici del tetraedro che contiene il punto; usa la met dei
+	/// campioni della trilineare e conserva i grigi.
+	/// </summary>
+	/// <param name="lut">LUT da valutare</param>
+	/// <param name="rgb">Canale RGB del pixel</param>
+	/// <returns>Canale RGB dopo la LUT</returns>
+	vec3f eval_grade_lut(const grade_lut& lut, const vec3f& rgb_) {
+		auto rgb = rgb_;
+		if (!lut.shaper.empty()) rgb = {evalShaper(lut, rgb.x, 0), evalShaper(lut, rgb.y, 1), evalShaper(lut, rgb.z, 2)};
+		auto n   = lut.size;
+		auto uvw = clamp((rgb - lut.domain_min) / (lut.domain_max - lut.domain_min), 0, 1) * (float)(n - 1);
+		auto ijk = vec3i{min((int)uvw.x, n - 2), min((int)uvw.y, n - 2), min((int)uvw.z, n - 2)};
+		auto f   = uvw - vec3f{(float)ijk.x, (float)ijk.y, (float)ijk.z};
+		auto at  = [&](int r, int g, int b) -> const vec3f& {
+			return lut.values[((size_t)(ijk.z + b) * n + (ijk.y + g)) * n + (ijk.x + r)];
+		};
+		auto& c000 = at(0, 0, 0);
+		auto& c111 = at(1, 1, 1);
+		if (f.x >= f.y) {
+			if (f.y >= f.z) {
+				auto &c100 = at(1, 0, 0), &c110 = at(1, 1, 0);
+				return c000 + f.x * (c100 - c000) + f.y * (c110 - c100) + f.z * (c111 - c110);
+			} else if (f.x >= f.z) {
+				auto &c100 = at(1, 0, 0), &c101 = at(1, 0, 1);
+				return c000 + f.x * (c100 - c000) + f.z * (c101 - c100) + f.y * (c111 - c101);
+			} else {
+				auto &c001 = at(0, 0, 1), &c101 = at(1, 0, 1);
+				return c000 + f.z * (c001 - c000) + f.x * (c101 - c001) + f.y * (c111 - c101);
+			}
+		} else {
+			if (f.z >= f.y) {
+				auto &c001 = at(0, 0, 1), &c011 = at(0, 1, 1);
+				return c000 + f.z * (c001 - c000) + f.y * (c011 - c001) + f.x * (c111 - c011);
+			} else if (f.z >= f.x) {
+				auto &c010 = at(0, 1, 0), &c011 = at(0, 1, 1);
+				return c000 + f.y * (c010 - c000) + f.z * (c011 - c010) + f.x * (c111 - c011);
+			} else {
+				auto &c010 = at(0, 1, 0), &c110 = at(1, 1, 0);
+				return c000 + f.y * (c010 - c000) + f.x * (c110 - c010) + f.z * (c111 - c110);
+			}
+		}
+	}
+
+	/// <summary>
+	/// Carica una LUT in formato .cube. Accetta le 3D con DOMAIN_MIN e DOMAIN_MAX, e le varianti con shaper 1D seguito dalla 3D
+	/// (LUT_1D_SIZE e LUT_3D_SIZE, con LUT_1D_INPUT_RANGE e LUT_3D_INPUT_RANGE). Una LUT solo 1D diventa uno shaper seguito
+	/// da una 3D identit.
+	/// </summary>
+	/// <param name="filename">Nome del file</param>
+	/// <param name="lut">LUT caricata</param>
+	/// <param name="error">Messaggio di errore</param>
+	/// <returns>False in caso di errore</returns>
+	bool load_grade_lut(const string& filename, grade_lut& lut, string& error) {
+		auto text = string{};
+		if (!load_text(filename, text, error)) return false;
+		lut             = grade_lut{};
+		auto size_1d    = 0;
+		auto entries    = vector<vec3f>{};
+		auto lines      = std::istringstream(text);
+		auto line       = string{};
+		for (auto number = 1; std::getline(lines, line); number++) {
+			auto words = std::istringstream(line.substr(0, line.find('#')));
+			auto key   = string{};
+			if (!(words >> key) || key == "TITLE") continue;
+			auto where = filename + ":" + std::to_string(number) + ": ";
+			auto valid = true;
+			if (key == "LUT_3D_SIZE") {
+				valid = (bool)(words >> lut.size) && lut.size >= 2;
+			} else if (key == "LUT_1D_SIZE") {
+				valid = (bool)(words >> size_1d) && size_1d >= 2;
+			} else if (key == "DOMAIN_MIN") {
+				valid = (bool)(words >> lut.domain_min.x >> lut.domain_min.y >> lut.domain_min.z);
+			} else if (key == "DOMAIN_MAX") {
+				valid = (bool)(words >> lut.domain_max.x >> lut.domain_max.y >> lut.domain_max.z);
+			} else if (key == "LUT_1D_INPUT_RANGE") {
+				valid = (bool)(words >> lut.shaper_range.x >> lut.shaper_range.y);
+			} else if (key == "LUT_3D_INPUT_RANGE") {
+				auto range = vec2f{};
+				valid      = (bool)(words >> range.x >> range.y);
+				lut.domain_min = {range.x, range.x, range.x};
+				lut.domain_max = {range.y, range.y, range.y};
+			} else {
+				auto value = vec3f{};
+				words      = std::istringstream(line);
+				valid      = (bool)(words >> value.x >> value.y >> value.z);
+				entries.push_back(value);
+			}
+			if (!valid) {
+				error = where + "invalid line " + line;
+				return false;
+			}
+		}
+		auto size_3d = (size_t)lut.size * lut.size * lut.size;
+		if ((size_1d == 0 && lut.size == 0) || entries.size() != size_1d + size_3d) {
+			error = filename + ": wrong number of LUT entries";
+			return false;
+		}
+		if (size_1d != 0 && lut.size == 0) {
+			// LUT solo 1D: il dominio  quello di DOMAIN_MIN e DOMAIN_MAX
+			lut.shaper_range = {lut.domain_min.x, lut.domain_max.x};
+			lut.shaper.assign(entries.begin(), entries.end());
+			lut.size       = 2;
+			lut.domain_min = {0, 0, 0};
+			lut.domain_max = {1, 1, 1};
+			for (auto b = 0; b < 2; b++)
+				for (auto g = 0; g < 2; g++)
+					for (auto r = 0; r < 2; r++) lut.values.push_back({(float)r, (float)g, (float)b});
+		} else {
+			lut.shaper.assign(entries.begin(), entries.begin() + size_1d);
+			lut.values.assign(entries.begin() + size_1d, entries.end());
+		}
+		return true;
+	}
+
+	/// <summary>
+	/// Salva una LUT in formato .cube, con lo shaper nella forma LUT_1D_SIZE / LUT_3D_SIZE se presente. In questa forma
+	/// LUT_3D_INPUT_RANGE ha un solo intervallo per tutti i canali, quindi un dominio diverso per canale  un errore.
+	/// </summary>
+	/// <param name="filename">Nome del file</param>
+	/// <param name="lut">LUT da salvare</param>
+	/// <param name="error">Messaggio di errore</param>
+	/// <returns>False in caso di errore</returns>
+	bool save_grade_lut(const string& filename, const grade_lut& lut, string& error) {
+		auto format = [](const vec3f& value) {
+			char buffer[64];
+			snprintf(buffer, sizeof(buffer), "%.6f %.6f %.6f\n", value.x, value.y, value.z);
+			return string{buffer};
+		};
+		auto range = [](float min, float max) { return std::to_string(min) + " " + std::to_string(max) + "\n"; };
+		auto text  = string{};
+		if (!lut.shaper.empty()) {
+			if (lut.domain_min.x != lut.domain_min.y || lut.domain_min.x != lut.domain_min.z ||
+				lut.domain_max.x != lut.domain_max.y || lut.domain_max.x != lut.domain_max.z) {
+				error = filename + ": LUT with a shaper needs the same domain on all channels";
+				return false;
+			}
+			// il formato ha solo shaper uniformi, quindi uno shaper nella radice quadrata viene ricampionato
+			auto shaper = lut.shaper;
+			if (lut.shaper_root) {
+				const int linear_size = 65536;
+				shaper.resize(linear_size);
+				for (auto idx = 0; idx < linear_size; idx++) {
+					auto value  = lut.shaper_range.x + (lut.shaper_range.y - lut.shaper_range.x) * idx / (linear_size - 1);
+					shaper[idx] = {evalShaper(lut, value, 0), evalShaper(lut, value, 1), evalShaper(lut, value, 2)};
+				}
+			}
+			text += "LUT_1D_SIZE " + std::to_string(shaper.size()) + "\n";
+			text += "LUT_1D_INPUT_RANGE " + range(lut.shaper_range.x, lut.shaper_range.y);
+			text += "LUT_3D_SIZE " + std::to_string(lut.size) + "\n";
+			text += "LUT_3D_INPUT_RANGE " + range(lut.domain_min.x, lut.domain_max.x);
+			for (auto& value : shaper) text += format(value);
+		} else {
+			text += "LUT_3D_SIZE " + std::to_string(lut.size) + "\n";
+			text += "DOMAIN_MIN " + format(lut.domain_min);
+			text += "DOMAIN_MAX " + format(lut.domain_max);
+		}
+		for (auto& value : lut.values) text += format(value);
+		return save_text(filename, text, error);
+	}
+
+	//------------------------------------------------------------------------------------
+	//FUNZIONI DEL FILTER GRAPH
+	//------------------------------------------------------------------------------------
+
+	/// <summary>
+	/// Esegue func(ij) per ogni pixel, per tile visitati in ordine row-major come image_data::pixels.
+	/// I tile sono indipendenti e vengono elaborati in parallelo se richiesto; quelli non ancora iniziati vengono saltati
+	/// quando stop diventa true.
+	/// </summary>
+	/// <param name="width">Larghezza dell'immagine</param>
+	/// <param name="height">Altezza dell'immagine</param>
+	/// <param name="noparallel">Disabilita il parallelismo</param>
+	/// <param name="func">Funzione da eseguire per ogni pixel</param>
+	/// <param name="stop">Flag di interruzione, opzionale</param>
+	template <typename Func>
+	void forEachTile(int width, int height, bool noparallel, Func&& func, const std::atomic<bool>* stop = nullptr) {
+		const int tile_size = 64;
+		auto tiles = vec2i{(width + tile_size - 1) / tile_size, (height + tile_size - 1) / tile_size};
+		auto grade_tile = [&](int tile) {
+			if (stop != nullptr && *stop) return;
+			auto start = vec2i{tile % tiles.x, tile / tiles.x} * tile_size;
+			auto end   = vec2i{min(start.x + tile_size, width), min(start.y + tile_size, height)};
+			for (auto j = start.y; j < end.y; j++) {
+				for (auto i = start.x; i < end.x; i++) func(vec2i{i, j});
+			}
+		};
+		if (noparallel) {
+			for (auto tile = 0; tile < tiles.x * tiles.y; tile++) grade_tile(tile);
+		} else {
+			parallel_for(tiles.x * tiles.y, grade_tile);
+		}
+	}
+
+	/// <summary>
+	/// Applica uno stage per pixel al canale RGB del pixel di coordinate ij.
+	/// </summary>
+	/// <param name="stage">Stage da applicare</param>
+	/// <param name="rgb">Canale RGB del pixel</param>
+	/// <param name="ij">Coordinate del pixel</param>
+	/// <param name="size">Size dell'immagine</param>
+	/// <returns>Canale RGB del pixel dopo lo stage</returns>
+	vec3f applyPointStage(const grade_stage& stage, vec3f rgb, vec2i ij, vec2i size) {
+		auto& params     = stage.params;
+		vec2f coords     = {(float)ij.x, (float)ij.y};
+		vec2f image_size = {(float)size.x, (float)size.y};
+		switch (stage.filter) {
+			case grade_filter::tonemap: return applyToneMapping(rgb, params);
+			case grade_filter::tint: return applyColorTint(rgb, params);
+			case grade_filter::saturation: return applySaturation(rgb, params);
+			case grade_filter::contrast: return applyContrast(rgb, params);
+			case grade_filter::vignette: return applyVignette(rgb, params, coords, image_size);
+			case grade_filter::grain: {
+				auto index = (uint64_t)ij.y * size.x + ij.x;
+				return rgb + (grainNoise(params.seed, index) - 0.5f) * params.grain;
+			}
+			case grade_filter::predator: return predatorThermalVision(image_size, rgb, coords);
+			case grade_filter::lut: return stage.lut != nullptr ? eval_grade_lut(*stage.lut, rgb) : rgb;
+			case grade_filter::grid: {
+				if (params.grid == 0) return rgb;
+				return (0 == ij.x % params.grid || 0 == ij.y % params.grid) ? 0.5 * rgb : rgb;
+			}
+			default: return rgb;
+		}
+	}
+
+	/// <summary>
+	/// Applichiamo un effetto mosaico in place, copiando in ogni pixel il pixel d'angolo del suo blocco. I pixel d'angolo non
+	/// vengono mai scritti, quindi i tile possono essere elaborati in parallelo senza un'immagine di appoggio.
+	/// </summary>
+	/// <param name="image">Immagine da modificare</param>
+	/// <param name="mosaic">Grandezza dei blocchi</param>
+	/// <param name="noparallel">Disabilita il parallelismo</param>
+	/// <param name="stop">Flag di interruzione, opzionale</param>
+	void applyMosaicEffect(color_image& image, int mosaic, bool noparallel, const std::atomic<bool>* stop = nullptr) {
+		if (mosaic <= 0) return;
+		forEachTile(image.width, image.height, noparallel, [&](vec2i ij) {
+			auto anchor = vec2i{ij.x - (ij.x % mosaic), ij.y - (ij.y % mosaic)};
+			if (anchor != ij) image[ij] = image[anchor];
+		}, stop);
+	}
+
+	/// <summary>
+	/// Operazione globale di auto-levels: calcola il minimo e il massimo di ogni canale sull'intera immagine e li porta in [0, 1].
+	/// </summary>
+	/// <param name="image">Immagine da modificare</param>
+	/// <param name="noparallel">Disabilita il parallelismo</param>
+	/// <param name="stop">Flag di interruzione, opzionale</param>
+	void normalizeLevels(color_image& image, bool noparallel, const std::atomic<bool>* stop = nullptr) {
+		auto lows  = vector<vec3f>(image.height, vec3f{flt_max, flt_max, flt_max});
+		auto highs = vector<vec3f>(image.height, vec3f{-flt_max, -flt_max, -flt_max});
+		forEachRow(image.height, noparallel, [&](int j) {
+			for (auto i = 0; i < image.width; i++) {
+				auto rgb = xyz(image[{i, j}]);
+				lows[j]  = min(lows[j], rgb);
+				highs[j] = max(highs[j], rgb);
+			}
+		}, stop);
+		auto low = vec3f{flt_max, flt_max, flt_max}, high = vec3f{-flt_max, -flt_max, -flt_max};
+		for (auto j = 0; j < image.height; j++) {
+			low  = min(low, lows[j]);
+			high = max(high, highs[j]);
+		}
+		auto range = max(high - low, vec3f{1e-6f, 1e-6f, 1e-6f});
+		forEachRow(image.height, noparallel, [&](int j) {
+			for (auto i = 0; i < image.width; i++) {
+				auto& pixel = image[{i, j}];
+				auto  rgb   = (xyz(pixel) - low) / range;
+				pixel       = {rgb.x, rgb.y, rgb.z, pixel.w};
+			}
+		}, stop);
+	}
+
+	/// <summary>
+	/// Restituisce il tipo di operazione di un filtro. Il mosaico  un'operazione sui pixel vicini, ma lavora in place.
+	/// </summary>
+	/// <param name="filter">Filtro</param>
+	/// <returns>Tipo di operazione</returns>
+	grade_stage_type get_stage_type(grade_filter filter) {
+		switch (filter) {
+			case grade_filter::mosaic:
+			case grade_filter::blur:
+			case grade_filter::crosshatching: return grade_stage_type::neighborhood;
+			case grade_filter::normalize: return grade_stage_type::global;
+			default: return grade_stage_type::point;
+		}
+	}
+
+	/// <summary>
+	/// Costruisce la pipeline equivalente ai parametri di grading, nell'ordine storico degli effetti. Il CrossHatching sostituisce
+	/// il colore e legge l'immagine di input, quindi quando  attivo le operazioni per pixel e il blur non contribuiscono.
+	/// Con una LUT, data o cotta qui se params.lut  diverso da 0, tonemap, tint, saturation e contrast diventano un solo stage.
+	/// </summary>
+	/// <param name="params">Parametri di grading</param>
+	/// <param name="lut">LUT delle operazioni sul colore, opzionale</param>
+	/// <returns>Stage della pipeline</returns>
+	vector<grade_stage> make_grade_pipeline(const grade_params& params, std::shared_ptr<const grade_lut> lut) {
+		auto pipeline  = vector<grade_stage>{};
+		auto add_stage = [&](grade_filter filter) { pipeline.push_back({filter, params}); };
+		if (params.crosshatching) {
+			add_stage(grade_filter::crosshatching);
+		} else {
+			if (lut == nullptr && params.lut != 0) lut = std::make_shared<grade_lut>(make_grade_lut(params, params.lut));
+			if (lut != nullptr) {
+				pipeline.push_back({grade_filter::lut, params, lut});
+			} else {
+				add_stage(grade_filter::tonemap);
+				add_stage(grade_filter::tint);
+				add_stage(grade_filter::saturation);
+				add_stage(grade_filter::contrast);
+			}
+			add_stage(grade_filter::vignette);
+			if (params.grain != 0) add_stage(grade_filter::grain);
+			if (params.predthermal) add_stage(grade_filter::predator);
+			if (params.sigma != 0) add_stage(grade_filter::blur);
+		}
+		if (params.mosaic != 0) add_stage(grade_filter::mosaic);
+		if (params.grid != 0) add_stage(grade_filter::grid);
+		return pipeline;
+	}
+
+	/// <summary>
+	/// Applica una pipeline all'immagine. Le operazioni per pixel consecutive sono fuse in un solo passaggio che legge dal buffer
+	/// corrente, o direttamente dall'input, e scrive nell'immagine di output. Blur, mosaico e operazioni globali lavorano in place;
+	/// solo il CrossHatching, che campiona coordinate arbitrarie, richiede un secondo buffer, allocato una volta sola e scambiato
+	/// con l'output (ping-pong). La memoria massima  quindi di due immagini oltre all'input. Lo stop viene controllato tra
+	/// gli stage e per tile o per riga al loro interno.
+	/// </summary>
+	/// <param name="image">Immagine di input</param>
+	/// <param name="pipeline">Stage da applicare in ordine</param>
+	/// <param name="noparallel">Disabilita il parallelismo</param>
+	/// <param name="stop">Flag di interruzione, opzionale</param>
+	/// <returns>Immagine dopo il grading, incompleta se interrotta</returns>
+	color_image grade_image(const color_image& image, const vector<grade_stage>& pipeline, bool noparallel, const std::atomic<bool>* stop) {
+		auto  size       = vec2i{image.width, image.height};
+		vec2f image_size = {(float)image.width, (float)image.height};
+		auto  graded     = make_image(image.width, image.height, image.linear);
+		auto  scratch    = color_image{};
+		auto  source     = &image;
+		for (auto first = 0; first < (int)pipeline.size();) {
+			if (stop != nullptr && *stop) break;
+			auto& stage = pipeline[first];
+			if (get_stage_type(stage.filter) == grade_stage_type::point) {
+				// fondiamo tutte le operazioni per pixel consecutive
+				auto last = first;
+				while (last < (int)pipeline.size() && get_stage_type(pipeline[last].filter) == grade_stage_type::point) last++;
+				auto& input = *source;
+				forEachTile(size.x, size.y, noparallel, [&](vec2i ij) {
+					auto rgb = xyz(input[ij]);
+					for (auto idx = first; idx < last; idx++) rgb = applyPointStage(pipeline[idx], rgb, ij, size);
+					graded[ij] = {rgb.x, rgb.y, rgb.z};
+				}, stop);
+				source = &graded;
+				first  = last;
+				continue;
+			}
+			if (stage.filter == grade_filter::crosshatching) {
+				if (source == &graded) {
+					if (scratch.pixels.empty()) scratch = make_image(image.width, image.height, image.linear);
+					swap(graded, scratch);
+					source = &scratch;
+				}
+				auto& input = *source;
+				forEachTile(size.x, size.y, noparallel, [&](vec2i ij) {
+					auto rgb   = applyCrossHatching(input, image_size, {(float)ij.x, (float)ij.y}, stage.params);
+					graded[ij] = {rgb.x, rgb.y, rgb.z};
+				}, stop);
+				source = &graded;
+			} else {
+				if (source != &graded) {
+					graded.pixels = image.pixels;
+					source        = &graded;
+				}
+				if (stage.filter == grade_filter::mosaic) applyMosaicEffect(graded, stage.params.mosaic, noparallel, stop);
+				if (stage.filter == grade_filter::blur && stage.params.sigma > 0) gaussianBlur(graded, stage.params.sigma, noparallel, stop);
+				if (stage.filter == grade_filter::normalize) normalizeLevels(graded, noparallel, stop);
+			}
+			first++;
+		}
+		if (source != &graded) graded.pixels = image.pixels;
+		return graded;
+	}
+
+	/// <summary>
+	/// Verifica se la pipeline pu essere applicata per regioni: solo le operazioni per pixel e il mosaico, che legge il pixel
+	/// d'angolo del blocco dall'input, non dipendono dai pixel vicini gi modificati.
+	/// </summary>
+	/// <param name="pipeline">Stage da applicare in ordine</param>
+	/// <returns>True se grade_region pu applicare la pipeline</returns>
+	bool is_region_gradable(const vector<grade_stage>& pipeline) {
+		for (auto& stage : pipeline) {
+			if (get_stage_type(stage.filter) != grade_stage_type::point && stage.filter != grade_filter::mosaic) return false;
+		}
+		return true;
+	}
+
+	/// <summary>
+	/// Applica la pipeline a una regione dell'immagine. Il mosaico sposta la lettura degli stage che lo precedono sul pixel
+	/// d'angolo del blocco, quindi per ogni pixel calcoliamo a ritroso la posizione in cui valutare ogni stage e poi applichiamo
+	/// gli stage in avanti, come farebbe grade_image sull'intera immagine.
+	/// </summary>
+	/// <param name="graded">Immagine di output, con la size dell'immagine di input</param>
+	/// <param name="image">Immagine di input</param>
+	/// <param name="pipeline">Stage da applicare in ordine</param>
+	/// <param name="start">Primo pixel della regione</param>
+	/// <param name="end">Pixel successivo all'ultimo della regione</param>
+	/// <returns>False se la pipeline non pu essere applicata per regioni</returns>
+	bool grade_region(color_image& graded, const color_image& image, const vector<grade_stage>& pipeline, vec2i start, vec2i end) {
+		if (!is_region_gradable(pipeline)) return false;
+		auto has_point = false;
+		for (auto& stage : pipeline) {
+			if (get_stage_type(stage.filter) == grade_stage_type::point) has_point = true;
+		}
+		auto size      = vec2i{image.width, image.height};
+		auto positions = vector<vec2i>(pipeline.size());
+		for (auto j = start.y; j < end.y; j++) {
+			for (auto i = start.x; i < end.x; i++) {
+				auto ij = vec2i{i, j};
+				for (auto idx = (int)pipeline.size() - 1; idx >= 0; idx--) {
+					positions[idx] = ij;
+					auto mosaic    = pipeline[idx].params.mosaic;
+					if (pipeline[idx].filter == grade_filter::mosaic && mosaic > 0) ij = {ij.x - (ij.x % mosaic), ij.y - (ij.y % mosaic)};
+				}
+				auto pixel = image[ij];
+				auto rgb   = xyz(pixel);
+				for (auto idx = 0; idx < (int)pipeline.size(); idx++) {
+					if (get_stage_type(pipeline[idx].filter) == grade_stage_type::point) rgb = applyPointStage(pipeline[idx], rgb, positions[idx], size);
+				}
+				// come in grade_image, le operazioni per pixel scrivono alpha a 0
+				graded[{i, j}] = {rgb.x, rgb.y, rgb.z, has_point ? 0 : pixel.w};
+			}
+		}
+		return true;
+	}
+
 	//------------------------------------------------------------------------------------
 	//FUNZIONE DI GRADING PRINCIPALE
 	//------------------------------------------------------------------------------------
 	color_image grade_image(const color_image& image, const grade_params& params) {
-		// PUT YOUR CODE HERE
-		//Ricaviamo prima alcuni parametri utili per le operazioni di gradazione dell'immagine
-		auto to_grade = image;
-		vec2f to_grade_size = {to_grade.width, to_grade.height}; 
-		auto rng = make_rng(172784);
-		for (auto i = 0; i < to_grade.width; i++) {
-          for (auto j = 0; j < to_grade.height; j++) {
-            // Per ogni pixel, estraiamo il corrispondente canale RGB e applichiamo le trasformazioni indicate
-            vec2i index = {i, j};
-            auto  rgb = xyz(to_grade[index]);
-			//Le trasformazioni restituiranno sempre il canale rgb modificato, per allinearsi alle specifiche di "design ideale" del codice 
-			//usando la libreria yocto, come discusso in classe (passaggio di raw data a fine funzione)
-            // Applichiamo la sequenza di operazioni del tone-mapping
-            rgb = applyToneMapping(rgb, params);
-            // Applichiamo la funzione di Color Tint
-            rgb = applyColorTint(rgb, params);
-            // Applichiamo la funzione di Saturazione
-            rgb = applySaturation(rgb, params);
-            // Applichiamo la funzione di Contrast
-            rgb = applyContrast(rgb, params);
-            // Applichiamo la funzione di Vignette. Utilizziamo un vec2f invece che un vec2i per questione di tipazione nel calcolo della funzione
-            vec2f coords = {i, j};
-            rgb = applyVignette(rgb, params, coords, to_grade_size);
-            // Applichiamo la funzione di Film Grain. Non  in una funzione a parte per problemi di generazione del valore randomico
-            rgb += (rand1f(rng) - 0.5) * params.grain;
-			//Applichiamo la funzione di Predator Thermal Vision
-            if (params.predthermal)	rgb = predatorThermalVision(to_grade_size, rgb, coords);
-            if (params.sigma != 0) rgb = gaussianBlur(to_grade, to_grade_size, coords, params);
-            if (params.crosshatching) rgb = applyCrossHatching(to_grade, to_grade_size, coords, params);
-            // Assegnamo all'immagine le operazioni effettuate sui canali RGB
-            to_grade[index] = {rgb.x, rgb.y, rgb.z};
-          }
-        }
-		//Le successive operazioni vengono effettuate in cicli a parte, per evitare di causare problemi alle modifiche del colore
-		
-		// Applichiamo la funzione di Mosaic Effect
-		if (params.mosaic != 0) applyMosaicEffect(params, to_grade);
-        // Applichiamo la funzione di Grid Effect
-        if (params.grid != 0) applyGridEffect(params, to_grade);
-		return to_grade;
-	}	
+		auto lut = std::shared_ptr<const grade_lut>{};
+		if (params.lut != 0) lut = std::make_shared<const grade_lut>(make_grade_lut(params, params.lut, get_grade_lut_domain(image)));
+		return grade_image(image, make_grade_pipeline(params, lut), params.noparallel);
+	}
+
+	//------------------------------------------------------------------------------------
+	//CARICAMENTO DELLE PIPELINE
+	//------------------------------------------------------------------------------------
+
+	/// <summary>
+	/// Legge un valore da una stringa, restituendo false se la stringa non  un valore valido.
+	/// </summary>
+	bool parseValue(const string& str, float& value) {
+		char* end = nullptr;
+		value     = std::strtof(str.c_str(), &end);
+		return !str.empty() && *end == 0;
+	}
+	bool parseValue(const string& str, int& value) {
+		char* end = nullptr;
+		value     = (int)std::strtol(str.c_str(), &end, 10);
+		return !str.empty() && *end == 0;
+	}
+	bool parseValue(const string& str, uint64_t& value) {
+		char* end = nullptr;
+		value     = std::strtoull(str.c_str(), &end, 10);
+		return !str.empty() && *end == 0;
+	}
+	bool parseValue(const string& str, bool& value) {
+		if (str == "true" || str == "1") value = true;
+		else if (str == "false" || str == "0") value = false;
+		else return false;
+		return true;
+	}
+	bool parseValue(const string& str, vec3f& value) {
+		auto first = str.find(','), second = str.find(',', first + 1);
+		if (first == string::npos || second == string::npos) return false;
+		return parseValue(str.substr(0, first), value.x) &&
+		       parseValue(str.substr(first + 1, second - first - 1), value.y) &&
+		       parseValue(str.substr(second + 1), value.z);
+	}
+
+	/// <summary>
+	/// Imposta il parametro di grading con il nome dato, che  lo stesso del campo di grade_params.
+	/// </summary>
+	/// <param name="params">Parametri di grading</param>
+	/// <param name="name">Nome del parametro</param>
+	/// <param name="value">Valore da leggere</param>
+	/// <returns>False se il parametro non esiste o il valore non  valido</returns>
+	bool setGradeParam(grade_params& params, const string& name, const string& value) {
+		if (name == "exposure") return parseValue(value, params.exposure);
+		if (name == "filmic") return parseValue(value, params.filmic);
+		if (name == "srgb") return parseValue(value, params.srgb);
+		if (name == "tint") return parseValue(value, params.tint);
+		if (name == "saturation") return parseValue(value, params.saturation);
+		if (name == "contrast") return parseValue(value, params.contrast);
+		if (name == "vignette") return parseValue(value, params.vignette);
+		if (name == "grain") return parseValue(value, params.grain);
+		if (name == "seed") return parseValue(value, params.seed);
+		if (name == "mosaic") return parseValue(value, params.mosaic);
+		if (name == "grid") return parseValue(value, params.grid);
+		if (name == "sigma") return parseValue(value, params.sigma);
+		if (name == "hatch_1") return parseValue(value, params.hatch_1);
+		if (name == "hatch_2") return parseValue(value, params.hatch_2);
+		if (name == "hatch_3") return parseValue(value, params.hatch_3);
+		if (name == "hatch_4") return parseValue(value, params.hatch_4);
+		if (name == "density") return parseValue(value, params.density);
+		if (name == "width") return parseValue(value, params.width);
+		if (name == "color_hatches") return parseValue(value, params.color_hatches);
+		return false;
+	}
+
+	/// <summary>
+	/// Carica una pipeline da file, con uno stage per riga: il nome del filtro seguito da coppie parametro=valore.
+	/// </summary>
+	/// <param name="filename">Nome del file</param>
+	/// <param name="pipeline">Stage caricati</param>
+	/// <param name="error">Messaggio di errore</param>
+	/// <returns>False in caso di errore</returns>
+	bool load_grade_pipeline(const string& filename, vector<grade_stage>& pipeline, string& error) {
+		auto text = string{};
+		if (!load_text(filename, text, error)) return false;
+		pipeline.clear();
+		auto lines = std::istringstream(text);
+		auto line  = string{};
+		for (auto number = 1; std::getline(lines, line); number++) {
+			auto tokens = vector<string>{};
+			auto words  = std::istringstream(line.substr(0, line.find('#')));
+			for (auto token = string{}; words >> token;) tokens.push_back(token);
+			if (tokens.empty()) continue;
+			auto where = filename + ":" + std::to_string(number) + ": ";
+			auto found = std::find(grade_filter_names.begin(), grade_filter_names.end(), tokens[0]);
+			if (found == grade_filter_names.end()) {
+				error = where + "unknown filter " + tokens[0];
+				return false;
+			}
+			auto& stage  = pipeline.emplace_back();
+			stage.filter = (grade_filter)(found - grade_filter_names.begin());
+			for (auto idx = 1; idx < (int)tokens.size(); idx++) {
+				auto split = tokens[idx].find('=');
+				if (stage.filter == grade_filter::lut && tokens[idx].substr(0, split) == "file" && split != string::npos) {
+					auto lut = std::make_shared<grade_lut>();
+					if (!load_grade_lut(path_join(path_dirname(filename), tokens[idx].substr(split + 1)), *lut, error)) return false;
+					stage.lut = lut;
+					continue;
+				}
+				if (split == string::npos ||
+					!setGradeParam(stage.params, tokens[idx].substr(0, split), tokens[idx].substr(split + 1))) {
+					error = where + "invalid parameter " + tokens[idx];
+					return false;
+				}
+			}
+		}
+		return true;
+	}
 }  // namespace yocto
\ No newline at end of file
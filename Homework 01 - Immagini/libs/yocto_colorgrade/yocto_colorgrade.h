@@ -36,6 +36,9 @@
 #include <yocto/yocto_image.h>
 #include <yocto/yocto_math.h>
 
+#include <atomic>
+#include <memory>
+
 // -----------------------------------------------------------------------------
 // COLOR GRADING FUNCTIONS
 // -----------------------------------------------------------------------------
@@ -72,11 +75,121 @@ struct grade_params {
 
   // Kernel offset
   float k_offset = 1.0f;
+
+  // Seed del film grain, il rumore di ogni pixel dipende solo da seed e indice
+  uint64_t seed = 172784;
+  // Grandezza della 3D LUT (33 o 65) in cui vengono cotte tonemap, tint,
+  // saturation e contrast; 0 per calcolarle su ogni pixel
+  int lut = 0;
+  // Disabilita il grading parallelo a tile
+  bool noparallel = false;
 };
 
 // Grading functions
 color_image grade_image(const color_image& image, const grade_params& params);
 
+// 3D LUT di un'operazione sul colore, campionata su una griglia size^3 nel
+// dominio [domain_min, domain_max]. I valori sono ordinati con il rosso che
+// varia pi velocemente, come nei file .cube. Una LUT 1D per canale (shaper),
+// sul dominio shaper_range, pu essere applicata prima della 3D. Con
+// shaper_root i campioni dello shaper sono uniformi nella radice quadrata della
+// posizione nel dominio, e quindi pi fitti vicino al nero; altrimenti sono
+// uniformi.
+struct grade_lut {
+  int           size         = 0;
+  vec3f         domain_min   = {0, 0, 0};
+  vec3f         domain_max   = {1, 1, 1};
+  vector<vec3f> values       = {};
+  vec2f         shaper_range = {0, 1};
+  vector<vec3f> shaper       = {};
+  bool          shaper_root  = false;
+};
+
+// Cuoce tonemap, tint, saturation e contrast in una LUT. Il tonemap agisce su
+// ogni canale separatamente e viene cotto in uno shaper pi fitto vicino al
+// nero, cos la 3D copre solo colori in [0, 1]. I colori fuori da
+// [0, domain_max] vengono portati sul bordo, quindi per immagini HDR
+// domain_max deve coprire i valori dell'immagine.
+grade_lut make_grade_lut(
+    const grade_params& params, int size = 33, float domain_max = 1);
+
+// Massimo dei canali RGB dell'immagine, almeno 1. Usato come domain_max di
+// make_grade_lut, perch le immagini HDR non vengano tagliate.
+float get_grade_lut_domain(const color_image& image);
+
+// Valuta la LUT con interpolazione tetraedrica
+vec3f eval_grade_lut(const grade_lut& lut, const vec3f& rgb);
+
+// Carica e salva una LUT in formato .cube. Il formato con shaper ha un solo
+// intervallo per la 3D, quindi il salvataggio fallisce se il dominio della 3D
+// non  lo stesso su tutti i canali. Il formato ha solo shaper uniformi, quindi
+// uno shaper con shaper_root viene ricampionato in 65536 valori uniformi.
+bool load_grade_lut(const string& filename, grade_lut& lut, string& error);
+bool save_grade_lut(
+    const string& filename, const grade_lut& lut, string& error);
+
+// Filtri del filter graph. Ogni stage legge da grade_params solo i valori del
+// suo filtro, con gli stessi nomi dei campi.
+enum struct grade_filter {
+  // clang-format off
+  tonemap, tint, saturation, contrast, vignette, grain, predator, grid,
+  mosaic, blur, normalize, crosshatching, lut
+  // clang-format on
+};
+
+// Nomi dei filtri, usati nei file di pipeline
+inline const auto grade_filter_names = vector<string>{"tonemap", "tint",
+    "saturation", "contrast", "vignette", "grain", "predator", "grid", "mosaic",
+    "blur", "normalize", "crosshatching", "lut"};
+
+// Tipo di operazione di un filtro: per pixel, sui pixel vicini o sull'intera
+// immagine
+enum struct grade_stage_type { point, neighborhood, global };
+
+// Stage del filter graph. Gli stage lut usano la LUT condivisa.
+struct grade_stage {
+  grade_filter                     filter = grade_filter::tonemap;
+  grade_params                     params = {};
+  std::shared_ptr<const grade_lut> lut    = nullptr;
+};
+
+// Tipo di operazione di un filtro
+grade_stage_type get_stage_type(grade_filter filter);
+
+// Pipeline equivalente ai parametri di grading. Se params.lut  diverso da 0,
+// o se viene passata una LUT, le operazioni sul colore sono sostituite da uno
+// stage lut. La LUT cotta qui copre i colori in [0, 1]; per le immagini HDR va
+// passata una LUT cotta con get_grade_lut_domain.
+vector<grade_stage> make_grade_pipeline(const grade_params& params,
+    std::shared_ptr<const grade_lut> lut = nullptr);
+
+// Applica una pipeline di stage nell'ordine dato. Le operazioni per pixel
+// consecutive sono fuse in un solo passaggio, e un buffer in pi viene allocato
+// solo per gli stage che non possono lavorare in place. Se stop diventa true il
+// grading si interrompe tra gli stage o tra tile e righe, e l'immagine
+// restituita  incompleta.
+color_image grade_image(const color_image& image,
+    const vector<grade_stage>& pipeline, bool noparallel = false,
+    const std::atomic<bool>* stop = nullptr);
+
+// Vero se la pipeline contiene solo stage per pixel e mosaici, e quindi pu
+// essere applicata per regioni con grade_region.
+bool is_region_gradable(const vector<grade_stage>& pipeline);
+
+// Applica la pipeline ai soli pixel in [start, end), scrivendoli in graded che
+// ha la size dell'immagine, con lo stesso risultato di grade_image. Serve per
+// il grading progressivo a tile; restituisce false, senza scrivere nulla, se la
+// pipeline non  applicabile per regioni, vedi is_region_gradable.
+bool grade_region(color_image& graded, const color_image& image,
+    const vector<grade_stage>& pipeline, vec2i start, vec2i end);
+
+// Carica una pipeline da un file di testo, con uno stage per riga nella forma
+// `filtro parametro=valore ...`. Le righe vuote e i commenti # sono ignorati.
+// Gli stage lut caricano un file .cube con `lut file=look.cube`, relativo al
+// file della pipeline.
+bool load_grade_pipeline(
+    const string& filename, vector<grade_stage>& pipeline, string& error);
+
 };  // namespace yocto
 
 #endif
@@ -964,6 +964,20 @@ void set_image(glimage_state& glimage, const image_data& image) {
   glimage.height = image.height;
 }
 
+void set_image_region(glimage_state& glimage, const image_data& image,
+    const vec2i& start, const vec2i& end) {
+  if (!glimage.texture || glimage.width != image.width ||
+      glimage.height != image.height) {
+    return set_image(glimage, image);
+  }
+  glBindTexture(GL_TEXTURE_2D, glimage.texture);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, image.width);
+  glTexSubImage2D(GL_TEXTURE_2D, 0, start.x, start.y, end.x - start.x,
+      end.y - start.y, GL_RGBA, GL_FLOAT,
+      image.pixels.data() + (size_t)start.y * image.width + start.x);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+}
+
 // draw image
 void draw_image(glimage_state& glimage, const glimage_params& params) {
   // check errors
@@ -121,6 +121,10 @@ void clear_image(glimage_state& glimage);
 // update image data
 void set_image(glimage_state& glimage, const image_data& image);
 
+// update the image data in the region [start, end) only
+void set_image_region(glimage_state& glimage, const image_data& image,
+    const vec2i& start, const vec2i& end);
+
 // OpenGL image drawing params
 struct glimage_params {
   vec2i window      = {512, 512};
@@ -0,0 +1,239 @@
+//
+// LICENSE:
+//
+// Copyright (c) 2016 -- 2021 Fabio Pellacini
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+// this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+// this list of conditions and the following disclaimer in the documentation
+// and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include <yocto/yocto_cli.h>
+#include <yocto/yocto_image.h>
+#include <yocto/yocto_math.h>
+#include <yocto/yocto_scene.h>
+#include <yocto/yocto_sceneio.h>
+#include <yocto_raytrace/yocto_raytrace.h>
+using namespace yocto;
+
+// Test scenes of the benchmark, with the bounces used by scripts/run.sh
+struct bench_scene {
+  string name     = "";
+  string filename = "";
+  int    bounces  = 4;
+};
+const auto bench_scenes = vector<bench_scene>{
+    {"01_cornellbox", "01_cornellbox/cornellbox.json", 4},
+    {"02_matte", "02_matte/matte.json", 4},
+    {"03_texture", "03_texture/texture.json", 4},
+    {"04_envlight", "04_envlight/envlight.json", 4},
+    {"05_arealight", "05_arealight/arealight.json", 4},
+    {"06_metal", "06_metal/metal.json", 4},
+    {"07_plastic", "07_plastic/plastic.json", 4},
+    {"08_glass", "08_glass/glass.json", 8},
+    {"09_opacity", "09_opacity/opacity.json", 4},
+    {"10_hair", "10_hair/hair.json", 4},
+    {"11_bathroom1", "11_bathroom1/bathroom1.json", 8},
+    {"12_ecosys", "12_ecosys/ecosys.json", 4},
+};
+
+// Error of a render against a reference. The relative MSE divides each
+// squared error by the squared reference plus a small constant, so that
+// dark and bright regions weigh alike.
+struct bench_error {
+  double rmse   = 0;
+  double relmse = 0;
+};
+bench_error compute_error(
+    const color_image& image, const color_image& reference) {
+  auto mse = 0.0, relmse = 0.0;
+  for (auto idx = 0; idx < (int)image.pixels.size(); idx++) {
+    auto value = xyz(image.pixels[idx]), expected = xyz(reference.pixels[idx]);
+    for (auto c = 0; c < 3; c++) {
+      auto error = (double)value[c] - (double)expected[c];
+      mse += error * error;
+      relmse += error * error / ((double)expected[c] * expected[c] + 0.01);
+    }
+  }
+  auto count = max((double)image.pixels.size() * 3, 1.0);
+  return {std::sqrt(mse / count), relmse / count};
+}
+
+// Format a number for json, writing null for missing values
+string format_json(double value, bool valid = true) {
+  if (!valid || !std::isfinite(value)) return "null";
+  auto buffer = array<char, 64>{};
+  snprintf(buffer.data(), buffer.size(), "%.6g", value);
+  return buffer.data();
+}
+
+// Benchmark the test scenes, timing load, bvh build and render at a fixed
+// number of samples, and comparing the renders to high-sample references.
+// The time to quality is the render time that reaches the target relative
+// MSE, assuming that the error is inversely proportional to the time.
+void run(const vector<string>& args) {
+  // command line parameters
+  auto params            = raytrace_params{};
+  auto testsdir          = "tests"s;
+  auto referencesdir     = "tests/references"s;
+  auto output            = "bench.json"s;
+  auto scenes            = ""s;
+  auto make_references   = false;
+  auto reference_samples = 4096;
+  auto target_relmse     = 0.001f;
+  params.shader          = raytrace_shader_type::pathtrace;
+  params.samples         = 64;
+  params.resolution      = 360;
+
+  // command line parsing
+  auto error = string{};
+  auto cli   = make_cli("ybench", "Benchmark the test scenes.");
+  add_option(cli, "tests", testsdir, "Test scenes directory.");
+  add_option(cli, "references", referencesdir, "References directory.");
+  add_option(cli, "output", output, "Output json filename.");
+  add_option(cli, "scenes", scenes, "Only scenes whose name contains this.");
+  add_option(cli, "make-references", make_references, "Render the references.");
+  add_option(cli, "reference-samples", reference_samples, "Reference samples.", {1, 1 << 20});
+  add_option(cli, "target-relmse", target_relmse, "Relative MSE for time to quality.", {0, 1});
+  add_option(cli, "resolution", params.resolution, "Image resolution.", {1, 4096});
+  add_option(cli, "shader", params.shader, "Shader type.", raytrace_shader_names);
+  add_option(cli, "samples", params.samples, "Number of samples.", {1, 4096});
+  add_option(cli, "batch", params.batch, "Samples per dispatch.", {1, 4096});
+  add_option(cli, "sortrays", params.sortrays, "Sort secondary rays by bounce.");
+  add_option(cli, "highqualitybvh", params.highqualitybvh, "Use SAH bvh build.");
+  add_option(cli, "bvhwidth", params.bvhwidth, "Bvh width (2, 4 or 8).", {2, 8});
+  add_option(cli, "trianglecache", params.trianglecache, "Cache bvh triangles.");
+  add_option(cli, "mipmaps", params.mipmaps, "Filter textures with mipmaps.");
+  if (!parse_cli(cli, args, error)) print_fatal(error);
+  if (!check_params(params, error)) print_fatal(error);
+
+  // render references
+  if (make_references) {
+    if (!make_directory(referencesdir, error)) print_fatal(error);
+    for (auto& bench : bench_scenes) {
+      if (bench.name.find(scenes) == string::npos) continue;
+      auto scene = scene_data{};
+      if (!load_scene(path_join(testsdir, bench.filename), scene, error)) {
+        print_info(bench.name + ": skipped, " + error);
+        continue;
+      }
+      auto rparams    = params;
+      rparams.samples = reference_samples;
+      rparams.bounces = bench.bounces;
+      auto bvh        = make_bvh(scene, rparams);
+      auto state      = make_state(scene, rparams);
+      print_progress_begin(bench.name, rparams.samples);
+      while (state.samples < rparams.samples) {
+        raytrace_samples(state, scene, bvh, rparams);
+        print_progress(bench.name, state.samples, rparams.samples);
+      }
+      auto filename = path_join(referencesdir, bench.name + ".exr");
+      if (!save_image(filename, get_render(state), error)) print_fatal(error);
+    }
+    return;
+  }
+
+  // benchmark scenes
+  auto results = vector<string>{};
+  for (auto& bench : bench_scenes) {
+    if (bench.name.find(scenes) == string::npos) continue;
+    auto bparams    = params;
+    bparams.bounces = bench.bounces;
+
+    // load, skipping scenes whose assets are missing
+    auto timer = simple_timer{};
+    auto scene = scene_data{};
+    if (!load_scene(path_join(testsdir, bench.filename), scene, error)) {
+      print_info(bench.name + ": skipped, " + error);
+      continue;
+    }
+    if (bparams.mipmaps) make_texture_mipmaps(scene);
+    auto load_time = elapsed_nanoseconds(timer);
+
+    // bvh
+    start_timer(timer);
+    auto bvh      = make_bvh(scene, bparams);
+    auto bvh_time = elapsed_nanoseconds(timer);
+
+    // render
+    auto state = make_state(scene, bparams);
+    start_timer(timer);
+    while (state.samples < bparams.samples) {
+      raytrace_samples(state, scene, bvh, bparams);
+    }
+    auto render_time = elapsed_nanoseconds(timer);
+    auto render      = get_render(state);
+
+    // error against the reference, if any
+    auto reference_name = path_join(referencesdir, bench.name + ".exr");
+    auto reference      = color_image{};
+    auto has_reference  = path_exists(reference_name);
+    if (has_reference && !load_image(reference_name, reference, error))
+      print_fatal(error);
+    if (has_reference && (reference.width != render.width ||
+                             reference.height != render.height))
+      print_fatal(reference_name + ": reference has a different resolution");
+    auto errors = has_reference ? compute_error(render, reference)
+                                : bench_error{};
+
+    // result, with times in seconds
+    auto render_seconds = render_time * 1e-9;
+    auto samples        = (double)get_samples(state);
+    auto rays           = (double)state.counters.rays;
+    auto result         = "    {\"name\": \"" + bench.name + "\"";
+    auto add_value      = [&](const string& name, double value, bool valid) {
+      result += ", \"" + name + "\": " + format_json(value, valid);
+    };
+    add_value("load", load_time * 1e-9, true);
+    add_value("bvh", bvh_time * 1e-9, true);
+    add_value("render", render_seconds, true);
+    add_value("msamples", samples / render_seconds / 1e6, true);
+    add_value("mrays", rays / render_seconds / 1e6, rays > 0);
+    add_value("rmse", errors.rmse, has_reference);
+    add_value("relmse", errors.relmse, has_reference);
+    add_value("time_to_quality",
+        render_seconds * errors.relmse / target_relmse, has_reference);
+    result += "}";
+    results.push_back(result);
+    print_info(bench.name + ": load " + format_duration(load_time) +
+               ", bvh " + format_duration(bvh_time) + ", render " +
+               format_duration(render_time) +
+               (has_reference ? ", relmse " + format_json(errors.relmse)
+                              : ", no reference"));
+  }
+
+  // save results
+  auto json = "{\n  \"shader\": \"" +
+              raytrace_shader_names[(int)params.shader] + "\",\n" +
+              "  \"resolution\": " + std::to_string(params.resolution) +
+              ",\n  \"samples\": " + std::to_string(params.samples) +
+              ",\n  \"target_relmse\": " + format_json(target_relmse) +
+              ",\n  \"scenes\": [\n";
+  for (auto idx = 0; idx < (int)results.size(); idx++) {
+    json += results[idx] + (idx + 1 < (int)results.size() ? ",\n" : "\n");
+  }
+  json += "  ]\n}\n";
+  if (!save_text(output, json, error)) print_fatal(error);
+}
+
+int main(int argc, const char* argv[]) {
+  handle_errors(run, make_cli_args(argc, argv));
+}
@@ -0,0 +1,76 @@
+//
+// LICENSE:
+//
+// Copyright (c) 2016 -- 2021 Fabio Pellacini
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+// this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+// this list of conditions and the following disclaimer in the documentation
+// and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include <yocto/yocto_cli.h>
+#include <yocto/yocto_image.h>
+#include <yocto/yocto_sceneio.h>
+using namespace yocto;
+
+// Merge images rendered by yraytrace for disjoint regions of the same frame.
+// Each image is frame sized, with zeros outside its region, so merging adds
+// the images together.
+void run(const vector<string>& args) {
+  // command line parameters
+  auto filenames = vector<string>{};
+  auto output    = "image.exr"s;
+
+  // command line parsing
+  auto error = string{};
+  auto cli   = make_cli("yimagemerge", "Merge region renders.");
+  add_option(cli, "output", output, "Output filename.");
+  add_argument(cli, "images", filenames, "Region images.");
+  if (!parse_cli(cli, args, error)) print_fatal(error);
+
+  // merge images
+  auto merged = image_data{};
+  print_progress_begin("merge images", (int)filenames.size());
+  for (auto& filename : filenames) {
+    auto image = image_data{};
+    if (!load_image(filename, image, error)) print_fatal(error);
+    if (merged.pixels.empty()) {
+      merged = image;
+    } else if (image.width != merged.width || image.height != merged.height ||
+               image.linear != merged.linear) {
+      print_fatal(filename + ": images should have the same size and type");
+    } else {
+      for (auto idx = 0; idx < (int)merged.pixels.size(); idx++) {
+        merged.pixels[idx] += image.pixels[idx];
+      }
+    }
+    print_progress_next();
+  }
+
+  // save image
+  print_progress_begin("save image");
+  if (!save_image(output, merged, error)) print_fatal(error);
+  print_progress_end();
+}
+
+int main(int argc, const char* argv[]) {
+  handle_errors(run, make_cli_args(argc, argv));
+}
@@ -0,0 +1,223 @@
+//
+// LICENSE:
+//
+// Copyright (c) 2016 -- 2021 Fabio Pellacini
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+// this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+// this list of conditions and the following disclaimer in the documentation
+// and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include <yocto/yocto_cli.h>
+#include <yocto/yocto_sampling.h>
+#include <yocto/yocto_sceneio.h>
+#include <yocto/yocto_shape.h>
+#include <yocto/yocto_trace.h>
+using namespace yocto;
+
+// Make a city block with many small emitters. Buildings are boxes on a grid,
+// and the lights are windows on their facades, so that most lights are
+// occluded or face away from most points.
+scene_data make_city_scene(int num_lights, uint64_t seed) {
+  auto scene = scene_data{};
+  auto rng   = make_rng(seed);
+
+  auto& camera    = scene.cameras.emplace_back();
+  camera.frame    = lookat_frame({0, 12, 24}, {0, 0, 0}, {0, 1, 0});
+  camera.lens     = 0.035f;
+  camera.aperture = 0;
+  camera.focus    = 27;
+  camera.film     = 0.036f;
+  camera.aspect   = 16.0f / 9.0f;
+
+  scene.shapes.push_back(make_floor({1, 1}, {40, 40}));
+  scene.materials.emplace_back().color = {0.4f, 0.4f, 0.4f};
+  auto& floor_instance    = scene.instances.emplace_back();
+  floor_instance.shape    = (int)scene.shapes.size() - 1;
+  floor_instance.material = (int)scene.materials.size() - 1;
+
+  // buildings on a grid
+  auto blocks         = 8;
+  auto building_shape = (int)scene.shapes.size();
+  scene.shapes.push_back(make_box({1, 1, 1}, {1, 1, 1}));
+  auto building_material = (int)scene.materials.size();
+  scene.materials.emplace_back().color = {0.6f, 0.55f, 0.5f};
+  auto heights = vector<float>{};
+  for (auto j = 0; j < blocks; j++) {
+    for (auto i = 0; i < blocks; i++) {
+      auto  height   = 1 + 5 * rand1f(rng);
+      auto& instance = scene.instances.emplace_back();
+      instance.frame = translation_frame(
+                           {(i - blocks / 2 + 0.5f) * 4, height,
+                               (j - blocks / 2 + 0.5f) * 4}) *
+                       scaling_frame({1.2f, height, 1.2f});
+      instance.shape    = building_shape;
+      instance.material = building_material;
+      heights.push_back(height);
+    }
+  }
+
+  // windows on random facades, with a few emission colors
+  auto window_shape = (int)scene.shapes.size();
+  scene.shapes.push_back(make_rect({1, 1}, {0.1f, 0.1f}));
+  auto window_material = (int)scene.materials.size();
+  for (auto color : {vec3f{1, 0.8f, 0.5f}, vec3f{0.6f, 0.8f, 1},
+           vec3f{1, 0.5f, 0.3f}, vec3f{0.9f, 0.9f, 0.9f}}) {
+    scene.materials.emplace_back().emission = color * 40;
+  }
+  for (auto light = 0; light < num_lights; light++) {
+    auto  block    = (int)(rand1f(rng) * blocks * blocks) % (blocks * blocks);
+    auto  side     = (int)(rand1f(rng) * 4) % 4;
+    auto  center   = vec3f{(block % blocks - blocks / 2 + 0.5f) * 4, 0,
+        (block / blocks - blocks / 2 + 0.5f) * 4};
+    auto  offset   = (rand1f(rng) - 0.5f) * 2;
+    auto  height   = (0.05f + 0.9f * rand1f(rng)) * 2 * heights[block];
+    auto  rotation = rotation_frame({0, 1, 0}, side * pif / 2);
+    auto& instance = scene.instances.emplace_back();
+    instance.frame = translation_frame(center + vec3f{0, height, 0}) *
+                     rotation * translation_frame({offset, 0, 1.21f});
+    instance.shape    = window_shape;
+    instance.material = window_material + light % 4;
+  }
+
+  return scene;
+}
+
+// Compare light element sampling with cdfs and alias tables on a scene, at
+// equal time. The error is measured against a reference with more samples.
+void run_elements(
+    const string& filename, const trace_params& params, float seconds) {
+  auto error = string{};
+  auto scene = scene_data{};
+  if (!load_scene(filename, scene, error)) print_fatal(error);
+  auto bvh = make_bvh(scene, params);
+
+  // reference, with a different seed than the timed renders
+  auto rparams    = params;
+  rparams.seed    = params.seed + 1;
+  rparams.samples = params.samples * 16;
+  auto rlights    = make_lights(scene, rparams);
+  auto reference  = make_state(scene, rparams);
+  while (reference.samples < rparams.samples) {
+    trace_samples(reference, scene, bvh, rlights, rparams);
+  }
+
+  auto configs = vector<pair<bool, int>>{{false, 1}, {true, 1}};
+  if (params.envcellsize > 1) configs.push_back({true, params.envcellsize});
+  for (auto [alias, cellsize] : configs) {
+    auto lparams        = params;
+    lparams.lightsalias = alias;
+    lparams.envcellsize = cellsize;
+    lparams.samples     = 1 << 20;
+    auto lights         = make_lights(scene, lparams);
+    auto state          = make_state(scene, lparams);
+    auto timer          = simple_timer{};
+    while (elapsed_seconds(timer) < seconds) {
+      trace_samples(state, scene, bvh, lights, lparams);
+    }
+    stop_timer(timer);
+    auto mse = 0.0;
+    for (auto idx = (size_t)0; idx < state.image.size(); idx++) {
+      auto diff = xyz(state.image[idx]) / (float)state.samples -
+                  xyz(reference.image[idx]) / (float)reference.samples;
+      mse += dot(diff, diff) / 3;
+    }
+    mse /= state.image.size();
+    auto rate = state.samples * state.image.size() / elapsed_seconds(timer);
+    print_info(string{alias ? "alias" : "cdf  "} + " cells " +
+               std::to_string(cellsize) + ": " +
+               std::to_string(state.samples) + " samples, " +
+               std::to_string((int64_t)rate) + " samples/s, mse " +
+               std::to_string(mse));
+  }
+}
+
+// Time many-light renders with and without the light tree, over scenes with
+// an increasing number of lights. With a scene, compares instead light
+// element sampling at equal time.
+void run(const vector<string>& args) {
+  // command line parameters
+  auto params       = trace_params{};
+  auto maxlights    = 4096;
+  auto scenesdir    = ""s;
+  auto stats        = false;
+  auto filename     = ""s;
+  auto seconds      = 10.0f;
+  params.sampler    = trace_sampler_type::pathmis;
+  params.samples    = 16;
+  params.resolution = 320;
+
+  // command line parsing
+  auto error = string{};
+  auto cli   = make_cli("ylightsbench", "Benchmark many-light sampling.");
+  add_option(cli, "resolution", params.resolution, "Image resolution.", {1, 4096});
+  add_option(cli, "sampler", params.sampler, "Sampler type.", trace_sampler_names);
+  add_option(cli, "samples", params.samples, "Number of samples.", {1, 4096});
+  add_option(cli, "batch", params.batch, "Samples per dispatch.", {1, 4096});
+  add_option(cli, "bounces", params.bounces, "Number of bounces.", {1, 128});
+  add_option(cli, "max-lights", maxlights, "Maximum number of lights.", {1, 1 << 20});
+  add_option(cli, "scenes", scenesdir, "Save the scenes in this directory.");
+  add_option(cli, "stats", stats, "Print ray tracing counters.");
+  add_option(cli, "scene", filename, "Compare element sampling on a scene.");
+  add_option(cli, "seconds", seconds, "Time per render with a scene.", {0, 3600});
+  add_option(cli, "env-cellsize", params.envcellsize, "Environment cell size.", {1, 64});
+  if (!parse_cli(cli, args, error)) print_fatal(error);
+  if (!filename.empty()) return run_elements(filename, params, seconds);
+
+  for (auto num_lights = 1; num_lights <= maxlights; num_lights *= 4) {
+    auto scene = make_city_scene(num_lights, params.seed);
+    if (!scenesdir.empty()) {
+      auto filename = path_join(
+          scenesdir, "city" + std::to_string(num_lights) + ".json");
+      if (!make_scene_directories(filename, scene, error)) print_fatal(error);
+      if (!save_scene(filename, scene, error)) print_fatal(error);
+    }
+    auto bvh = make_bvh(scene, params);
+    for (auto lighttree : {false, true}) {
+      auto lparams      = params;
+      lparams.lighttree = lighttree;
+      auto lights       = make_lights(scene, lparams);
+      auto state        = make_state(scene, lparams);
+      auto timer        = simple_timer{};
+      while (state.samples < lparams.samples) {
+        trace_samples(state, scene, bvh, lights, lparams);
+      }
+      stop_timer(timer);
+      auto average = vec4f{0, 0, 0, 0};
+      for (auto& pixel : state.image) average += pixel;
+      average /= (float)(state.image.size() * state.samples);
+      print_info(std::to_string(num_lights) + " lights, " +
+                 (lighttree ? "tree:    " : "uniform: ") +
+                 elapsed_formatted(timer) + ", mean " +
+                 std::to_string(mean(xyz(average))));
+      if (stats) {
+        print_info("  stats: " + format_bvh_counters(state.counters,
+                                     elapsed_seconds(timer)));
+        if (lparams.sampler == trace_sampler_type::wavefront)
+          print_info("  stages: " + format_wavefront_stats(state.wavefront));
+      }
+    }
+  }
+}
+
+int main(int argc, const char* argv[]) {
+  handle_errors(run, make_cli_args(argc, argv));
+}
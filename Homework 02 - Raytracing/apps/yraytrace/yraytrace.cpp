@@ -36,9 +36,29 @@
 #include <yocto_raytrace/yocto_raytrace.h>
 using namespace yocto;
 
-// render scene offline
+// Place the render of a region in an image of the size of the frame, with
+// the pixels outside the region left at zero, so that the renders of disjoint
+// regions can be merged by adding them.
+color_image get_frame_render(const raytrace_state& state) {
+  auto render = get_render(state);
+  if (state.width == state.frame.x && state.height == state.frame.y)
+    return render;
+  auto image = make_image(state.frame.x, state.frame.y, true);
+  for (auto j = 0; j < state.height; j++) {
+    for (auto i = 0; i < state.width; i++) {
+      image.pixels[(state.offset.y + j) * image.width + state.offset.x + i] =
+          render.pixels[j * render.width + i];
+    }
+  }
+  return image;
+}
+
+// render scene offline, stopping after `timebudget` seconds if positive and
+// saving a checkpoint every `interval` seconds if `checkpoint` is given, and
+// printing the ray tracing counters if `counters` is set
 void run_offline(const string& filename, const string& output,
-    const raytrace_params& params_) {
+    const raytrace_params& params_, const string& checkpoint, bool resume,
+    float timebudget, float interval, bool counters) {
   // copy params
   auto params = params_;
 
@@ -49,6 +69,32 @@ void run_offline(const string& filename, const string& output,
   if (!load_scene(filename, scene, error)) print_fatal(error);
   print_progress_end();
 
+  // texture mipmaps
+  if (params.mipmaps) {
+    print_progress_begin("build mipmaps");
+    make_texture_mipmaps(scene, params.noparallel);
+    print_progress_end();
+  }
+
+  // texture compression
+  if (params.compression != texture_compression::none) {
+    print_progress_begin("compress textures");
+    auto bytes = get_texture_bytes(scene);
+    compress_textures(scene, params.compression, params.noparallel);
+    print_progress_end();
+    print_info("textures: " + format_num(get_texture_bytes(scene)) +
+               " bytes, from " + format_num(bytes) + " bytes");
+  }
+
+  // texture cache
+  if (params.texturecache > 0) {
+    print_progress_begin("build texture cache");
+    if (!make_texture_cache(
+            scene, (int64_t)params.texturecache << 20, error))
+      print_fatal(error);
+    print_progress_end();
+  }
+
   // camera
   // params.camera = find_camera(scene, params.camname);
 
@@ -57,21 +103,97 @@ void run_offline(const string& filename, const string& output,
   auto bvh = make_bvh(scene, params);
   print_progress_end();
 
+  // bvh statistics, with the shape bvhs summed together
+  auto stats        = get_bvh_stats(bvh);
+  auto shapes_stats = bvh_stats{};
+  for (auto& shape_bvh : bvh.shapes) {
+    auto shape_stats = get_bvh_stats(shape_bvh);
+    shapes_stats.nodes += shape_stats.nodes;
+    shapes_stats.bytes += shape_stats.bytes;
+    shapes_stats.cache_bytes += shape_stats.cache_bytes;
+    shapes_stats.depth = max(shapes_stats.depth, shape_stats.depth);
+    shapes_stats.sah_cost += shape_stats.sah_cost;
+  }
+  print_info("bvh: " + format_duration(stats.build_time) + ", " +
+             format_num(stats.nodes + shapes_stats.nodes) + " nodes, " +
+             format_num(stats.bytes + shapes_stats.bytes) + " bytes, depth " +
+             std::to_string(stats.depth) + " + " +
+             std::to_string(shapes_stats.depth) + ", sah cost " +
+             std::to_string(stats.sah_cost) + " + " +
+             std::to_string(shapes_stats.sah_cost) + ", triangle cache " +
+             format_num(stats.cache_bytes + shapes_stats.cache_bytes) +
+             " bytes");
+
   // state
   print_progress_begin("init state");
   auto state = make_state(scene, params);
   print_progress_end();
 
+  // resume
+  if (resume) {
+    print_progress_begin("load checkpoint");
+    if (!load_state(checkpoint, state, scene, params, error))
+      print_fatal(error);
+    print_progress_end();
+  }
+
   // render
+  auto timer            = simple_timer{};
+  auto checkpoint_timer = simple_timer{};
   print_progress_begin("render image", params.samples);
-  for (auto sample = 0; sample < params.samples; sample++) {
+  print_progress("render image", state.samples, params.samples);
+  while (state.samples < params.samples) {
+    if (timebudget > 0 && elapsed_seconds(timer) >= timebudget) {
+      print_progress_end();
+      print_info("time budget reached at " + std::to_string(state.samples) +
+                 " samples");
+      break;
+    }
     raytrace_samples(state, scene, bvh, params);
-    print_progress_next();
+    print_progress("render image", state.samples, params.samples);
+    if (!checkpoint.empty() && elapsed_seconds(checkpoint_timer) >= interval) {
+      if (!save_state(checkpoint, state, scene, params, error))
+        print_fatal(error);
+      start_timer(checkpoint_timer);
+    }
+  }
+
+  // ray tracing counters
+  if (counters)
+    print_info("stats: " + format_bvh_counters(
+                              state.counters, elapsed_seconds(timer)));
+
+  // texture cache statistics, to size the cache
+  if (params.texturecache > 0) {
+    auto stats    = get_texture_cache_stats(scene);
+    auto requests = std::max(stats.hits + stats.misses, (int64_t)1);
+    print_info("texture cache: " + format_num(stats.hits) + " hits, " +
+               format_num(stats.misses) + " misses (" +
+               std::to_string(100 * stats.misses / requests) + "%), " +
+               format_num(stats.evictions) + " evictions, peak " +
+               format_num(stats.peak) + " of " + format_num(stats.budget) +
+               " bytes, " + format_num(stats.size) + " bytes tiled");
+  }
+
+  // save checkpoint
+  if (!checkpoint.empty()) {
+    print_progress_begin("save checkpoint");
+    if (!save_state(checkpoint, state, scene, params, error))
+      print_fatal(error);
+    print_progress_end();
+  }
+
+  // samples statistics, against the uniform budget
+  if (params.adaptive > 0) {
+    auto budget = (int64_t)state.width * state.height * params.samples;
+    print_info("samples: " + format_num(get_samples(state)) + " of " +
+               format_num(budget) + " (" +
+               std::to_string(100 * get_samples(state) / budget) + "%)");
   }
 
   // save image
   print_progress_begin("save image");
-  if (!save_image(output, get_render(state), error)) print_fatal(error);
+  if (!save_image(output, get_frame_render(state), error)) print_fatal(error);
   print_progress_end();
 }
 
@@ -88,6 +210,32 @@ void run_interactive(const string& filename, const string& output,
   if (!load_scene(filename, scene, error)) print_fatal(error);
   print_progress_end();
 
+  // texture mipmaps
+  if (params.mipmaps) {
+    print_progress_begin("build mipmaps");
+    make_texture_mipmaps(scene, params.noparallel);
+    print_progress_end();
+  }
+
+  // texture compression
+  if (params.compression != texture_compression::none) {
+    print_progress_begin("compress textures");
+    auto bytes = get_texture_bytes(scene);
+    compress_textures(scene, params.compression, params.noparallel);
+    print_progress_end();
+    print_info("textures: " + format_num(get_texture_bytes(scene)) +
+               " bytes, from " + format_num(bytes) + " bytes");
+  }
+
+  // texture cache
+  if (params.texturecache > 0) {
+    print_progress_begin("build texture cache");
+    if (!make_texture_cache(
+            scene, (int64_t)params.texturecache << 20, error))
+      print_fatal(error);
+    print_progress_end();
+  }
+
   // camera
   // params.camera = find_camera(scene, params.camname);
 
@@ -134,15 +282,18 @@ void run_interactive(const string& filename, const string& output,
     render_worker = {};
     render_stop   = false;
 
-    // preview
+    // preview of the whole frame, since the region is in full resolution
+    // pixels, sampled at the frame position of the region pixels
     auto pparams = params;
     pparams.resolution /= params.pratio;
     pparams.samples = 1;
+    pparams.region  = {0, 0, 0, 0};
     auto pstate     = make_state(scene, pparams);
     raytrace_samples(pstate, scene, bvh, pparams);
     auto preview = get_render(pstate);
     for (auto idx = 0; idx < state.width * state.height; idx++) {
-      auto i = idx % render.width, j = idx / render.width;
+      auto i = idx % render.width + state.offset.x,
+           j = idx / render.width + state.offset.y;
       auto pi            = clamp(i / params.pratio, 0, preview.width - 1),
            pj            = clamp(j / params.pratio, 0, preview.height - 1);
       render.pixels[idx] = preview.pixels[pj * preview.width + pi];
@@ -158,7 +309,7 @@ void run_interactive(const string& filename, const string& output,
 
     // start renderer
     render_worker = std::async(std::launch::async, [&]() {
-      for (auto sample = 0; sample < params.samples; sample += 1) {
+      while (state.samples < params.samples) {
         if (render_stop) return;
         raytrace_samples(state, scene, bvh, params);
         if (!render_stop) {
@@ -283,6 +434,11 @@ void run(const vector<string>& args) {
   auto filename    = "scene.json"s;
   auto output      = "image.png"s;
   auto interactive = false;
+  auto checkpoint  = ""s;
+  auto resume      = false;
+  auto timebudget  = 0.0f;
+  auto interval    = 600.0f;
+  auto stats       = false;
 
   // command line parsing
   auto error = string{};
@@ -294,13 +450,34 @@ void run(const vector<string>& args) {
   add_option( cli, "shader", params.shader, "Shader type.", raytrace_shader_names);
   add_option(cli, "samples", params.samples, "Number of samples.", {1, 4096});
   add_option(cli, "bounces", params.bounces, "Number of bounces.", {1, 8});
+  add_option(cli, "roulette", params.roulette, "Russian roulette bounce.", {0, 128});
+  add_option(cli, "tile-size", params.tilesize, "Tile size.", {1, 256});
+  add_option(cli, "batch", params.batch, "Samples per dispatch.", {1, 4096});
+  add_option(cli, "sortrays", params.sortrays, "Sort secondary rays by bounce.");
+  add_option(cli, "highqualitybvh", params.highqualitybvh, "Use SAH bvh build.");
+  add_option(cli, "bvhwidth", params.bvhwidth, "Bvh width (2, 4 or 8).", {2, 8});
+  add_option(cli, "trianglecache", params.trianglecache, "Cache bvh triangles.");
+  add_option(cli, "mipmaps", params.mipmaps, "Filter textures with mipmaps.");
+  add_option(cli, "texture-compression", params.compression, "Texture compression.", texture_compression_names);
+  add_option(cli, "texture-cache-mb", params.texturecache, "Texture cache size in MB, 0 to disable.", {0, 1 << 20});
+  add_option(cli, "adaptive-threshold", params.adaptive, "Adaptive sampling relative error.", {0, 1});
+  add_option(cli, "adaptive-warmup", params.adaptivewarmup, "Samples before adaptive stopping.", {2, 4096});
+  add_option(cli, "region", params.region, "Render region x0 y0 x1 y1.", {0, 65536});
   add_option(cli, "noparallel", params.noparallel, "Disable threading.");
+  add_option(cli, "time-budget", timebudget, "Render time limit in seconds.");
+  add_option(cli, "checkpoint", checkpoint, "Checkpoint filename.");
+  add_option(cli, "checkpoint-interval", interval, "Seconds between checkpoints.");
+  add_option(cli, "resume", resume, "Resume from the checkpoint.");
+  add_option(cli, "stats", stats, "Print ray tracing counters.");
   add_option(cli, "wet", params.wet, "Enable wet effect");
   if (!parse_cli(cli, args, error)) print_fatal(error);
+  if (!check_params(params, error)) print_fatal(error);
 
   // run
   if (!interactive) {
-    run_offline(filename, output, params);
+    if (resume && checkpoint.empty()) print_fatal("resume needs a checkpoint");
+    run_offline(filename, output, params, checkpoint, resume, timebudget,
+        interval, stats);
   } else {
     run_interactive(filename, output, params);
   }
@@ -35,8 +35,10 @@
 #include <algorithm>
 #include <array>
 #include <atomic>
+#include <chrono>
 #include <cstring>
 #include <memory>
+#include <mutex>
 #include <stdexcept>
 #include <string>
 #include <utility>
@@ -62,6 +64,115 @@ using namespace std::string_literals;
 
 }  // namespace yocto
 
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION FOR BVH COUNTERS
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Counters of each thread. They are constant initialized, so that accessing
+// them needs no guard, and registered on first use in a global list that
+// collect_bvh_counters sums over. Exiting threads move their counts to the
+// retired ones.
+static thread_local bvh_counters bvh_thread_counters   = {};
+static thread_local bool         bvh_thread_registered = false;
+static std::mutex                bvh_counters_mutex    = {};
+static vector<bvh_counters*>     bvh_counters_threads  = {};
+static bvh_counters              bvh_counters_retired  = {};
+
+// Add counters
+static void add_counters(bvh_counters& counters, const bvh_counters& other) {
+  counters.rays += other.rays;
+  counters.nodes += other.nodes;
+  counters.primitives += other.primitives;
+  counters.traversal += other.traversal;
+  counters.samples += other.samples;
+  counters.sampling += other.sampling;
+  counters.shades += other.shades;
+}
+
+// Registration of the counters of a thread, for its lifetime
+struct bvh_counters_registration {
+  bvh_counters_registration() {
+    auto lock = std::lock_guard{bvh_counters_mutex};
+    bvh_counters_threads.push_back(&bvh_thread_counters);
+  }
+  ~bvh_counters_registration() {
+    auto lock = std::lock_guard{bvh_counters_mutex};
+    add_counters(bvh_counters_retired, bvh_thread_counters);
+    bvh_counters_threads.erase(std::find(bvh_counters_threads.begin(),
+        bvh_counters_threads.end(), &bvh_thread_counters));
+  }
+};
+
+bvh_counters& get_bvh_counters() {
+  if (!bvh_thread_registered) {
+    static thread_local auto registration = bvh_counters_registration{};
+    bvh_thread_registered                 = true;
+  }
+  return bvh_thread_counters;
+}
+
+void collect_bvh_counters(bvh_counters& counters) {
+  auto lock = std::lock_guard{bvh_counters_mutex};
+  add_counters(counters, bvh_counters_retired);
+  bvh_counters_retired = {};
+  for (auto thread_counters : bvh_counters_threads) {
+    add_counters(counters, *thread_counters);
+    *thread_counters = {};
+  }
+}
+
+string format_bvh_counters([[maybe_unused]] const bvh_counters& counters,
+    [[maybe_unused]] double seconds) {
+#ifdef YOCTO_STATS
+  auto rays      = max((double)counters.rays, 1.0);
+  auto sampling  = max((double)counters.sampling, 1.0);
+  auto traversal = min(counters.traversal / sampling, 1.0);
+  return std::to_string(counters.rays) + " rays, " +
+         std::to_string(counters.rays / max(seconds, 1e-9) / 1e6) +
+         " Mrays/s, " + std::to_string(counters.nodes / rays) +
+         " nodes/ray, " + std::to_string(counters.primitives / rays) +
+         " primitives/ray, " + std::to_string(counters.samples) +
+         " samples, " + std::to_string(counters.shades) +
+         " shades, traversal " + std::to_string(100 * traversal) +
+         "%, shading " + std::to_string(100 * (1 - traversal)) + "%";
+#else
+  return "counters disabled, build with YOCTO_STATS";
+#endif
+}
+
+// Count nodes and primitives visited by the calling thread. Compiled out
+// without YOCTO_STATS.
+static inline void count_bvh_nodes([[maybe_unused]] int num) {
+#ifdef YOCTO_STATS
+  bvh_thread_counters.nodes += num;
+#endif
+}
+static inline void count_bvh_primitives([[maybe_unused]] int num) {
+#ifdef YOCTO_STATS
+  bvh_thread_counters.primitives += num;
+#endif
+}
+
+// Scoped timer that counts the rays of a query and its traversal time.
+// Does nothing without YOCTO_STATS.
+struct bvh_ray_timer {
+  int rays = 1;
+#ifdef YOCTO_STATS
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  ~bvh_ray_timer() {
+    auto& counters = get_bvh_counters();
+    counters.rays += rays;
+    counters.traversal += std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start)
+                              .count();
+  }
+#endif
+};
+
+}  // namespace yocto
+
 // -----------------------------------------------------------------------------
 // IMPLEMENTATION FOR EMBREE BVH
 // -----------------------------------------------------------------------------
@@ -308,51 +419,407 @@ static bool intersect_embree_bvh(const bvh_data& bvh, const scene_data& scene,
 
 }  // namespace yocto
 
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION FOR WIDE BVH
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Surface area of a bbox used by the SAH
+static float bvh_bbox_area(const bbox3f& bbox) {
+  auto size = bbox.max - bbox.min;
+  return 1e-12f + 2 * size.x * size.y + 2 * size.x * size.z +
+         2 * size.y * size.z;
+}
+
+// Whether a node bounds can be quantized. Empty shapes have an invalid bbox
+// at the root, whose extent would give an infinite or NaN step.
+static bool is_wide_grid_valid(const bbox3f& bbox) {
+  auto size = bbox.max - bbox.min;
+  return isfinite(bbox.min) && isfinite(bbox.max) && isfinite(size) &&
+         size.x >= 0 && size.y >= 0 && size.z >= 0;
+}
+
+// Quantization grid of a wide node. The step is rounded up so that the grid
+// covers the node bounds. Invalid bounds get a unit grid, and the caller
+// marks their children as empty.
+static pair<vec3f, vec3f> make_wide_grid(const bbox3f& bbox) {
+  if (!is_wide_grid_valid(bbox)) return {{0, 0, 0}, {1, 1, 1}};
+  auto origin = bbox.min;
+  auto scale  = (bbox.max - bbox.min) / 255;
+  for (auto axis = 0; axis < 3; axis++) {
+    while (origin[axis] + 255 * scale[axis] < bbox.max[axis])
+      scale[axis] = std::nextafter(scale[axis], flt_max);
+  }
+  return {origin, scale};
+}
+
+// Quantize a bound on the grid, rounding outwards
+static uint8_t quantize_wide_bound(
+    float value, float origin, float scale, bool upper) {
+  if (scale == 0) return 0;
+  auto grid = (value - origin) / scale;
+  auto q    = clamp(
+      (int)(upper ? std::ceil(grid) : std::floor(grid)), 0, 255);
+  if (upper) {
+    while (q < 255 && origin + q * scale < value) q++;
+  } else {
+    while (q > 0 && origin + q * scale > value) q--;
+  }
+  return (uint8_t)q;
+}
+
+// Bounds of the children of a wide node
+template <int N>
+static bbox3f get_wide_bounds(const bvh_wide_node<N>& node, int child) {
+  return {{node.origin.x + node.qmin_x[child] * node.scale.x,
+              node.origin.y + node.qmin_y[child] * node.scale.y,
+              node.origin.z + node.qmin_z[child] * node.scale.z},
+      {node.origin.x + node.qmax_x[child] * node.scale.x,
+          node.origin.y + node.qmax_y[child] * node.scale.y,
+          node.origin.z + node.qmax_z[child] * node.scale.z}};
+}
+
+// Collapse a binary bvh into a wide one. Each wide node takes the children of
+// a binary node, then repeatedly replaces its largest internal child with
+// the child's children until it has N of them.
+template <int N>
+static void collapse_bvh(
+    vector<bvh_wide_node<N>>& wnodes, const vector<bvh_node>& nodes) {
+  wnodes.clear();
+  if (nodes.empty()) return;
+
+  // push first node onto the stack
+  auto stack = vector<vec2i>{{0, 0}};
+  wnodes.emplace_back();
+
+  // create nodes until the stack is empty
+  while (!stack.empty()) {
+    // grab wide node and binary node to work on
+    auto [wnodeid, nodeid] = stack.back();
+    stack.pop_back();
+    auto& node = nodes[nodeid];
+
+    // gather children
+    auto children  = array<int, N>{};
+    auto nchildren = 0;
+    if (node.internal) {
+      children[nchildren++] = node.start + 0;
+      children[nchildren++] = node.start + 1;
+    } else {
+      children[nchildren++] = nodeid;
+    }
+    while (nchildren < N) {
+      auto largest = -1;
+      auto area    = 0.0f;
+      for (auto child = 0; child < nchildren; child++) {
+        auto& cnode = nodes[children[child]];
+        if (!cnode.internal) continue;
+        if (largest >= 0 && bvh_bbox_area(cnode.bbox) <= area) continue;
+        largest = child;
+        area    = bvh_bbox_area(cnode.bbox);
+      }
+      if (largest < 0) break;
+      auto start            = nodes[children[largest]].start;
+      children[largest]     = start + 0;
+      children[nchildren++] = start + 1;
+    }
+
+    // quantize children bounds and link them
+    auto [origin, scale]  = make_wide_grid(node.bbox);
+    auto valid            = is_wide_grid_valid(node.bbox);
+    wnodes[wnodeid].origin = origin;
+    wnodes[wnodeid].scale  = scale;
+    for (auto child = 0; child < N; child++) {
+      if (!valid || child >= nchildren ||
+          (!nodes[children[child]].internal &&
+              nodes[children[child]].num == 0)) {
+        wnodes[wnodeid].num[child] = -1;
+        continue;
+      }
+      auto& cnode  = nodes[children[child]];
+      auto& wnode  = wnodes[wnodeid];
+      wnode.qmin_x[child] = quantize_wide_bound(
+          cnode.bbox.min.x, origin.x, scale.x, false);
+      wnode.qmin_y[child] = quantize_wide_bound(
+          cnode.bbox.min.y, origin.y, scale.y, false);
+      wnode.qmin_z[child] = quantize_wide_bound(
+          cnode.bbox.min.z, origin.z, scale.z, false);
+      wnode.qmax_x[child] = quantize_wide_bound(
+          cnode.bbox.max.x, origin.x, scale.x, true);
+      wnode.qmax_y[child] = quantize_wide_bound(
+          cnode.bbox.max.y, origin.y, scale.y, true);
+      wnode.qmax_z[child] = quantize_wide_bound(
+          cnode.bbox.max.z, origin.z, scale.z, true);
+      if (cnode.internal) {
+        wnode.num[child]   = 0;
+        wnode.start[child] = (int)wnodes.size();
+        stack.push_back({wnode.start[child], children[child]});
+        wnodes.emplace_back();
+      } else {
+        wnode.num[child]   = (int8_t)cnode.num;
+        wnode.start[child] = cnode.start;
+      }
+    }
+  }
+
+  // cleanup
+  wnodes.shrink_to_fit();
+}
+
+// Collapse the bvh into a wide one of the given width, keeping of the binary
+// tree only the root bounds
+static void collapse_bvh(bvh_data& bvh, int width) {
+  if (width == 2) return;
+  if (width == 4) {
+    collapse_bvh(bvh.nodes4, bvh.nodes);
+  } else if (width == 8) {
+    collapse_bvh(bvh.nodes8, bvh.nodes);
+  } else {
+    throw std::invalid_argument{"bvh width should be 2, 4 or 8"};
+  }
+  if (!bvh.nodes.empty()) bvh.nodes = {bvh_node{bvh.nodes.front().bbox}};
+}
+
+// Check if a bvh is wide
+static bool is_wide_bvh(const bvh_data& bvh) {
+  return !bvh.nodes4.empty() || !bvh.nodes8.empty();
+}
+
+// Item of the stack used to traverse wide bvhs. Items refer to nodes, if num
+// is 0, or to primitive ranges. Left uninitialized since the stack is large.
+struct bvh_wide_item {
+  float distance;
+  int   start;
+  int   num;
+};
+
+// Intersect ray with a wide bvh. Primitives are intersected by calling
+// `intersect_leaf(start, num, ray)` that returns whether it found a hit and
+// shortens the ray accordingly. Children are tested all at once, and visited
+// from the closest.
+template <int N, typename Func>
+static bool intersect_wide_bvh(const vector<bvh_wide_node<N>>& nodes,
+    const ray3f& ray_, bool find_any, Func&& intersect_leaf) {
+  // node stack
+  array<bvh_wide_item, 256> node_stack;
+  auto                      node_cur = 0;
+  node_stack[node_cur++] = {ray_.tmin, 0, 0};
+
+  // shared variables
+  auto hit = false;
+
+  // copy ray to modify it
+  auto ray = ray_;
+
+  // prepare ray for fast queries
+  auto ray_dinv = vec3f{1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z};
+
+  // walking stack
+  while (node_cur != 0) {
+    // grab item, skipping it if a closer hit was found since it was pushed
+    auto item = node_stack[--node_cur];
+    if (item.distance > ray.tmax * 1.00000024f) continue;
+
+    // intersect primitives
+    if (item.num > 0) {
+      if (intersect_leaf(item.start, item.num, ray)) {
+        hit = true;
+        if (find_any) return hit;
+      }
+      continue;
+    }
+
+    // intersect children bounds
+    auto& node = nodes[item.start];
+    count_bvh_nodes(1);
+    auto ax = (node.origin.x - ray.o.x) * ray_dinv.x;
+    auto  ay = (node.origin.y - ray.o.y) * ray_dinv.y;
+    auto  az = (node.origin.z - ray.o.z) * ray_dinv.z;
+    auto  bx = node.scale.x * ray_dinv.x;
+    auto  by = node.scale.y * ray_dinv.y;
+    auto  bz = node.scale.z * ray_dinv.z;
+    float tnear[N];
+    int   thit[N];
+    for (auto child = 0; child < N; child++) {
+      auto x0 = ax + node.qmin_x[child] * bx, x1 = ax + node.qmax_x[child] * bx;
+      auto y0 = ay + node.qmin_y[child] * by, y1 = ay + node.qmax_y[child] * by;
+      auto z0 = az + node.qmin_z[child] * bz, z1 = az + node.qmax_z[child] * bz;
+      auto t0 = max(max(max(min(x0, x1), min(y0, y1)), min(z0, z1)), ray.tmin);
+      auto t1 = min(min(min(max(x0, x1), max(y0, y1)), max(z0, z1)), ray.tmax);
+      tnear[child] = t0;
+      thit[child]  = (node.num[child] >= 0) & (t0 <= t1 * 1.00000024f);
+    }
+
+    // push children from the farthest, so that the closest is visited first
+    auto order  = array<int, N>{};
+    auto nhits  = 0;
+    for (auto child = 0; child < N; child++) {
+      if (!thit[child]) continue;
+      auto pos = nhits++;
+      while (pos > 0 && tnear[order[pos - 1]] < tnear[child]) {
+        order[pos] = order[pos - 1];
+        pos--;
+      }
+      order[pos] = child;
+    }
+    for (auto idx = 0; idx < nhits; idx++) {
+      auto child             = order[idx];
+      node_stack[node_cur++] = {
+          tnear[child], node.start[child], (int)node.num[child]};
+    }
+  }
+
+  return hit;
+}
+
+// Overlap a point with a wide bvh. Primitives are tested by calling
+// `overlap_leaf(start, num, max_distance)` that returns whether it found
+// a hit and shortens the distance accordingly.
+template <int N, typename Func>
+static bool overlap_wide_bvh(const vector<bvh_wide_node<N>>& nodes,
+    const vec3f& pos, float max_distance, bool find_any,
+    Func&& overlap_leaf) {
+  // node stack
+  array<bvh_wide_item, 256> node_stack;
+  auto                      node_cur = 0;
+  node_stack[node_cur++] = {0, 0, 0};
+
+  // hit
+  auto hit = false;
+
+  // walking stack
+  while (node_cur != 0) {
+    // grab item
+    auto item = node_stack[--node_cur];
+
+    // overlap primitives
+    if (item.num > 0) {
+      if (overlap_leaf(item.start, item.num, max_distance)) {
+        hit = true;
+        if (find_any) return hit;
+      }
+      continue;
+    }
+
+    // overlap children bounds
+    auto& node = nodes[item.start];
+    for (auto child = 0; child < N; child++) {
+      if (node.num[child] < 0) continue;
+      if (!overlap_bbox(pos, max_distance, get_wide_bounds(node, child)))
+        continue;
+      node_stack[node_cur++] = {0, node.start[child], (int)node.num[child]};
+    }
+  }
+
+  return hit;
+}
+
+// Compute statistics of a wide bvh
+template <int N>
+static void get_wide_stats(
+    bvh_stats& stats, const vector<bvh_wide_node<N>>& nodes) {
+  auto bounds = [](const bvh_wide_node<N>& node) {
+    return bbox3f{node.origin, node.origin + 255 * node.scale};
+  };
+  auto root_area = bvh_bbox_area(bounds(nodes[0]));
+  auto stack     = vector<vec2i>{{0, 1}};
+  while (!stack.empty()) {
+    auto [nodeid, depth] = stack.back();
+    stack.pop_back();
+    auto& node  = nodes[nodeid];
+    stats.depth = max(stats.depth, depth);
+    stats.nodes += 1;
+    stats.sah_cost += bvh_bbox_area(bounds(node)) / root_area;
+    for (auto child = 0; child < N; child++) {
+      if (node.num[child] == 0) {
+        stack.push_back({node.start[child], depth + 1});
+      } else if (node.num[child] > 0) {
+        auto area = bvh_bbox_area(get_wide_bounds(node, child)) / root_area;
+        stats.sah_cost += area * node.num[child];
+        stats.leaves += 1;
+      }
+    }
+  }
+  stats.bytes += nodes.size() * sizeof(bvh_wide_node<N>);
+}
+
+}  // namespace yocto
+
 // -----------------------------------------------------------------------------
 // IMPLEMENTATION FOR BVH BUILD
 // -----------------------------------------------------------------------------
 namespace yocto {
 
 // Splits a BVH node using the SAH heuristic. Returns split position and axis.
+// Primitives are binned by their centers on the three axes in a single pass,
+// and the split costs are then evaluated sweeping the bins from both sides.
 static pair<int, int> split_sah(vector<int>& primitives,
     const vector<bbox3f>& bboxes, const vector<vec3f>& centers, int start,
     int end) {
   // compute primintive bounds and size
+  auto bbox  = invalidb3f;
   auto cbbox = invalidb3f;
-  for (auto i = start; i < end; i++)
+  for (auto i = start; i < end; i++) {
+    bbox  = merge(bbox, bboxes[primitives[i]]);
     cbbox = merge(cbbox, centers[primitives[i]]);
+  }
   auto csize = cbbox.max - cbbox.min;
   if (csize == vec3f{0, 0, 0}) return {(start + end) / 2, 0};
 
-  // consider N bins, compute their cost and keep the minimum
-  auto      axis      = 0;
+  // bin primitives on all axes
   const int nbins     = 16;
-  auto      split     = 0.0f;
-  auto      min_cost  = flt_max;
-  auto      bbox_area = [](const bbox3f& b) {
+  auto      bin_index = [&cbbox, &csize](const vec3f& center, int axis) {
+    return clamp(
+        (int)(nbins * (center[axis] - cbbox.min[axis]) / csize[axis]), 0,
+        nbins - 1);
+  };
+  auto bin_bboxes = array<array<bbox3f, nbins>, 3>{};
+  auto bin_counts = array<array<int, nbins>, 3>{};
+  for (auto saxis = 0; saxis < 3; saxis++) {
+    bin_bboxes[saxis].fill(invalidb3f);
+    bin_counts[saxis].fill(0);
+  }
+  for (auto i = start; i < end; i++) {
+    auto primitive = primitives[i];
+    for (auto saxis = 0; saxis < 3; saxis++) {
+      if (csize[saxis] == 0) continue;
+      auto bin               = bin_index(centers[primitive], saxis);
+      bin_bboxes[saxis][bin] = merge(bin_bboxes[saxis][bin], bboxes[primitive]);
+      bin_counts[saxis][bin] += 1;
+    }
+  }
+
+  // consider the splits between bins, compute their cost and keep the minimum
+  auto axis      = 0;
+  auto split     = 0;
+  auto min_cost  = flt_max;
+  auto bbox_area = [](const bbox3f& b) {
     auto size = b.max - b.min;
     return 1e-12f + 2 * size.x * size.y + 2 * size.x * size.z +
            2 * size.y * size.z;
   };
   for (auto saxis = 0; saxis < 3; saxis++) {
+    if (csize[saxis] == 0) continue;
+    // sweep from the right to get the right side of each split
+    auto right_costs = array<float, nbins>{};
+    auto right_bbox  = invalidb3f;
+    auto right_count = 0;
+    for (auto b = nbins - 1; b > 0; b--) {
+      right_bbox = merge(right_bbox, bin_bboxes[saxis][b]);
+      right_count += bin_counts[saxis][b];
+      right_costs[b] = right_count ? right_count * bbox_area(right_bbox) : 0;
+    }
+    // sweep from the left and evaluate each split
+    auto left_bbox  = invalidb3f;
+    auto left_count = 0;
     for (auto b = 1; b < nbins; b++) {
-      auto bsplit    = cbbox.min[saxis] + b * csize[saxis] / nbins;
-      auto left_bbox = invalidb3f, right_bbox = invalidb3f;
-      auto left_nprims = 0, right_nprims = 0;
-      for (auto i = start; i < end; i++) {
-        if (centers[primitives[i]][saxis] < bsplit) {
-          left_bbox = merge(left_bbox, bboxes[primitives[i]]);
-          left_nprims += 1;
-        } else {
-          right_bbox = merge(right_bbox, bboxes[primitives[i]]);
-          right_nprims += 1;
-        }
-      }
-      auto cost = 1 + left_nprims * bbox_area(left_bbox) / bbox_area(cbbox) +
-                  right_nprims * bbox_area(right_bbox) / bbox_area(cbbox);
+      left_bbox = merge(left_bbox, bin_bboxes[saxis][b - 1]);
+      left_count += bin_counts[saxis][b - 1];
+      auto left_cost = left_count ? left_count * bbox_area(left_bbox) : 0;
+      auto cost = 1 + (left_cost + right_costs[b]) / bbox_area(bbox);
       if (cost < min_cost) {
         min_cost = cost;
-        split    = bsplit;
+        split    = b;
         axis     = saxis;
       }
     }
@@ -360,8 +827,8 @@ static pair<int, int> split_sah(vector<int>& primitives,
   // split
   auto middle =
       (int)(std::partition(primitives.data() + start, primitives.data() + end,
-                [axis, split, &centers](auto primitive) {
-                  return centers[primitive][axis] < split;
+                [axis, split, &centers, &bin_index](auto primitive) {
+                  return bin_index(centers[primitive], axis) < split;
                 }) -
             primitives.data());
 
@@ -443,25 +910,20 @@ static pair<int, int> split_middle(vector<int>& primitives,
 // Maximum number of primitives per BVH node.
 const int bvh_max_prims = 4;
 
-// Build BVH nodes
-static void build_bvh(
-    bvh_data& bvh, const vector<bbox3f>& bboxes, bool highquality) {
-  // prepare to build nodes
-  bvh.nodes.clear();
-  bvh.nodes.reserve(bboxes.size() * 2);
-
-  // prepare primitives
-  bvh.primitives.resize(bboxes.size());
-  for (auto idx = 0; idx < bboxes.size(); idx++) bvh.primitives[idx] = idx;
-
-  // prepare centers
-  auto centers = vector<vec3f>(bboxes.size());
-  for (auto idx = 0; idx < bboxes.size(); idx++)
-    centers[idx] = center(bboxes[idx]);
-
+// Subtrees with at most this number of primitives are built as parallel
+// tasks.
+const int bvh_task_prims = 4096;
+
+// Build BVH nodes for the primitives from start to end, with the root in
+// nodeid. Subtrees with at most `max_prims` primitives are not built, but
+// returned as nodeid, start, end, so that they can be built separately.
+static vector<vec3i> build_bvh_nodes(vector<bvh_node>& nodes,
+    vector<int>& primitives, const vector<bbox3f>& bboxes,
+    const vector<vec3f>& centers, int nodeid, int start, int end,
+    bool highquality, int max_prims) {
   // push first node onto the stack
-  auto stack = vector<vec3i>{{0, 0, (int)bboxes.size()}};
-  bvh.nodes.emplace_back();
+  auto stack    = vector<vec3i>{{nodeid, start, end}};
+  auto subtrees = vector<vec3i>{};
 
   // create nodes until the stack is empty
   while (!stack.empty()) {
@@ -469,29 +931,34 @@ static void build_bvh(
     auto [nodeid, start, end] = stack.back();
     stack.pop_back();
 
+    // defer small subtrees
+    if (end - start <= max_prims && end - start > bvh_max_prims) {
+      subtrees.push_back({nodeid, start, end});
+      continue;
+    }
+
     // grab node
-    auto& node = bvh.nodes[nodeid];
+    auto& node = nodes[nodeid];
 
     // compute bounds
     node.bbox = invalidb3f;
     for (auto i = start; i < end; i++)
-      node.bbox = merge(node.bbox, bboxes[bvh.primitives[i]]);
+      node.bbox = merge(node.bbox, bboxes[primitives[i]]);
 
     // split into two children
     if (end - start > bvh_max_prims) {
       // get split
       auto [mid, axis] =
-          highquality
-              ? split_sah(bvh.primitives, bboxes, centers, start, end)
-              : split_middle(bvh.primitives, bboxes, centers, start, end);
+          highquality ? split_sah(primitives, bboxes, centers, start, end)
+                      : split_middle(primitives, bboxes, centers, start, end);
 
       // make an internal node
       node.internal = true;
       node.axis     = (uint8_t)axis;
       node.num      = 2;
-      node.start    = (int)bvh.nodes.size();
-      bvh.nodes.emplace_back();
-      bvh.nodes.emplace_back();
+      node.start    = (int)nodes.size();
+      nodes.emplace_back();
+      nodes.emplace_back();
       stack.push_back({node.start + 0, start, mid});
       stack.push_back({node.start + 1, mid, end});
     } else {
@@ -502,12 +969,67 @@ static void build_bvh(
     }
   }
 
+  // done
+  return subtrees;
+}
+
+// Build BVH nodes. The top levels are built first, then the subtrees below
+// them are built in parallel and appended in order, so that the result does
+// not depend on threading.
+static void build_bvh(bvh_data& bvh, const vector<bbox3f>& bboxes,
+    bool highquality, bool noparallel) {
+  // prepare to build nodes
+  auto& nodes      = bvh.nodes;
+  auto& primitives = bvh.primitives;
+  nodes.clear();
+  nodes.reserve(bboxes.size() * 2);
+
+  // prepare primitives
+  primitives.resize(bboxes.size());
+  for (auto idx = 0; idx < bboxes.size(); idx++) primitives[idx] = idx;
+
+  // prepare centers
+  auto centers = vector<vec3f>(bboxes.size());
+  for (auto idx = 0; idx < bboxes.size(); idx++)
+    centers[idx] = center(bboxes[idx]);
+
+  // build top levels
+  nodes.emplace_back();
+  auto subtrees = build_bvh_nodes(nodes, primitives, bboxes, centers, 0, 0,
+      (int)bboxes.size(), highquality, bvh_task_prims);
+
+  // build subtrees
+  auto subnodes      = vector<vector<bvh_node>>(subtrees.size());
+  auto build_subtree = [&](size_t idx) {
+    auto [nodeid, start, end] = subtrees[idx];
+    subnodes[idx].reserve((end - start) * 2);
+    subnodes[idx].emplace_back();
+    build_bvh_nodes(subnodes[idx], primitives, bboxes, centers, 0, start, end,
+        highquality, 0);
+  };
+  if (noparallel) {
+    for (auto idx = (size_t)0; idx < subtrees.size(); idx++) build_subtree(idx);
+  } else {
+    parallel_for(subtrees.size(), build_subtree);
+  }
+
+  // append subtrees, with their root in place of the deferred node
+  for (auto idx = 0; idx < subtrees.size(); idx++) {
+    auto offset = (int)nodes.size() - 1;
+    for (auto& node : subnodes[idx]) {
+      if (node.internal) node.start += offset;
+    }
+    nodes[subtrees[idx].x] = subnodes[idx].front();
+    nodes.insert(nodes.end(), subnodes[idx].begin() + 1, subnodes[idx].end());
+  }
+
   // cleanup
-  bvh.nodes.shrink_to_fit();
+  nodes.shrink_to_fit();
 }
 
 // Update bvh
 static void refit_bvh(bvh_data& bvh, const vector<bbox3f>& bboxes) {
+  if (is_wide_bvh(bvh)) throw std::runtime_error("wide bvh refit not supported");
   for (auto nodeid = (int)bvh.nodes.size() - 1; nodeid >= 0; nodeid--) {
     auto& node = bvh.nodes[nodeid];
     node.bbox  = invalidb3f;
@@ -523,14 +1045,33 @@ static void refit_bvh(bvh_data& bvh, const vector<bbox3f>& bboxes) {
   }
 }
 
-bvh_data make_bvh(const shape_data& shape, bool highquality, bool embree) {
+// Build the triangle cache in the order of the primitive array
+static void make_triangle_cache(bvh_data& bvh, const shape_data& shape) {
+  bvh.triangles.resize(bvh.primitives.size());
+  for (auto idx = 0; idx < bvh.primitives.size(); idx++) {
+    auto& t                  = shape.triangles[bvh.primitives[idx]];
+    auto& p0                 = shape.positions[t.x];
+    bvh.triangles[idx].p0    = p0;
+    bvh.triangles[idx].edge1 = shape.positions[t.y] - p0;
+    bvh.triangles[idx].edge2 = shape.positions[t.z] - p0;
+  }
+}
+
+// Get time in nanoseconds, used for build statistics
+static int64_t get_bvh_time() {
+  return std::chrono::high_resolution_clock::now().time_since_epoch().count();
+}
+
+bvh_data make_bvh(const shape_data& shape, bool highquality, bool embree,
+    bool noparallel, int width, bool trianglecache) {
   // embree
 #ifdef YOCTO_EMBREE
   if (embree) return make_embree_bvh(shape, highquality);
 #endif
 
   // bvh
-  auto bvh = bvh_data{};
+  auto bvh        = bvh_data{};
+  auto start_time = get_bvh_time();
 
   // build primitives
   auto bboxes = vector<bbox3f>{};
@@ -565,31 +1106,50 @@ bvh_data make_bvh(const shape_data& shape, bool highquality, bool embree) {
   }
 
   // build nodes
-  build_bvh(bvh, bboxes, highquality);
+  build_bvh(bvh, bboxes, highquality, noparallel);
+  collapse_bvh(bvh, width);
+
+  // build triangle cache
+  if (trianglecache && !shape.triangles.empty()) {
+    make_triangle_cache(bvh, shape);
+  }
+  bvh.build_time = get_bvh_time() - start_time;
 
   // done
   return bvh;
 }
 
-bvh_data make_bvh(
-    const scene_data& scene, bool highquality, bool embree, bool noparallel) {
+// Bounds of an instance. Empty shapes keep an invalid bbox, since
+// transforming it would give a box covering the whole float range.
+static bbox3f get_instance_bbox(
+    const instance_data& instance, const bvh_data& sbvh) {
+  if (sbvh.nodes.empty() || sbvh.nodes[0].bbox == invalidb3f)
+    return invalidb3f;
+  return transform_bbox(instance.frame, sbvh.nodes[0].bbox);
+}
+
+bvh_data make_bvh(const scene_data& scene, bool highquality, bool embree,
+    bool noparallel, int width, bool trianglecache) {
   // embree
 #ifdef YOCTO_EMBREE
   if (embree) return make_embree_bvh(scene, highquality, noparallel);
 #endif
 
   // bvh
-  auto bvh = bvh_data{};
+  auto bvh        = bvh_data{};
+  auto start_time = get_bvh_time();
 
   // build shape bvh
   bvh.shapes.resize(scene.shapes.size());
   if (noparallel) {
     for (auto idx = (size_t)0; idx < scene.shapes.size(); idx++) {
-      bvh.shapes[idx] = make_bvh(scene.shapes[idx], highquality, embree);
+      bvh.shapes[idx] = make_bvh(scene.shapes[idx], highquality, embree,
+          noparallel, width, trianglecache);
     }
   } else {
     parallel_for(scene.shapes.size(), [&](size_t idx) {
-      bvh.shapes[idx] = make_bvh(scene.shapes[idx], highquality, embree);
+      bvh.shapes[idx] = make_bvh(scene.shapes[idx], highquality, embree,
+          false, width, trianglecache);
     });
   }
 
@@ -597,14 +1157,13 @@ bvh_data make_bvh(
   auto bboxes = vector<bbox3f>(scene.instances.size());
   for (auto idx = 0; idx < bboxes.size(); idx++) {
     auto& instance = scene.instances[idx];
-    auto& sbvh     = bvh.shapes[instance.shape];
-    bboxes[idx]    = sbvh.nodes.empty()
-                         ? invalidb3f
-                         : transform_bbox(instance.frame, sbvh.nodes[0].bbox);
+    bboxes[idx]    = get_instance_bbox(instance, bvh.shapes[instance.shape]);
   }
 
   // build nodes
-  build_bvh(bvh, bboxes, highquality);
+  build_bvh(bvh, bboxes, highquality, noparallel);
+  collapse_bvh(bvh, width);
+  bvh.build_time = get_bvh_time() - start_time;
 
   // done
   return bvh;
@@ -650,6 +1209,9 @@ static void refit_bvh(bvh_data& bvh, const shape_data& shape) {
 
   // update nodes
   refit_bvh(bvh, bboxes);
+
+  // update triangle cache
+  if (!bvh.triangles.empty()) make_triangle_cache(bvh, shape);
 }
 
 void refit_bvh(bvh_data& bvh, const scene_data& scene,
@@ -664,8 +1226,7 @@ void refit_bvh(bvh_data& bvh, const scene_data& scene,
   auto bboxes = vector<bbox3f>(scene.instances.size());
   for (auto idx = 0; idx < bboxes.size(); idx++) {
     auto& instance = scene.instances[idx];
-    auto& sbvh     = bvh.shapes[instance.shape];
-    bboxes[idx]    = transform_bbox(instance.frame, sbvh.nodes[0].bbox);
+    bboxes[idx]    = get_instance_bbox(instance, bvh.shapes[instance.shape]);
   }
 
   // update nodes
@@ -688,6 +1249,45 @@ void update_bvh(bvh_data& bvh, const scene_data& scene,
   refit_bvh(bvh, scene, updated_instances);
 }
 
+// Compute bvh statistics. The SAH cost is the expected cost of tracing a
+// ray that hits the root bounds, counting one for each node visited and
+// each primitive tested.
+bvh_stats get_bvh_stats(const bvh_data& bvh) {
+  auto stats       = bvh_stats{};
+  stats.build_time = bvh.build_time;
+  stats.bytes      = bvh.nodes.size() * sizeof(bvh_node) +
+                bvh.primitives.size() * sizeof(int);
+  stats.cache_bytes = bvh.triangles.size() * sizeof(bvh_triangle);
+  if (!bvh.nodes4.empty()) {
+    get_wide_stats(stats, bvh.nodes4);
+    return stats;
+  }
+  if (!bvh.nodes8.empty()) {
+    get_wide_stats(stats, bvh.nodes8);
+    return stats;
+  }
+  if (bvh.nodes.empty()) return stats;
+  auto root_area = bvh_bbox_area(bvh.nodes[0].bbox);
+  auto stack     = vector<vec2i>{{0, 1}};
+  while (!stack.empty()) {
+    auto [nodeid, depth] = stack.back();
+    stack.pop_back();
+    auto& node  = bvh.nodes[nodeid];
+    auto  area  = node.num ? bvh_bbox_area(node.bbox) / root_area : 0;
+    stats.depth = max(stats.depth, depth);
+    stats.nodes += 1;
+    if (node.internal) {
+      stats.sah_cost += area;
+      stack.push_back({node.start + 0, depth + 1});
+      stack.push_back({node.start + 1, depth + 1});
+    } else {
+      stats.sah_cost += area * (1 + node.num);
+      stats.leaves += 1;
+    }
+  }
+  return stats;
+}
+
 }  // namespace yocto
 
 // -----------------------------------------------------------------------------
@@ -695,10 +1295,100 @@ void update_bvh(bvh_data& bvh, const scene_data& scene,
 // -----------------------------------------------------------------------------
 namespace yocto {
 
-// Intersect ray with a bvh.
+// Intersect ray with a cached triangle. Same math as intersect_triangle.
+static bool intersect_triangle(
+    const ray3f& ray, const bvh_triangle& triangle, vec2f& uv, float& dist) {
+  // compute determinant to solve a linear system
+  auto pvec = cross(ray.d, triangle.edge2);
+  auto det  = dot(triangle.edge1, pvec);
+
+  // check determinant and exit if triangle and ray are parallel
+  if (det == 0) return false;
+  auto inv_det = 1.0f / det;
+
+  // compute and check first bricentric coordinated
+  auto tvec = ray.o - triangle.p0;
+  auto u    = dot(tvec, pvec) * inv_det;
+  if (u < 0 || u > 1) return false;
+
+  // compute and check second bricentric coordinated
+  auto qvec = cross(tvec, triangle.edge1);
+  auto v    = dot(ray.d, qvec) * inv_det;
+  if (v < 0 || u + v > 1) return false;
+
+  // compute and check ray parameter
+  auto t = dot(triangle.edge2, qvec) * inv_det;
+  if (t < ray.tmin || t > ray.tmax) return false;
+
+  // intersection occurred: set params and exit
+  uv   = {u, v};
+  dist = t;
+  return true;
+}
+
+// Intersect ray with the primitives of a bvh leaf, from start to
+// start + num, shortening the ray at each hit.
+static bool intersect_leaf(const bvh_data& bvh, const shape_data& shape,
+    int start, int num, ray3f& ray, int& element, vec2f& uv,
+    float& distance) {
+  count_bvh_primitives(num);
+  auto hit = false;
+  if (!shape.points.empty()) {
+    for (auto idx = start; idx < start + num; idx++) {
+      auto& p = shape.points[bvh.primitives[idx]];
+      if (intersect_point(
+              ray, shape.positions[p], shape.radius[p], uv, distance)) {
+        hit      = true;
+        element  = bvh.primitives[idx];
+        ray.tmax = distance;
+      }
+    }
+  } else if (!shape.lines.empty()) {
+    for (auto idx = start; idx < start + num; idx++) {
+      auto& l = shape.lines[bvh.primitives[idx]];
+      if (intersect_line(ray, shape.positions[l.x], shape.positions[l.y],
+              shape.radius[l.x], shape.radius[l.y], uv, distance)) {
+        hit      = true;
+        element  = bvh.primitives[idx];
+        ray.tmax = distance;
+      }
+    }
+  } else if (!bvh.triangles.empty()) {
+    for (auto idx = start; idx < start + num; idx++) {
+      if (intersect_triangle(ray, bvh.triangles[idx], uv, distance)) {
+        hit      = true;
+        element  = bvh.primitives[idx];
+        ray.tmax = distance;
+      }
+    }
+  } else if (!shape.triangles.empty()) {
+    for (auto idx = start; idx < start + num; idx++) {
+      auto& t = shape.triangles[bvh.primitives[idx]];
+      if (intersect_triangle(ray, shape.positions[t.x], shape.positions[t.y],
+              shape.positions[t.z], uv, distance)) {
+        hit      = true;
+        element  = bvh.primitives[idx];
+        ray.tmax = distance;
+      }
+    }
+  } else if (!shape.quads.empty()) {
+    for (auto idx = start; idx < start + num; idx++) {
+      auto& q = shape.quads[bvh.primitives[idx]];
+      if (intersect_quad(ray, shape.positions[q.x], shape.positions[q.y],
+              shape.positions[q.z], shape.positions[q.w], uv, distance)) {
+        hit      = true;
+        element  = bvh.primitives[idx];
+        ray.tmax = distance;
+      }
+    }
+  }
+  return hit;
+}
+
+// Intersect ray with a bvh, starting from the node `root`.
 static bool intersect_bvh(const bvh_data& bvh, const shape_data& shape,
     const ray3f& ray_, int& element, vec2f& uv, float& distance,
-    bool find_any) {
+    bool find_any, int root = 0) {
 #ifdef YOCTO_EMBREE
   // call Embree if needed
   if (bvh.embree_bvh) {
@@ -707,13 +1397,25 @@ static bool intersect_bvh(const bvh_data& bvh, const shape_data& shape,
   }
 #endif
 
+  // wide bvh
+  if (is_wide_bvh(bvh)) {
+    auto intersect_leaf_ = [&](int start, int num, ray3f& ray) {
+      return intersect_leaf(
+          bvh, shape, start, num, ray, element, uv, distance);
+    };
+    return !bvh.nodes4.empty() ? intersect_wide_bvh(bvh.nodes4, ray_,
+                                     find_any, intersect_leaf_)
+                               : intersect_wide_bvh(bvh.nodes8, ray_,
+                                     find_any, intersect_leaf_);
+  }
+
   // check empty
   if (bvh.nodes.empty()) return false;
 
   // node stack
   auto node_stack        = array<int, 128>{};
   auto node_cur          = 0;
-  node_stack[node_cur++] = 0;
+  node_stack[node_cur++] = root;
 
   // shared variables
   auto hit = false;
@@ -730,6 +1432,7 @@ static bool intersect_bvh(const bvh_data& bvh, const shape_data& shape,
   while (node_cur != 0) {
     // grab node
     auto& node = bvh.nodes[node_stack[--node_cur]];
+    count_bvh_nodes(1);
 
     // intersect bbox
     // if (!intersect_bbox(ray, ray_dinv, ray_dsign, node.bbox)) continue;
@@ -747,46 +1450,9 @@ static bool intersect_bvh(const bvh_data& bvh, const shape_data& shape,
         node_stack[node_cur++] = node.start + 1;
         node_stack[node_cur++] = node.start + 0;
       }
-    } else if (!shape.points.empty()) {
-      for (auto idx = node.start; idx < node.start + node.num; idx++) {
-        auto& p = shape.points[bvh.primitives[idx]];
-        if (intersect_point(
-                ray, shape.positions[p], shape.radius[p], uv, distance)) {
-          hit      = true;
-          element  = bvh.primitives[idx];
-          ray.tmax = distance;
-        }
-      }
-    } else if (!shape.lines.empty()) {
-      for (auto idx = node.start; idx < node.start + node.num; idx++) {
-        auto& l = shape.lines[bvh.primitives[idx]];
-        if (intersect_line(ray, shape.positions[l.x], shape.positions[l.y],
-                shape.radius[l.x], shape.radius[l.y], uv, distance)) {
-          hit      = true;
-          element  = bvh.primitives[idx];
-          ray.tmax = distance;
-        }
-      }
-    } else if (!shape.triangles.empty()) {
-      for (auto idx = node.start; idx < node.start + node.num; idx++) {
-        auto& t = shape.triangles[bvh.primitives[idx]];
-        if (intersect_triangle(ray, shape.positions[t.x], shape.positions[t.y],
-                shape.positions[t.z], uv, distance)) {
-          hit      = true;
-          element  = bvh.primitives[idx];
-          ray.tmax = distance;
-        }
-      }
-    } else if (!shape.quads.empty()) {
-      for (auto idx = node.start; idx < node.start + node.num; idx++) {
-        auto& q = shape.quads[bvh.primitives[idx]];
-        if (intersect_quad(ray, shape.positions[q.x], shape.positions[q.y],
-                shape.positions[q.z], shape.positions[q.w], uv, distance)) {
-          hit      = true;
-          element  = bvh.primitives[idx];
-          ray.tmax = distance;
-        }
-      }
+    } else if (intersect_leaf(bvh, shape, node.start, node.num, ray, element,
+                   uv, distance)) {
+      hit = true;
     }
 
     // check for early exit
@@ -797,6 +1463,27 @@ static bool intersect_bvh(const bvh_data& bvh, const shape_data& shape,
 }
 
 // Intersect ray with a bvh.
+// Intersect ray with the instances of a bvh leaf, from start to
+// start + num, shortening the ray at each hit.
+static bool intersect_leaf(const bvh_data& bvh, const scene_data& scene,
+    int start, int num, ray3f& ray, int& instance, int& element, vec2f& uv,
+    float& distance, bool find_any, bool non_rigid_frames) {
+  auto hit = false;
+  for (auto idx = start; idx < start + num; idx++) {
+    auto& instance_ = scene.instances[bvh.primitives[idx]];
+    auto  inv_ray   = transform_ray(
+        inverse(instance_.frame, non_rigid_frames), ray);
+    if (intersect_bvh(bvh.shapes[instance_.shape],
+            scene.shapes[instance_.shape], inv_ray, element, uv, distance,
+            find_any)) {
+      hit      = true;
+      instance = bvh.primitives[idx];
+      ray.tmax = distance;
+    }
+  }
+  return hit;
+}
+
 static bool intersect_bvh(const bvh_data& bvh, const scene_data& scene,
     const ray3f& ray_, int& instance, int& element, vec2f& uv, float& distance,
     bool find_any, bool non_rigid_frames) {
@@ -808,6 +1495,18 @@ static bool intersect_bvh(const bvh_data& bvh, const scene_data& scene,
   }
 #endif
 
+  // wide bvh
+  if (is_wide_bvh(bvh)) {
+    auto intersect_leaf_ = [&](int start, int num, ray3f& ray) {
+      return intersect_leaf(bvh, scene, start, num, ray, instance, element,
+          uv, distance, find_any, non_rigid_frames);
+    };
+    return !bvh.nodes4.empty() ? intersect_wide_bvh(bvh.nodes4, ray_,
+                                     find_any, intersect_leaf_)
+                               : intersect_wide_bvh(bvh.nodes8, ray_,
+                                     find_any, intersect_leaf_);
+  }
+
   // check empty
   if (bvh.nodes.empty()) return false;
 
@@ -831,6 +1530,7 @@ static bool intersect_bvh(const bvh_data& bvh, const scene_data& scene,
   while (node_cur != 0) {
     // grab node
     auto& node = bvh.nodes[node_stack[--node_cur]];
+    count_bvh_nodes(1);
 
     // intersect bbox
     // if (!intersect_bbox(ray, ray_dinv, ray_dsign, node.bbox)) continue;
@@ -848,19 +1548,9 @@ static bool intersect_bvh(const bvh_data& bvh, const scene_data& scene,
         node_stack[node_cur++] = node.start + 1;
         node_stack[node_cur++] = node.start + 0;
       }
-    } else {
-      for (auto idx = node.start; idx < node.start + node.num; idx++) {
-        auto& instance_ = scene.instances[bvh.primitives[idx]];
-        auto  inv_ray   = transform_ray(
-            inverse(instance_.frame, non_rigid_frames), ray);
-        if (intersect_bvh(bvh.shapes[instance_.shape],
-                scene.shapes[instance_.shape], inv_ray, element, uv, distance,
-                find_any)) {
-          hit      = true;
-          instance = bvh.primitives[idx];
-          ray.tmax = distance;
-        }
-      }
+    } else if (intersect_leaf(bvh, scene, node.start, node.num, ray, instance,
+                   element, uv, distance, find_any, non_rigid_frames)) {
+      hit = true;
     }
 
     // check for early exit
@@ -882,15 +1572,384 @@ static bool intersect_bvh(const bvh_data& bvh, const scene_data& scene,
 
 }  // namespace yocto
 
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION FOR BVH PACKET INTERSECTION
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Packet of rays stored in SoA layout. Loops over the lanes are written
+// without branches so that they compile to SIMD instructions.
+template <int N>
+struct bvh_packet {
+  float ox[N], oy[N], oz[N];
+  float dx[N], dy[N], dz[N];
+  float ix[N], iy[N], iz[N];
+  float tmin[N], tmax[N];
+};
+
+// Lane masks
+template <int N>
+constexpr int bvh_packet_all = (1 << N) - 1;
+static int popcount_mask(int mask) {
+  auto count = 0;
+  for (; mask != 0; mask &= mask - 1) count++;
+  return count;
+}
+
+// Set/get a packet lane
+template <int N>
+static void set_lane(bvh_packet<N>& packet, int lane, const ray3f& ray) {
+  packet.ox[lane]   = ray.o.x;
+  packet.oy[lane]   = ray.o.y;
+  packet.oz[lane]   = ray.o.z;
+  packet.dx[lane]   = ray.d.x;
+  packet.dy[lane]   = ray.d.y;
+  packet.dz[lane]   = ray.d.z;
+  packet.ix[lane]   = 1 / ray.d.x;
+  packet.iy[lane]   = 1 / ray.d.y;
+  packet.iz[lane]   = 1 / ray.d.z;
+  packet.tmin[lane] = ray.tmin;
+  packet.tmax[lane] = ray.tmax;
+}
+template <int N>
+static ray3f get_lane(const bvh_packet<N>& packet, int lane) {
+  return {{packet.ox[lane], packet.oy[lane], packet.oz[lane]},
+      {packet.dx[lane], packet.dy[lane], packet.dz[lane]}, packet.tmin[lane],
+      packet.tmax[lane]};
+}
+
+// Intersect a packet with a bbox, returning the mask of the lanes that hit.
+template <int N>
+static int intersect_bbox(
+    const bvh_packet<N>& packet, const bbox3f& bbox, int mask) {
+  int hit[N];
+  for (auto lane = 0; lane < N; lane++) {
+    auto x0 = (bbox.min.x - packet.ox[lane]) * packet.ix[lane];
+    auto x1 = (bbox.max.x - packet.ox[lane]) * packet.ix[lane];
+    auto y0 = (bbox.min.y - packet.oy[lane]) * packet.iy[lane];
+    auto y1 = (bbox.max.y - packet.oy[lane]) * packet.iy[lane];
+    auto z0 = (bbox.min.z - packet.oz[lane]) * packet.iz[lane];
+    auto z1 = (bbox.max.z - packet.oz[lane]) * packet.iz[lane];
+    auto t0 = max(max(max(min(x0, x1), min(y0, y1)), min(z0, z1)),
+        packet.tmin[lane]);
+    auto t1 = min(min(min(max(x0, x1), max(y0, y1)), max(z0, z1)),
+        packet.tmax[lane]);
+    hit[lane] = (t0 <= t1 * 1.00000024f) ? 1 : 0;
+  }
+  auto result = 0;
+  for (auto lane = 0; lane < N; lane++) result |= hit[lane] << lane;
+  return result & mask;
+}
+
+// Intersect a packet with a triangle given by a vertex and its two edges,
+// returning the mask of the lanes that hit closer than their tmax.
+// Same math as intersect_triangle.
+template <int N>
+static int intersect_triangle(const bvh_packet<N>& packet, const vec3f& p0,
+    const vec3f& edge1, const vec3f& edge2, float* us, float* vs, float* ts,
+    int mask) {
+  int hit[N];
+  for (auto lane = 0; lane < N; lane++) {
+    auto dx = packet.dx[lane], dy = packet.dy[lane], dz = packet.dz[lane];
+    auto px      = dy * edge2.z - dz * edge2.y;
+    auto py      = dz * edge2.x - dx * edge2.z;
+    auto pz      = dx * edge2.y - dy * edge2.x;
+    auto det     = edge1.x * px + edge1.y * py + edge1.z * pz;
+    auto inv_det = 1.0f / det;
+    auto tx      = packet.ox[lane] - p0.x;
+    auto ty      = packet.oy[lane] - p0.y;
+    auto tz      = packet.oz[lane] - p0.z;
+    auto u       = (tx * px + ty * py + tz * pz) * inv_det;
+    auto qx      = ty * edge1.z - tz * edge1.y;
+    auto qy      = tz * edge1.x - tx * edge1.z;
+    auto qz      = tx * edge1.y - ty * edge1.x;
+    auto v       = (dx * qx + dy * qy + dz * qz) * inv_det;
+    auto t       = (edge2.x * qx + edge2.y * qy + edge2.z * qz) * inv_det;
+    us[lane]     = u;
+    vs[lane]     = v;
+    ts[lane]     = t;
+    hit[lane]    = (det != 0 && u >= 0 && u <= 1 && v >= 0 && u + v <= 1 &&
+                    t >= packet.tmin[lane] && t <= packet.tmax[lane])
+                       ? 1
+                       : 0;
+  }
+  auto result = 0;
+  for (auto lane = 0; lane < N; lane++) result |= hit[lane] << lane;
+  return result & mask;
+}
+
+// Intersect a packet with a shape bvh. Lanes in `mask` that hit are
+// recorded in the returned mask, with their tmax shortened.
+template <int N>
+static int intersect_bvh(const bvh_data& bvh, const shape_data& shape,
+    bvh_packet<N>& packet, int mask, int* elements, vec2f* uvs,
+    bool find_any) {
+  // check empty
+  if (bvh.nodes.empty()) return 0;
+
+  // node stack
+  auto node_stack        = array<int, 128>{};
+  auto node_cur          = 0;
+  node_stack[node_cur++] = 0;
+
+  // shared variables
+  auto hits = 0;
+
+  // walking stack
+  while (node_cur != 0 && mask != 0) {
+    // grab node
+    auto  node_id = node_stack[--node_cur];
+    auto& node    = bvh.nodes[node_id];
+    count_bvh_nodes(popcount_mask(mask));
+
+    // intersect bbox
+    auto node_mask = intersect_bbox(packet, node.bbox, mask);
+    if (node_mask == 0) continue;
+
+    // fallback to single rays when the packet has diverged
+    if (popcount_mask(node_mask) == 1) {
+      auto lane = 0;
+      while (!(node_mask & (1 << lane))) lane++;
+      auto distance = 0.0f;
+      if (intersect_bvh(bvh, shape, get_lane(packet, lane), elements[lane],
+              uvs[lane], distance, find_any, node_id)) {
+        hits |= 1 << lane;
+        packet.tmax[lane] = distance;
+        if (find_any) mask &= ~(1 << lane);
+      }
+      continue;
+    }
+
+    // intersect node, switching based on node type
+    if (node.internal) {
+      // the packet is coherent, so use the direction of the first lane
+      auto lane = 0;
+      while (!(node_mask & (1 << lane))) lane++;
+      auto dir = node.axis == 0   ? packet.dx[lane]
+                 : node.axis == 1 ? packet.dy[lane]
+                                  : packet.dz[lane];
+      if (dir < 0) {
+        node_stack[node_cur++] = node.start + 0;
+        node_stack[node_cur++] = node.start + 1;
+      } else {
+        node_stack[node_cur++] = node.start + 1;
+        node_stack[node_cur++] = node.start + 0;
+      }
+    } else if (!shape.triangles.empty()) {
+      count_bvh_primitives(node.num * popcount_mask(node_mask));
+      float us[N], vs[N], ts[N];
+      for (auto idx = node.start; idx < node.start + node.num; idx++) {
+        auto tri_mask = 0;
+        if (!bvh.triangles.empty()) {
+          auto& triangle = bvh.triangles[idx];
+          tri_mask = intersect_triangle(packet, triangle.p0, triangle.edge1,
+              triangle.edge2, us, vs, ts, node_mask);
+        } else {
+          auto& t  = shape.triangles[bvh.primitives[idx]];
+          auto& p0 = shape.positions[t.x];
+          tri_mask = intersect_triangle(packet, p0, shape.positions[t.y] - p0,
+              shape.positions[t.z] - p0, us, vs, ts, node_mask);
+        }
+        for (auto lane = 0; lane < N; lane++) {
+          if (!(tri_mask & (1 << lane))) continue;
+          elements[lane]    = bvh.primitives[idx];
+          uvs[lane]         = {us[lane], vs[lane]};
+          packet.tmax[lane] = ts[lane];
+        }
+        hits |= tri_mask;
+      }
+    } else {
+      for (auto lane = 0; lane < N; lane++) {
+        if (!(node_mask & (1 << lane))) continue;
+        auto ray      = get_lane(packet, lane);
+        auto distance = 0.0f;
+        if (intersect_leaf(bvh, shape, node.start, node.num, ray,
+                elements[lane], uvs[lane], distance)) {
+          hits |= 1 << lane;
+          packet.tmax[lane] = ray.tmax;
+        }
+      }
+    }
+
+    // lanes that found any hit are done
+    if (find_any) mask &= ~hits;
+  }
+
+  return hits;
+}
+
+// Intersect a packet of rays with a scene bvh. Rays whose directions do
+// not all lie in the same octant are traced one at a time.
+template <int N>
+static void intersect_bvh(const bvh_data& bvh, const scene_data& scene,
+    const array<ray3f, N>& rays, array<bvh_intersection, N>& intersections,
+    bool find_any, bool non_rigid_frames) {
+  // initialize
+  for (auto& intersection : intersections) intersection = {};
+
+  // check coherence
+  auto coherent = !bvh.nodes.empty() && !is_wide_bvh(bvh);
+#ifdef YOCTO_EMBREE
+  if (bvh.embree_bvh) coherent = false;
+#endif
+  for (auto lane = 1; lane < N && coherent; lane++) {
+    coherent = (rays[lane].d.x < 0) == (rays[0].d.x < 0) &&
+               (rays[lane].d.y < 0) == (rays[0].d.y < 0) &&
+               (rays[lane].d.z < 0) == (rays[0].d.z < 0);
+  }
+  if (!coherent) {
+    for (auto lane = 0; lane < N; lane++) {
+      auto& intersection = intersections[lane];
+      intersection.hit   = intersect_bvh(bvh, scene, rays[lane],
+          intersection.instance, intersection.element, intersection.uv,
+          intersection.distance, find_any, non_rigid_frames);
+    }
+    return;
+  }
+
+  // prepare packet
+  auto packet = bvh_packet<N>{};
+  for (auto lane = 0; lane < N; lane++) set_lane(packet, lane, rays[lane]);
+  auto mask = bvh_packet_all<N>;
+
+  // node stack
+  auto node_stack        = array<int, 128>{};
+  auto node_cur          = 0;
+  node_stack[node_cur++] = 0;
+
+  // walking stack
+  while (node_cur != 0 && mask != 0) {
+    // grab node
+    auto& node = bvh.nodes[node_stack[--node_cur]];
+    count_bvh_nodes(popcount_mask(mask));
+
+    // intersect bbox
+    auto node_mask = intersect_bbox(packet, node.bbox, mask);
+    if (node_mask == 0) continue;
+
+    // intersect node, switching based on node type
+    if (node.internal) {
+      if (rays[0].d[node.axis] < 0) {
+        node_stack[node_cur++] = node.start + 0;
+        node_stack[node_cur++] = node.start + 1;
+      } else {
+        node_stack[node_cur++] = node.start + 1;
+        node_stack[node_cur++] = node.start + 0;
+      }
+    } else {
+      for (auto idx = node.start; idx < node.start + node.num; idx++) {
+        auto& instance = scene.instances[bvh.primitives[idx]];
+        auto  inv_frame = inverse(instance.frame, non_rigid_frames);
+        auto  inv_packet = bvh_packet<N>{};
+        for (auto lane = 0; lane < N; lane++) {
+          set_lane(inv_packet, lane,
+              transform_ray(inv_frame, get_lane(packet, lane)));
+        }
+        int   elements[N];
+        vec2f uvs[N];
+        auto  hits = intersect_bvh(bvh.shapes[instance.shape],
+            scene.shapes[instance.shape], inv_packet, node_mask, elements, uvs,
+            find_any);
+        for (auto lane = 0; lane < N; lane++) {
+          if (!(hits & (1 << lane))) continue;
+          auto& intersection    = intersections[lane];
+          intersection.hit      = true;
+          intersection.instance = bvh.primitives[idx];
+          intersection.element  = elements[lane];
+          intersection.uv       = uvs[lane];
+          intersection.distance = inv_packet.tmax[lane];
+          packet.tmax[lane]     = inv_packet.tmax[lane];
+        }
+        if (find_any) {
+          mask &= ~hits;
+          node_mask &= ~hits;
+        }
+      }
+    }
+  }
+}
+
+}  // namespace yocto
+
 // -----------------------------------------------------------------------------
 // IMPLEMENTATION FOR BVH OVERLAP
 // -----------------------------------------------------------------------------
 namespace yocto {
 
+// Overlap point with the primitives of a bvh leaf, from start to
+// start + num, shortening the maximum distance at each hit.
+static bool overlap_leaf(const bvh_data& bvh, const shape_data& shape,
+    int start, int num, const vec3f& pos, float& max_distance, int& element,
+    vec2f& uv, float& distance) {
+  auto hit = false;
+  if (!shape.points.empty()) {
+    for (auto idx = 0; idx < num; idx++) {
+      auto  primitive = bvh.primitives[start + idx];
+      auto& p         = shape.points[primitive];
+      if (overlap_point(pos, max_distance, shape.positions[p],
+              shape.radius[p], uv, distance)) {
+        hit          = true;
+        element      = primitive;
+        max_distance = distance;
+      }
+    }
+  } else if (!shape.lines.empty()) {
+    for (auto idx = 0; idx < num; idx++) {
+      auto  primitive = bvh.primitives[start + idx];
+      auto& l         = shape.lines[primitive];
+      if (overlap_line(pos, max_distance, shape.positions[l.x],
+              shape.positions[l.y], shape.radius[l.x], shape.radius[l.y], uv,
+              distance)) {
+        hit          = true;
+        element      = primitive;
+        max_distance = distance;
+      }
+    }
+  } else if (!shape.triangles.empty()) {
+    for (auto idx = 0; idx < num; idx++) {
+      auto  primitive = bvh.primitives[start + idx];
+      auto& t         = shape.triangles[primitive];
+      if (overlap_triangle(pos, max_distance, shape.positions[t.x],
+              shape.positions[t.y], shape.positions[t.z], shape.radius[t.x],
+              shape.radius[t.y], shape.radius[t.z], uv, distance)) {
+        hit          = true;
+        element      = primitive;
+        max_distance = distance;
+      }
+    }
+  } else if (!shape.quads.empty()) {
+    for (auto idx = 0; idx < num; idx++) {
+      auto  primitive = bvh.primitives[start + idx];
+      auto& q         = shape.quads[primitive];
+      if (overlap_quad(pos, max_distance, shape.positions[q.x],
+              shape.positions[q.y], shape.positions[q.z],
+              shape.positions[q.w], shape.radius[q.x], shape.radius[q.y],
+              shape.radius[q.z], shape.radius[q.w], uv, distance)) {
+        hit          = true;
+        element      = primitive;
+        max_distance = distance;
+      }
+    }
+  }
+  return hit;
+}
+
 // Intersect ray with a bvh.
 static bool overlap_bvh(const bvh_data& bvh, const shape_data& shape,
     const vec3f& pos, float max_distance, int& element, vec2f& uv,
     float& distance, bool find_any) {
+  // wide bvh
+  if (is_wide_bvh(bvh)) {
+    auto overlap_leaf_ = [&](int start, int num, float& max_distance) {
+      return overlap_leaf(bvh, shape, start, num, pos, max_distance, element,
+          uv, distance);
+    };
+    return !bvh.nodes4.empty() ? overlap_wide_bvh(bvh.nodes4, pos,
+                                     max_distance, find_any, overlap_leaf_)
+                               : overlap_wide_bvh(bvh.nodes8, pos,
+                                     max_distance, find_any, overlap_leaf_);
+  }
+
   // check if empty
   if (bvh.nodes.empty()) return false;
 
@@ -916,54 +1975,9 @@ static bool overlap_bvh(const bvh_data& bvh, const shape_data& shape,
       // internal node
       node_stack[node_cur++] = node.start + 0;
       node_stack[node_cur++] = node.start + 1;
-    } else if (!shape.points.empty()) {
-      for (auto idx = 0; idx < node.num; idx++) {
-        auto  primitive = bvh.primitives[node.start + idx];
-        auto& p         = shape.points[primitive];
-        if (overlap_point(pos, max_distance, shape.positions[p],
-                shape.radius[p], uv, distance)) {
-          hit          = true;
-          element      = primitive;
-          max_distance = distance;
-        }
-      }
-    } else if (!shape.lines.empty()) {
-      for (auto idx = 0; idx < node.num; idx++) {
-        auto  primitive = bvh.primitives[node.start + idx];
-        auto& l         = shape.lines[primitive];
-        if (overlap_line(pos, max_distance, shape.positions[l.x],
-                shape.positions[l.y], shape.radius[l.x], shape.radius[l.y], uv,
-                distance)) {
-          hit          = true;
-          element      = primitive;
-          max_distance = distance;
-        }
-      }
-    } else if (!shape.triangles.empty()) {
-      for (auto idx = 0; idx < node.num; idx++) {
-        auto  primitive = bvh.primitives[node.start + idx];
-        auto& t         = shape.triangles[primitive];
-        if (overlap_triangle(pos, max_distance, shape.positions[t.x],
-                shape.positions[t.y], shape.positions[t.z], shape.radius[t.x],
-                shape.radius[t.y], shape.radius[t.z], uv, distance)) {
-          hit          = true;
-          element      = primitive;
-          max_distance = distance;
-        }
-      }
-    } else if (!shape.quads.empty()) {
-      for (auto idx = 0; idx < node.num; idx++) {
-        auto  primitive = bvh.primitives[node.start + idx];
-        auto& q         = shape.quads[primitive];
-        if (overlap_quad(pos, max_distance, shape.positions[q.x],
-                shape.positions[q.y], shape.positions[q.z],
-                shape.positions[q.w], shape.radius[q.x], shape.radius[q.y],
-                shape.radius[q.z], shape.radius[q.w], uv, distance)) {
-          hit          = true;
-          element      = primitive;
-          max_distance = distance;
-        }
-      }
+    } else if (overlap_leaf(bvh, shape, node.start, node.num, pos,
+                   max_distance, element, uv, distance)) {
+      hit = true;
     }
 
     // check for early exit
@@ -973,10 +1987,46 @@ static bool overlap_bvh(const bvh_data& bvh, const shape_data& shape,
   return hit;
 }
 
+// Overlap point with the instances of a bvh leaf, from start to
+// start + num, shortening the maximum distance at each hit.
+static bool overlap_leaf(const bvh_data& bvh, const scene_data& scene,
+    int start, int num, const vec3f& pos, float& max_distance, int& instance,
+    int& element, vec2f& uv, float& distance, bool find_any,
+    bool non_rigid_frames) {
+  auto hit = false;
+  for (auto idx = 0; idx < num; idx++) {
+    auto  primitive = bvh.primitives[start + idx];
+    auto& instance_ = scene.instances[primitive];
+    auto& shape     = scene.shapes[instance_.shape];
+    auto& sbvh      = bvh.shapes[instance_.shape];
+    auto  inv_pos   = transform_point(
+        inverse(instance_.frame, non_rigid_frames), pos);
+    if (overlap_bvh(sbvh, shape, inv_pos, max_distance, element, uv, distance,
+            find_any)) {
+      hit          = true;
+      instance     = primitive;
+      max_distance = distance;
+    }
+  }
+  return hit;
+}
+
 // Intersect ray with a bvh.
 static bool overlap_bvh(const bvh_data& bvh, const scene_data& scene,
     const vec3f& pos, float max_distance, int& instance, int& element,
     vec2f& uv, float& distance, bool find_any, bool non_rigid_frames) {
+  // wide bvh
+  if (is_wide_bvh(bvh)) {
+    auto overlap_leaf_ = [&](int start, int num, float& max_distance) {
+      return overlap_leaf(bvh, scene, start, num, pos, max_distance, instance,
+          element, uv, distance, find_any, non_rigid_frames);
+    };
+    return !bvh.nodes4.empty() ? overlap_wide_bvh(bvh.nodes4, pos,
+                                     max_distance, find_any, overlap_leaf_)
+                               : overlap_wide_bvh(bvh.nodes8, pos,
+                                     max_distance, find_any, overlap_leaf_);
+  }
+
   // check if empty
   if (bvh.nodes.empty()) return false;
 
@@ -1002,21 +2052,10 @@ static bool overlap_bvh(const bvh_data& bvh, const scene_data& scene,
       // internal node
       node_stack[node_cur++] = node.start + 0;
       node_stack[node_cur++] = node.start + 1;
-    } else {
-      for (auto idx = 0; idx < node.num; idx++) {
-        auto  primitive = bvh.primitives[node.start + idx];
-        auto& instance_ = scene.instances[primitive];
-        auto& shape     = scene.shapes[instance_.shape];
-        auto& sbvh      = bvh.shapes[instance_.shape];
-        auto  inv_pos   = transform_point(
-            inverse(instance_.frame, non_rigid_frames), pos);
-        if (overlap_bvh(sbvh, shape, inv_pos, max_distance, element, uv,
-                distance, find_any)) {
-          hit          = true;
-          instance     = primitive;
-          max_distance = distance;
-        }
-      }
+    } else if (overlap_leaf(bvh, scene, node.start, node.num, pos,
+                   max_distance, instance, element, uv, distance, find_any,
+                   non_rigid_frames)) {
+      hit = true;
     }
 
     // check for early exit
@@ -1089,29 +2128,47 @@ void overlap_bvh_elems(const bvh_data& bvh1, const bvh_data& bvh2,
 
 bvh_intersection intersect_bvh(const bvh_data& bvh, const shape_data& shape,
     const ray3f& ray, bool find_any) {
-  auto intersection = bvh_intersection{};
-  intersection.hit  = intersect_bvh(bvh, shape, ray, intersection.element,
+  [[maybe_unused]] auto timer = bvh_ray_timer{1};
+  auto intersection           = bvh_intersection{};
+  intersection.hit = intersect_bvh(bvh, shape, ray, intersection.element,
       intersection.uv, intersection.distance, find_any);
   return intersection;
 }
 bvh_intersection intersect_bvh(const bvh_data& bvh, const scene_data& scene,
     const ray3f& ray, bool find_any, bool non_rigid_frames) {
-  auto intersection = bvh_intersection{};
-  intersection.hit  = intersect_bvh(bvh, scene, ray, intersection.instance,
+  [[maybe_unused]] auto timer = bvh_ray_timer{1};
+  auto intersection           = bvh_intersection{};
+  intersection.hit = intersect_bvh(bvh, scene, ray, intersection.instance,
       intersection.element, intersection.uv, intersection.distance, find_any,
       non_rigid_frames);
   return intersection;
 }
 bvh_intersection intersect_bvh(const bvh_data& bvh, const scene_data& scene,
     int instance, const ray3f& ray, bool find_any, bool non_rigid_frames) {
-  auto intersection     = bvh_intersection{};
-  intersection.hit      = intersect_bvh(bvh, scene, instance, ray,
+  [[maybe_unused]] auto timer = bvh_ray_timer{1};
+  auto intersection           = bvh_intersection{};
+  intersection.hit = intersect_bvh(bvh, scene, instance, ray,
       intersection.element, intersection.uv, intersection.distance, find_any,
       non_rigid_frames);
   intersection.instance = instance;
   return intersection;
 }
 
+void intersect_bvh_packet(const bvh_data& bvh, const scene_data& scene,
+    const array<ray3f, 4>& rays, array<bvh_intersection, 4>& intersections,
+    bool find_any, bool non_rigid_frames) {
+  [[maybe_unused]] auto timer = bvh_ray_timer{4};
+  intersect_bvh<4>(
+      bvh, scene, rays, intersections, find_any, non_rigid_frames);
+}
+void intersect_bvh_packet(const bvh_data& bvh, const scene_data& scene,
+    const array<ray3f, 8>& rays, array<bvh_intersection, 8>& intersections,
+    bool find_any, bool non_rigid_frames) {
+  [[maybe_unused]] auto timer = bvh_ray_timer{8};
+  intersect_bvh<8>(
+      bvh, scene, rays, intersections, find_any, non_rigid_frames);
+}
+
 bvh_intersection overlap_bvh(const bvh_data& bvh, const scene_data& scene,
     const vec3f& pos, float max_distance, bool find_any,
     bool non_rigid_frames) {
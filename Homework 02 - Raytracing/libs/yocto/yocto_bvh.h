@@ -39,6 +39,7 @@
 // -----------------------------------------------------------------------------
 
 #include <array>
+#include <chrono>
 #include <cstdint>
 #include <memory>
 #include <string>
@@ -78,30 +79,140 @@ struct bvh_node {
   bool    internal = false;
 };
 
+// Node of a wide BVH with up to N children, collapsed from the binary tree.
+// Children bounds are stored in SoA layout, quantized to 8 bits on a grid
+// that spans the node bounds, and rounded outwards. Children refer to other
+// nodes if num is 0, to primitives if num is positive, and are empty if num
+// is negative.
+template <int N>
+struct bvh_wide_node {
+  vec3f             origin = {0, 0, 0};
+  vec3f             scale  = {0, 0, 0};
+  array<uint8_t, N> qmin_x = {};
+  array<uint8_t, N> qmin_y = {};
+  array<uint8_t, N> qmin_z = {};
+  array<uint8_t, N> qmax_x = {};
+  array<uint8_t, N> qmax_y = {};
+  array<uint8_t, N> qmax_z = {};
+  array<int32_t, N> start  = {};
+  array<int8_t, N>  num    = {};
+};
+
+// Triangle with the edges used by the intersection test precomputed.
+struct bvh_triangle {
+  vec3f p0    = {0, 0, 0};
+  vec3f edge1 = {0, 0, 0};
+  vec3f edge2 = {0, 0, 0};
+};
+
 // BVH tree stored as a node array with the tree structure is encoded using
 // array indices. BVH nodes indices refer to either the node array,
 // for internal nodes, or the primitive arrays, for leaf nodes.
 // For instance BVHs, we also store the BVH of the contained shapes.
 // Application data is not stored explicitly.
+// Wide BVHs keep only the root of the binary tree, for its bounds.
+// Triangle shapes may cache their triangles in the order of the primitive
+// array, so that leaves are intersected without indirections.
 // Additionally, we support the use of Intel Embree.
 struct bvh_data {
   vector<bvh_node>                  nodes      = {};
+  vector<bvh_wide_node<4>>          nodes4     = {};  // 4-wide nodes
+  vector<bvh_wide_node<8>>          nodes8     = {};  // 8-wide nodes
   vector<int>                       primitives = {};
+  vector<bvh_triangle>              triangles  = {};  // triangle cache
   vector<bvh_data>                  shapes     = {};                  // shapes
   unique_ptr<void, void (*)(void*)> embree_bvh = {nullptr, nullptr};  // embree
+  int64_t                           build_time = 0;  // nanoseconds
 };
 
-// Build the bvh acceleration structure.
-bvh_data make_bvh(
-    const shape_data& shape, bool highquality = false, bool embree = false);
+// Build the bvh acceleration structure. The high quality build uses a
+// binned SAH, the default one splits in the middle of the largest axis.
+// A width of 4 or 8 collapses the binary tree into a wide one, that uses
+// less memory and visits fewer nodes, but cannot be refit.
+// The triangle cache trades memory for faster leaf intersection.
+bvh_data make_bvh(const shape_data& shape, bool highquality = false,
+    bool embree = false, bool noparallel = false, int width = 2,
+    bool trianglecache = false);
 bvh_data make_bvh(const scene_data& scene, bool highquality = false,
-    bool embree = false, bool noparallel = false);
+    bool embree = false, bool noparallel = false, int width = 2,
+    bool trianglecache = false);
 
-// Refit bvh data
+// Refit bvh data. Triangle caches are recomputed from the new positions.
 void update_bvh(bvh_data& bvh, const shape_data& shape);
 void update_bvh(bvh_data& bvh, const scene_data& scene,
     const vector<int>& updated_instances, const vector<int>& updated_shapes);
 
+// BVH statistics used to compare builds. The build time is in nanoseconds,
+// and includes the shape bvhs for scene bvhs. The other values refer only to
+// the given tree. The SAH cost is the expected number of node visits and
+// primitive tests for a ray that hits the root. Bytes count nodes and
+// primitive indices, cache bytes the triangle cache.
+struct bvh_stats {
+  int64_t build_time  = 0;
+  int     nodes       = 0;
+  int     leaves      = 0;
+  int     depth       = 0;
+  float   sah_cost    = 0;
+  size_t  bytes       = 0;
+  size_t  cache_bytes = 0;
+};
+
+// Compute bvh statistics.
+bvh_stats get_bvh_stats(const bvh_data& bvh);
+
+// Ray tracing counters used to profile renders. Built with YOCTO_STATS,
+// intersection queries update the counters of the calling thread without
+// synchronization, and renderers add their samples and the time spent in
+// them. Shading time is the sampling time minus the traversal time, and
+// shades counts the shading points evaluated by the renderers. Packets count
+// node and primitive tests once for each active ray, so that per ray counts
+// compare with single ray traversal. Without
+// YOCTO_STATS, the counters stay zero. Times are in nanoseconds.
+struct bvh_counters {
+  int64_t rays       = 0;
+  int64_t nodes      = 0;
+  int64_t primitives = 0;
+  int64_t traversal  = 0;
+  int64_t samples    = 0;
+  int64_t sampling   = 0;
+  int64_t shades     = 0;
+};
+
+// Get the counters of the calling thread.
+bvh_counters& get_bvh_counters();
+
+// Add the counters of all threads to `counters` and reset them. Call it when
+// no thread is tracing, e.g. after a parallel loop.
+void collect_bvh_counters(bvh_counters& counters);
+
+// Format the counters of a render that took `seconds` as a one line summary.
+string format_bvh_counters(const bvh_counters& counters, double seconds);
+
+// Count shading points evaluated by the calling thread. Does nothing without
+// YOCTO_STATS.
+inline void count_bvh_shades([[maybe_unused]] int num = 1) {
+#ifdef YOCTO_STATS
+  get_bvh_counters().shades += num;
+#endif
+}
+
+// Scoped timer that adds samples and their time to the counters of the
+// calling thread. Does nothing without YOCTO_STATS.
+struct bvh_sample_timer {
+  int samples = 1;
+#ifdef YOCTO_STATS
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  ~bvh_sample_timer() {
+    auto& counters = get_bvh_counters();
+    counters.samples += samples;
+    counters.sampling += std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start)
+                             .count();
+  }
+#endif
+};
+
 // Results of intersect_xxx and overlap_xxx functions that include hit flag,
 // instance id, shape element id, shape element uv and intersection distance.
 // The values are all set for scene intersection. Shape intersection does not
@@ -126,6 +237,18 @@ bvh_intersection intersect_bvh(const bvh_data& bvh, const scene_data& scene,
     int instance, const ray3f& ray, bool find_any = false,
     bool non_rigid_frames = true);
 
+// Intersect packets of 4 or 8 rays with a bvh, returning the same results
+// as intersect_bvh on each ray. Packets whose directions lie in the same
+// octant are traversed together, testing all rays against each node and
+// triangle at once; the others, or rays left alone in a subtree, are
+// traced one by one.
+void intersect_bvh_packet(const bvh_data& bvh, const scene_data& scene,
+    const array<ray3f, 4>& rays, array<bvh_intersection, 4>& intersections,
+    bool find_any = false, bool non_rigid_frames = true);
+void intersect_bvh_packet(const bvh_data& bvh, const scene_data& scene,
+    const array<ray3f, 8>& rays, array<bvh_intersection, 8>& intersections,
+    bool find_any = false, bool non_rigid_frames = true);
+
 // Find a shape element that overlaps a point within a given distance
 // max distance, returning either the closest or any overlap depending on
 // `find_any`. Returns the point distance, the instance id, the shape element
@@ -80,7 +80,10 @@ string format_duration(int64_t duration) {
 string format_num(uint64_t num) {
   auto rem = num % 1000;
   auto div = num / 1000;
-  if (div > 0) return format_num(div) + "," + std::to_string(rem);
+  if (div > 0) {
+    auto digits = std::to_string(rem);
+    return format_num(div) + "," + string(3 - digits.size(), '0') + digits;
+  }
   return std::to_string(rem);
 }
 
@@ -111,6 +111,9 @@ inline void swap(int& a, int& b);
 inline size_t min(size_t a, size_t b);
 inline size_t max(size_t a, size_t b);
 
+inline int64_t min(int64_t a, int64_t b);
+inline int64_t max(int64_t a, int64_t b);
+
 }  // namespace yocto
 
 // -----------------------------------------------------------------------------
@@ -1402,6 +1405,9 @@ inline void swap(int& a, int& b) { std::swap(a, b); }
 inline size_t min(size_t a, size_t b) { return (a < b) ? a : b; }
 inline size_t max(size_t a, size_t b) { return (a > b) ? a : b; }
 
+inline int64_t min(int64_t a, int64_t b) { return (a < b) ? a : b; }
+inline int64_t max(int64_t a, int64_t b) { return (a > b) ? a : b; }
+
 }  // namespace yocto
 
 // -----------------------------------------------------------------------------
@@ -38,9 +38,14 @@
 // -----------------------------------------------------------------------------
 
 #include <atomic>
+#include <condition_variable>
 #include <deque>
+#include <exception>
+#include <functional>
 #include <future>
+#include <memory>
 #include <mutex>
+#include <string>
 #include <thread>
 #include <utility>
 #include <vector>
@@ -55,6 +60,8 @@ using std::atomic;
 using std::deque;
 using std::future;
 using std::mutex;
+using std::string;
+using std::unique_ptr;
 using std::vector;
 
 }  // namespace yocto
@@ -90,6 +97,44 @@ inline bool is_valid(const future<void>& result);
 inline bool is_running(const future<void>& result);
 inline bool is_ready(const future<void>& result);
 
+// Pool of worker threads used by all parallel algorithms. Each worker owns
+// a task deque that it uses as a stack, while idle workers steal from the
+// other end of the other deques. Threads waiting for their tasks to finish
+// run queued tasks meanwhile, so parallel algorithms can be nested, and sleep
+// when there is nothing to run.
+// The calling thread takes part in the work, so a context with `nthreads`
+// threads starts `nthreads - 1` workers. Zero uses all hardware threads.
+struct parallel_context {
+  explicit parallel_context(int nthreads = 0);
+  ~parallel_context();
+  parallel_context(const parallel_context& other) = delete;
+  parallel_context& operator=(const parallel_context& other) = delete;
+
+  struct task_queue {
+    std::mutex                   mutex = {};
+    deque<std::function<void()>> tasks = {};
+  };
+  vector<unique_ptr<task_queue>> queues  = {};  // workers, then external
+  vector<std::thread>            threads = {};
+  atomic<int>                    queued  = 0;
+  atomic<bool>                   stop    = false;
+  std::mutex                     sleep_mutex;
+  std::condition_variable        sleep_cv;  // idle workers
+  std::condition_variable        wait_cv;   // threads waiting for tasks
+};
+
+// Process-wide context used by the parallel algorithms by default.
+inline parallel_context& get_parallel_context();
+
+// Number of threads that work on a parallel algorithm, caller included.
+inline int get_num_threads(const parallel_context& context);
+
+// Runs `func` concurrently on up to `nthreads` threads of the context,
+// including the caller, and waits for all of them. Rethrows the first
+// exception thrown by `func`.
+template <typename Func>
+inline void parallel_run(parallel_context& context, int nthreads, Func&& func);
+
 // Simple parallel for used since our target platforms do not yet support
 // parallel algorithms. `Func` takes the integer index.
 template <typename T, typename Func>
@@ -126,6 +171,31 @@ template <typename T, typename Func>
 inline bool parallel_foreach(
     const vector<T>& values, string& error, Func&& func);
 
+// Same as above, but running on an explicit context.
+template <typename T, typename Func>
+inline void parallel_for(parallel_context& context, T num, Func&& func);
+template <typename T, typename Func>
+inline void parallel_for(
+    parallel_context& context, T num1, T num2, Func&& func);
+template <typename T, typename Func>
+inline void parallel_for_batch(
+    parallel_context& context, T num, T batch, Func&& func);
+template <typename T, typename Func>
+inline void parallel_foreach(
+    parallel_context& context, vector<T>& values, Func&& func);
+template <typename T, typename Func>
+inline void parallel_foreach(
+    parallel_context& context, const vector<T>& values, Func&& func);
+template <typename T, typename Func>
+inline bool parallel_for(
+    parallel_context& context, T num, string& error, Func&& func);
+template <typename T, typename Func>
+inline bool parallel_foreach(parallel_context& context, vector<T>& values,
+    string& error, Func&& func);
+template <typename T, typename Func>
+inline bool parallel_foreach(parallel_context& context,
+    const vector<T>& values, string& error, Func&& func);
+
 }  // namespace yocto
 
 // -----------------------------------------------------------------------------
@@ -183,128 +253,277 @@ inline bool is_ready(const future<void>& result) {
                                std::future_status::ready;
 }
 
+// Thread pool state of the calling thread
+inline thread_local parallel_context* parallel_thread_context = nullptr;
+inline thread_local int              parallel_thread_queue   = -1;
+
+// Queue used by the calling thread. Threads that are not workers of the
+// context share the last queue.
+inline int parallel_queue_index(const parallel_context& context) {
+  return parallel_thread_context == &context
+             ? parallel_thread_queue
+             : (int)context.queues.size() - 1;
+}
+
+// Push a task on the queue of the calling thread and wake up a worker
+inline void parallel_push(
+    parallel_context& context, std::function<void()>&& task) {
+  auto& queue = *context.queues[parallel_queue_index(context)];
+  {
+    auto lock = std::lock_guard{queue.mutex};
+    queue.tasks.push_back(std::move(task));
+  }
+  context.queued += 1;
+  { auto lock = std::lock_guard{context.sleep_mutex}; }
+  context.sleep_cv.notify_one();
+  context.wait_cv.notify_all();
+}
+
+// Pop a task from the queue of the calling thread, most recent first,
+// or steal the oldest task of another queue.
+inline bool parallel_pop(
+    parallel_context& context, std::function<void()>& task) {
+  if (context.queued == 0) return false;
+  auto num  = (int)context.queues.size();
+  auto self = parallel_queue_index(context);
+  for (auto offset = 0; offset < num; offset++) {
+    auto& queue = *context.queues[(self + offset) % num];
+    auto  lock  = std::lock_guard{queue.mutex};
+    if (queue.tasks.empty()) continue;
+    if (offset == 0) {
+      task = std::move(queue.tasks.back());
+      queue.tasks.pop_back();
+    } else {
+      task = std::move(queue.tasks.front());
+      queue.tasks.pop_front();
+    }
+    context.queued -= 1;
+    return true;
+  }
+  return false;
+}
+
+// Pool of worker threads
+inline parallel_context::parallel_context(int nthreads) {
+  if (nthreads <= 0) nthreads = (int)std::thread::hardware_concurrency();
+  if (nthreads <= 0) nthreads = 1;
+  for (auto idx = 0; idx < nthreads; idx++)
+    queues.push_back(std::make_unique<task_queue>());
+  for (auto idx = 0; idx < nthreads - 1; idx++) {
+    threads.emplace_back([this, idx]() {
+      parallel_thread_context = this;
+      parallel_thread_queue   = idx;
+      while (true) {
+        auto task = std::function<void()>{};
+        if (parallel_pop(*this, task)) {
+          task();
+          continue;
+        }
+        auto lock = std::unique_lock{sleep_mutex};
+        sleep_cv.wait(lock, [this]() { return stop || queued > 0; });
+        if (stop) return;
+      }
+    });
+  }
+}
+inline parallel_context::~parallel_context() {
+  {
+    auto lock = std::lock_guard{sleep_mutex};
+    stop      = true;
+  }
+  sleep_cv.notify_all();
+  for (auto& thread : threads) thread.join();
+}
+
+// Process-wide context used by the parallel algorithms by default.
+inline parallel_context& get_parallel_context() {
+  static auto context = parallel_context{};
+  return context;
+}
+
+// Number of threads that work on a parallel algorithm, caller included.
+inline int get_num_threads(const parallel_context& context) {
+  return (int)context.threads.size() + 1;
+}
+
+// Runs `func` concurrently on up to `nthreads` threads of the context,
+// including the caller, and waits for all of them.
+template <typename Func>
+inline void parallel_run(parallel_context& context, int nthreads, Func&& func) {
+  auto pending = atomic<int>{0};
+  auto error   = std::exception_ptr{};
+  auto emutex  = std::mutex{};
+  auto run     = [&func, &error, &emutex]() {
+    try {
+      func();
+    } catch (...) {
+      auto lock = std::lock_guard{emutex};
+      if (!error) error = std::current_exception();
+    }
+  };
+  auto helpers = std::min(nthreads, get_num_threads(context)) - 1;
+  for (auto helper = 0; helper < helpers; helper++) {
+    pending += 1;
+    parallel_push(context, [&context, &run, &pending]() {
+      run();
+      // the waiting thread may return as soon as pending is zero, so this
+      // task does not touch its locals after the decrement
+      {
+        auto lock = std::lock_guard{context.sleep_mutex};
+        pending -= 1;
+      }
+      context.wait_cv.notify_all();
+    });
+  }
+  run();
+  // help with queued work until our helpers are done, sleeping while the
+  // helpers run on other threads and nothing else is queued
+  while (pending > 0) {
+    auto task = std::function<void()>{};
+    if (parallel_pop(context, task)) {
+      task();
+      continue;
+    }
+    auto lock = std::unique_lock{context.sleep_mutex};
+    context.wait_cv.wait(
+        lock, [&]() { return pending == 0 || context.queued > 0; });
+  }
+  if (error) std::rethrow_exception(error);
+}
+
 // Simple parallel for used since our target platforms do not yet support
 // parallel algorithms. `Func` takes the integer index.
 template <typename T, typename Func>
 inline void parallel_for(T num, Func&& func) {
-  auto         futures  = vector<future<void>>{};
-  auto         nthreads = std::thread::hardware_concurrency();
+  parallel_for(get_parallel_context(), num, std::forward<Func>(func));
+}
+template <typename T, typename Func>
+inline void parallel_for(parallel_context& context, T num, Func&& func) {
   atomic<T>    next_idx(0);
   atomic<bool> has_error(false);
-  for (auto thread_id = 0; thread_id < (int)nthreads; thread_id++) {
-    futures.emplace_back(
-        std::async(std::launch::async, [&func, &next_idx, &has_error, num]() {
-          try {
-            while (true) {
-              auto idx = next_idx.fetch_add(1);
-              if (idx >= num) break;
-              if (has_error) break;
-              func(idx);
-            }
-          } catch (...) {
-            has_error = true;
-            throw;
+  parallel_run(context, (int)std::min(num, (T)(1 << 30)),
+      [&func, &next_idx, &has_error, num]() {
+        try {
+          while (true) {
+            auto idx = next_idx.fetch_add(1);
+            if (idx >= num) break;
+            if (has_error) break;
+            func(idx);
           }
-        }));
-  }
-  for (auto& f : futures) f.get();
+        } catch (...) {
+          has_error = true;
+          throw;
+        }
+      });
 }
 
 // Simple parallel for used since our target platforms do not yet support
 // parallel algorithms. `Func` takes the two integer indices.
 template <typename T, typename Func>
 inline void parallel_for(T num1, T num2, Func&& func) {
-  auto         futures  = vector<future<void>>{};
-  auto         nthreads = std::thread::hardware_concurrency();
+  parallel_for(get_parallel_context(), num1, num2, std::forward<Func>(func));
+}
+template <typename T, typename Func>
+inline void parallel_for(
+    parallel_context& context, T num1, T num2, Func&& func) {
   atomic<T>    next_idx(0);
   atomic<bool> has_error(false);
-  for (auto thread_id = 0; thread_id < (int)nthreads; thread_id++) {
-    futures.emplace_back(std::async(
-        std::launch::async, [&func, &next_idx, &has_error, num1, num2]() {
-          try {
-            while (true) {
-              auto j = next_idx.fetch_add(1);
-              if (j >= num2) break;
-              if (has_error) break;
-              for (auto i = (T)0; i < num1; i++) func(i, j);
-            }
-          } catch (...) {
-            has_error = true;
-            throw;
+  parallel_run(context, (int)std::min(num2, (T)(1 << 30)),
+      [&func, &next_idx, &has_error, num1, num2]() {
+        try {
+          while (true) {
+            auto j = next_idx.fetch_add(1);
+            if (j >= num2) break;
+            if (has_error) break;
+            for (auto i = (T)0; i < num1; i++) func(i, j);
           }
-        }));
-  }
-  for (auto& f : futures) f.get();
+        } catch (...) {
+          has_error = true;
+          throw;
+        }
+      });
 }
 
 // Simple parallel for used since our target platforms do not yet support
 // parallel algorithms. `Func` takes the integer index.
 template <typename T, typename Func>
 inline void parallel_for_batch(T num, T batch, Func&& func) {
-  auto         futures  = vector<future<void>>{};
-  auto         nthreads = std::thread::hardware_concurrency();
+  parallel_for_batch(
+      get_parallel_context(), num, batch, std::forward<Func>(func));
+}
+template <typename T, typename Func>
+inline void parallel_for_batch(
+    parallel_context& context, T num, T batch, Func&& func) {
   atomic<T>    next_idx(0);
   atomic<bool> has_error(false);
-  for (auto thread_id = 0; thread_id < (int)nthreads; thread_id++) {
-    futures.emplace_back(std::async(
-        std::launch::async, [&func, &next_idx, &has_error, num, batch]() {
-          try {
-            while (true) {
-              auto start = next_idx.fetch_add(batch);
-              if (start >= num) break;
-              if (has_error) break;
-              auto end = std::min(num, start + batch);
-              for (auto i = (T)start; i < end; i++) func(i);
-            }
-          } catch (...) {
-            has_error = true;
-            throw;
+  parallel_run(context, (int)std::min((num + batch - 1) / batch, (T)(1 << 30)),
+      [&func, &next_idx, &has_error, num, batch]() {
+        try {
+          while (true) {
+            auto start = next_idx.fetch_add(batch);
+            if (start >= num) break;
+            if (has_error) break;
+            auto end = std::min(num, start + batch);
+            for (auto i = (T)start; i < end; i++) func(i);
           }
-        }));
-  }
-  for (auto& f : futures) f.get();
+        } catch (...) {
+          has_error = true;
+          throw;
+        }
+      });
 }
 
 // Simple parallel for used since our target platforms do not yet support
 // parallel algorithms. `Func` takes a reference to a `T`.
 template <typename T, typename Func>
 inline void parallel_foreach(vector<T>& values, Func&& func) {
-  parallel_for(
-      values.size(), [&func, &values](size_t idx) { func(values[idx]); });
+  parallel_foreach(get_parallel_context(), values, std::forward<Func>(func));
 }
 template <typename T, typename Func>
 inline void parallel_foreach(const vector<T>& values, Func&& func) {
-  parallel_for(
-      values.size(), [&func, &values](size_t idx) { func(values[idx]); });
+  parallel_foreach(get_parallel_context(), values, std::forward<Func>(func));
+}
+template <typename T, typename Func>
+inline void parallel_foreach(
+    parallel_context& context, vector<T>& values, Func&& func) {
+  parallel_for(context, values.size(),
+      [&func, &values](size_t idx) { func(values[idx]); });
+}
+template <typename T, typename Func>
+inline void parallel_foreach(
+    parallel_context& context, const vector<T>& values, Func&& func) {
+  parallel_for(context, values.size(),
+      [&func, &values](size_t idx) { func(values[idx]); });
 }
 
 // Simple parallel for used since our target platforms do not yet support
 // parallel algorithms. `Func` takes the integer index.
 template <typename T, typename Func>
 inline bool parallel_for(T num, string& error, Func&& func) {
-  auto         futures  = vector<future<void>>{};
-  auto         nthreads = std::thread::hardware_concurrency();
+  return parallel_for(
+      get_parallel_context(), num, error, std::forward<Func>(func));
+}
+template <typename T, typename Func>
+inline bool parallel_for(
+    parallel_context& context, T num, string& error, Func&& func) {
   atomic<T>    next_idx(0);
   atomic<bool> has_error(false);
   mutex        error_mutex;
-  for (auto thread_id = 0; thread_id < (int)nthreads; thread_id++) {
-    futures.emplace_back(std::async(std::launch::async,
-        [&func, &next_idx, &has_error, &error_mutex, &error, num]() {
-          auto this_error = string{};
-          while (true) {
-            if (has_error) break;
-            auto idx = next_idx.fetch_add(1);
-            if (idx >= num) break;
-            if (!func(idx, this_error)) {
-              has_error = true;
-              auto _    = std::lock_guard{error_mutex};
-              error     = this_error;
-              break;
-            }
+  parallel_run(context, (int)std::min(num, (T)(1 << 30)),
+      [&func, &next_idx, &has_error, &error_mutex, &error, num]() {
+        auto this_error = string{};
+        while (true) {
+          if (has_error) break;
+          auto idx = next_idx.fetch_add(1);
+          if (idx >= num) break;
+          if (!func(idx, this_error)) {
+            has_error = true;
+            auto _    = std::lock_guard{error_mutex};
+            error     = this_error;
+            break;
           }
-        }));
-  }
-  for (auto& f : futures) f.get();
+        }
+      });
   return !(bool)has_error;
 }
 
@@ -312,16 +531,28 @@ inline bool parallel_for(T num, string& error, Func&& func) {
 // parallel algorithms. `Func` takes a reference to a `T`.
 template <typename T, typename Func>
 inline bool parallel_foreach(vector<T>& values, string& error, Func&& func) {
-  return parallel_for(
-      values.size(), error, [&func, &values](size_t idx, string& error) {
+  return parallel_foreach(
+      get_parallel_context(), values, error, std::forward<Func>(func));
+}
+template <typename T, typename Func>
+inline bool parallel_foreach(
+    const vector<T>& values, string& error, Func&& func) {
+  return parallel_foreach(
+      get_parallel_context(), values, error, std::forward<Func>(func));
+}
+template <typename T, typename Func>
+inline bool parallel_foreach(parallel_context& context, vector<T>& values,
+    string& error, Func&& func) {
+  return parallel_for(context, values.size(), error,
+      [&func, &values](size_t idx, string& error) {
         return func(values[idx], error);
       });
 }
 template <typename T, typename Func>
-inline bool parallel_foreach(
+inline bool parallel_foreach(parallel_context& context,
     const vector<T>& values, string& error, Func&& func) {
-  return parallel_for(
-      values.size(), error, [&func, &values](size_t idx, string& error) {
+  return parallel_for(context, values.size(), error,
+      [&func, &values](size_t idx, string& error) {
         return func(values[idx], error);
       });
 }
@@ -161,6 +161,14 @@ inline int sample_discrete(const vector<float>& cdf, float r);
 // Pdf for uniform discrete distribution sampling.
 inline float sample_discrete_pdf(const vector<float>& cdf, int idx);
 
+// Build the alias table of a discrete distribution represented by its cdf.
+// Each bin keeps its index with the stored probability, or picks its alias.
+inline vector<pair<float, int>> make_alias_table(const vector<float>& cdf);
+// Sample a discrete distribution represented by its alias table in constant
+// time. The bin is picked with r and the alias with s.
+inline int sample_alias(
+    const vector<pair<float, int>>& alias, float r, float s);
+
 }  // namespace yocto
 
 // -----------------------------------------------------------------------------
@@ -394,6 +402,42 @@ inline float sample_discrete_pdf(const vector<float>& cdf, int idx) {
   return cdf.at(idx) - cdf.at(idx - 1);
 }
 
+// Build the alias table of a discrete distribution, with Vose's method.
+inline vector<pair<float, int>> make_alias_table(const vector<float>& cdf) {
+  auto size  = (int)cdf.size();
+  auto alias = vector<pair<float, int>>(size, {1.0f, 0});
+  if (size == 0 || cdf.back() <= 0) return alias;
+  auto scaled = vector<double>(size);
+  for (auto idx = 0; idx < size; idx++) {
+    scaled[idx] = (double)sample_discrete_pdf(cdf, idx) / cdf.back() * size;
+  }
+  auto small = vector<int>{}, large = vector<int>{};
+  for (auto idx = 0; idx < size; idx++) {
+    (scaled[idx] < 1 ? small : large).push_back(idx);
+  }
+  while (!small.empty() && !large.empty()) {
+    auto less = small.back(), more = large.back();
+    small.pop_back();
+    alias[less] = {(float)scaled[less], more};
+    scaled[more] -= 1 - scaled[less];
+    if (scaled[more] < 1) {
+      large.pop_back();
+      small.push_back(more);
+    }
+  }
+  // leftovers are full bins, up to round-off
+  for (auto idx : small) alias[idx] = {1.0f, idx};
+  for (auto idx : large) alias[idx] = {1.0f, idx};
+  return alias;
+}
+
+// Sample a discrete distribution represented by its alias table.
+inline int sample_alias(
+    const vector<pair<float, int>>& alias, float r, float s) {
+  auto idx = clamp((int)(r * alias.size()), 0, (int)alias.size() - 1);
+  return s < alias[idx].first ? idx : alias[idx].second;
+}
+
 }  // namespace yocto
 
 #endif
@@ -29,13 +29,19 @@
 #include "yocto_scene.h"
 
 #include <algorithm>
+#include <array>
 #include <cassert>
 #include <cctype>
 #include <climits>
+#include <atomic>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <list>
 #include <memory>
+#include <mutex>
 #include <stdexcept>
+#include <type_traits>
 #include <unordered_map>
 
 #include "yocto_color.h"
@@ -101,6 +107,22 @@ ray3f eval_camera(
   }
 }
 
+// Width of the footprint of a pixel on the surface seen by a camera. The
+// cosine is clamped so that grazing angles pick the coarsest mipmaps instead
+// of an infinite footprint.
+float eval_camera_footprint(const camera_data& camera, int resolution,
+    const vec3f& position, const vec3f& normal) {
+  auto pixel     = camera.film / max(resolution, 1);
+  auto offset    = position - camera.frame.o;
+  auto direction = camera.orthographic
+                       ? transform_direction(camera.frame, {0, 0, -1})
+                       : normalize(offset);
+  auto cosine    = max(abs(dot(normal, direction)), 0.01f);
+  auto width     = camera.orthographic ? pixel
+                                       : pixel / camera.lens * length(offset);
+  return width / cosine;
+}
+
 }  // namespace yocto
 
 // -----------------------------------------------------------------------------
@@ -108,25 +130,305 @@ ray3f eval_camera(
 // -----------------------------------------------------------------------------
 namespace yocto {
 
+// Conversion from sRGB bytes to linear floats, tabulated to avoid pow.
+static const auto srgb_to_rgb_table = [] {
+  auto table = std::array<float, 256>{};
+  for (auto idx = 0; idx < 256; idx++) {
+    table[idx] = srgb_to_rgb(byte_to_float((byte)idx));
+  }
+  return table;
+}();
+
+// Conversion of texels to floats.
+static vec4f texel_to_float(const vec4f& color, bool srgb) {
+  return srgb ? srgb_to_rgb(color) : color;
+}
+static vec4f texel_to_float(const vec4b& color, bool srgb) {
+  if (srgb) {
+    return {srgb_to_rgb_table[color.x], srgb_to_rgb_table[color.y],
+        srgb_to_rgb_table[color.z], byte_to_float(color.w)};
+  } else {
+    return byte_to_float(color);
+  }
+}
+
+// Conversion between floats and half floats, rounding to nearest even.
+// Finite values beyond the half range saturate to the largest half, 65504.
+static const auto half_max = 65504.0f;
+static uint16_t float_to_half(float value) {
+  auto bits = (uint32_t)0;
+  memcpy(&bits, &value, sizeof(bits));
+  auto sign     = (uint16_t)((bits >> 16) & 0x8000);
+  auto exponent = (int)((bits >> 23) & 0xff);
+  auto mantissa = bits & 0x7fffff;
+  if (exponent == 0xff) return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+  exponent += 15 - 127;
+  if (exponent >= 31) return sign | 0x7bff;
+  auto shift = 13;
+  if (exponent <= 0) {
+    if (exponent < -10) return sign;
+    mantissa |= 0x800000;
+    shift += 1 - exponent;
+    exponent = 0;
+  }
+  auto half      = (uint32_t)(exponent << 10) + (mantissa >> shift);
+  auto remainder = mantissa & ((1u << shift) - 1);
+  auto midpoint  = 1u << (shift - 1);
+  if (remainder > midpoint || (remainder == midpoint && (half & 1))) half++;
+  if (half > 0x7bff) half = 0x7bff;
+  return sign | (uint16_t)half;
+}
+static float half_to_float(uint16_t half) {
+  auto sign     = (uint32_t)(half & 0x8000) << 16;
+  auto exponent = (uint32_t)(half >> 10) & 0x1f;
+  auto mantissa = (uint32_t)half & 0x3ff;
+  auto bits     = sign;
+  if (exponent == 0) {
+    auto value = mantissa * (1.0f / (1 << 24));
+    return sign ? -value : value;
+  } else if (exponent == 31) {
+    bits |= 0x7f800000 | (mantissa << 13);
+  } else {
+    bits |= ((exponent + 127 - 15) << 23) | (mantissa << 13);
+  }
+  auto value = 0.0f;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+// Pixel of a BC1 block, with k the pixel index in the block in row order.
+// Colors are expanded and interpolated as bytes, as done by the hardware.
+static vec4b bc1_to_byte(uint64_t block, int k) {
+  auto expand = [](uint32_t c) {
+    auto r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+    return vec3i{(int)((r << 3) | (r >> 2)), (int)((g << 2) | (g >> 4)),
+        (int)((b << 3) | (b >> 2))};
+  };
+  auto c0    = (uint32_t)(block & 0xffff);
+  auto c1    = (uint32_t)((block >> 16) & 0xffff);
+  auto index = (int)((block >> (32 + 2 * k)) & 3);
+  auto color = vec3i{0, 0, 0};
+  if (index == 0) {
+    color = expand(c0);
+  } else if (index == 1) {
+    color = expand(c1);
+  } else if (c0 > c1) {
+    color = index == 2 ? (2 * expand(c0) + expand(c1)) / 3
+                       : (expand(c0) + 2 * expand(c1)) / 3;
+  } else if (index == 2) {
+    color = (expand(c0) + expand(c1)) / 2;
+  }
+  return {(byte)color.x, (byte)color.y, (byte)color.z, 255};
+}
+
+// Encode a block of 4x4 pixels in BC1. Endpoints are the extremes of the
+// pixels along their principal axis, and pixels pick the closest color.
+static uint64_t byte_to_bc1(const array<vec4b, 16>& pixels) {
+  auto colors = array<vec3f, 16>{};
+  auto center = vec3f{0, 0, 0};
+  for (auto k = 0; k < 16; k++) {
+    colors[k] = {(float)pixels[k].x, (float)pixels[k].y, (float)pixels[k].z};
+    center += colors[k] / 16;
+  }
+  // principal axis by power iteration on the covariance
+  auto covariance = mat3f{{0, 0, 0}, {0, 0, 0}, {0, 0, 0}};
+  for (auto& color : colors) {
+    auto d = color - center;
+    covariance += mat3f{d * d.x, d * d.y, d * d.z};
+  }
+  auto axis = vec3f{1, 1, 1};
+  for (auto iteration = 0; iteration < 8; iteration++) {
+    auto next = covariance * axis;
+    if (length(next) < 1e-6f) break;
+    axis = normalize(next);
+  }
+  auto tmin = flt_max, tmax = -flt_max;
+  for (auto& color : colors) {
+    tmin = min(tmin, dot(color - center, axis));
+    tmax = max(tmax, dot(color - center, axis));
+  }
+  auto to_565 = [](const vec3f& color) {
+    auto c = clamp(color, 0, 255);
+    return (uint32_t)((int)(c.x * 31 / 255 + 0.5f) << 11) |
+           (uint32_t)((int)(c.y * 63 / 255 + 0.5f) << 5) |
+           (uint32_t)((int)(c.z * 31 / 255 + 0.5f));
+  };
+  auto c0 = to_565(center + axis * tmax), c1 = to_565(center + axis * tmin);
+  if (c0 < c1) std::swap(c0, c1);
+  auto block = (uint64_t)c0 | ((uint64_t)c1 << 16);
+  if (c0 == c1) return block;
+  auto palette = array<vec3f, 4>{};
+  for (auto index = 0; index < 4; index++) {
+    auto color = bc1_to_byte(block | ((uint64_t)index << 32), 0);
+    palette[index] = {(float)color.x, (float)color.y, (float)color.z};
+  }
+  for (auto k = 0; k < 16; k++) {
+    auto best = 0;
+    for (auto index = 1; index < 4; index++) {
+      if (distance_squared(colors[k], palette[index]) <
+          distance_squared(colors[k], palette[best]))
+        best = index;
+    }
+    block |= (uint64_t)best << (32 + 2 * k);
+  }
+  return block;
+}
+
+// Cache of texture tiles. Tiles are identified by their offset in the
+// backing file, and kept in least recently used order. The generation is
+// bumped on every eviction, so that threads drop the tiles they hold.
+struct texture_cache {
+  using tile_ptr = shared_ptr<const vector<byte>>;
+  struct entry {
+    std::list<int64_t>::iterator lru  = {};
+    tile_ptr                     tile = {};
+  };
+
+  ~texture_cache() {
+    if (file) std::fclose(file);
+  }
+
+  int64_t                            id         = 0;
+  std::FILE*                         file       = nullptr;
+  int64_t                            size       = 0;
+  int64_t                            budget     = 0;
+  std::mutex                         mutex      = {};
+  std::mutex                         file_mutex = {};
+  std::list<int64_t>                 lru        = {};
+  std::unordered_map<int64_t, entry> tiles      = {};
+  texture_cache_stats                stats      = {};
+  std::atomic<int64_t>               generation = 0;
+};
+
+// Tiled storage of a texture, with tiles of tile_size x tile_size pixels
+// stored in row order from offset in the backing file.
+struct texture_tiles {
+  shared_ptr<texture_cache> cache  = {};
+  int64_t                   offset = 0;
+  bool                      floats = false;
+};
+
+// Tile size in pixels
+static const auto texture_tile_size = 64;
+
+// Seek in files larger than 2GB.
+static bool seek_file(std::FILE* file, int64_t offset) {
+#ifdef _WIN32
+  return _fseeki64(file, offset, SEEK_SET) == 0;
+#else
+  return fseeko(file, (off_t)offset, SEEK_SET) == 0;
+#endif
+}
+
+// Get a tile from the cache, reading it from the backing file on a miss.
+static shared_ptr<const vector<byte>> get_texture_tile(
+    texture_cache& cache, int64_t offset, int64_t bytes) {
+  {
+    auto lock = std::lock_guard{cache.mutex};
+    auto it   = cache.tiles.find(offset);
+    if (it != cache.tiles.end()) {
+      cache.stats.hits += 1;
+      cache.lru.splice(cache.lru.begin(), cache.lru, it->second.lru);
+      return it->second.tile;
+    }
+    cache.stats.misses += 1;
+  }
+  auto tile = std::make_shared<vector<byte>>(bytes);
+  {
+    auto lock = std::lock_guard{cache.file_mutex};
+    if (!seek_file(cache.file, offset) ||
+        std::fread(tile->data(), 1, bytes, cache.file) != (size_t)bytes)
+      throw std::runtime_error{"cannot read texture cache"};
+  }
+  auto lock = std::lock_guard{cache.mutex};
+  auto it   = cache.tiles.find(offset);
+  if (it != cache.tiles.end()) return it->second.tile;
+  cache.lru.push_front(offset);
+  cache.tiles[offset] = {cache.lru.begin(), tile};
+  cache.stats.resident += bytes;
+  while (cache.stats.resident > cache.budget && cache.lru.size() > 1) {
+    auto evicted = cache.tiles.find(cache.lru.back());
+    cache.stats.resident -= (int64_t)evicted->second.tile->size();
+    cache.stats.evictions += 1;
+    cache.tiles.erase(evicted);
+    cache.lru.pop_back();
+    cache.generation += 1;
+  }
+  cache.stats.peak = max(cache.stats.peak, cache.stats.resident);
+  return tile;
+}
+
+// Pixel access for tiled textures. Each thread keeps the last tile it used,
+// so that most lookups of a bilinear fetch do not reach the cache. The tile
+// is fetched again after any eviction, so evicted tiles are not kept alive
+// outside the budget, and cache hits count tile fetches, not texel lookups.
+static vec4f lookup_texture_tiled(
+    const texture_data& texture, int i, int j, bool as_linear) {
+  struct last_tile {
+    int64_t                        cache      = -1;
+    int64_t                        offset     = -1;
+    int64_t                        generation = -1;
+    shared_ptr<const vector<byte>> tile       = {};
+  };
+  static thread_local auto last = last_tile{};
+  auto& tiles   = *texture.tiles;
+  auto  texel   = tiles.floats ? sizeof(vec4f) : sizeof(vec4b);
+  auto  bytes   = (int64_t)(texture_tile_size * texture_tile_size * texel);
+  auto  columns = (texture.width + texture_tile_size - 1) / texture_tile_size;
+  auto  offset  = tiles.offset +
+                 ((int64_t)(j / texture_tile_size) * columns +
+                     i / texture_tile_size) *
+                     bytes;
+  auto generation = tiles.cache->generation.load(std::memory_order_relaxed);
+  if (last.cache != tiles.cache->id || last.offset != offset ||
+      last.generation != generation) {
+    last.tile       = {};
+    last.tile       = get_texture_tile(*tiles.cache, offset, bytes);
+    last.cache      = tiles.cache->id;
+    last.offset     = offset;
+    last.generation = generation;
+  }
+  auto idx = (j % texture_tile_size) * texture_tile_size +
+             i % texture_tile_size;
+  auto srgb = as_linear && !texture.linear;
+  if (tiles.floats) {
+    return texel_to_float(((const vec4f*)last.tile->data())[idx], srgb);
+  } else {
+    return texel_to_float(((const vec4b*)last.tile->data())[idx], srgb);
+  }
+}
+
 // pixel access
 vec4f lookup_texture(
     const texture_data& texture, int i, int j, bool as_linear) {
-  auto color = vec4f{0, 0, 0, 0};
+  if (texture.tiles) return lookup_texture_tiled(texture, i, j, as_linear);
+  auto srgb = as_linear && !texture.linear;
   if (!texture.pixelsf.empty()) {
-    color = texture.pixelsf[j * texture.width + i];
-  } else {
-    color = byte_to_float(texture.pixelsb[j * texture.width + i]);
-  }
-  if (as_linear && !texture.linear) {
-    return srgb_to_rgb(color);
+    return texel_to_float(texture.pixelsf[j * texture.width + i], srgb);
+  } else if (!texture.pixelsb.empty()) {
+    return texel_to_float(texture.pixelsb[j * texture.width + i], srgb);
+  } else if (!texture.pixelsh.empty()) {
+    auto half  = &texture.pixelsh[((size_t)j * texture.width + i) * 3];
+    auto color = vec4f{
+        half_to_float(half[0]), half_to_float(half[1]), half_to_float(half[2]),
+        1};
+    return texel_to_float(color, srgb);
   } else {
-    return color;
+    auto columns = (texture.width + 3) / 4;
+    auto block   = texture.blocks[(j / 4) * columns + i / 4];
+    return texel_to_float(bc1_to_byte(block, (j % 4) * 4 + i % 4), srgb);
   }
 }
 
-// Evaluates an image at a point `uv`.
-vec4f eval_texture(const texture_data& texture, const vec2f& uv, bool as_linear,
-    bool no_interpolation, bool clamp_to_edge) {
+// Whether a texture stores float pixels.
+static bool is_float_texture(const texture_data& texture) {
+  return !texture.pixelsf.empty() || !texture.pixelsh.empty() ||
+         (texture.tiles && texture.tiles->floats);
+}
+
+// Evaluates a single mipmap level at a point `uv`.
+static vec4f eval_texture_level(const texture_data& texture, const vec2f& uv,
+    bool as_linear, bool no_interpolation, bool clamp_to_edge) {
   if (texture.width == 0 || texture.height == 0) return {0, 0, 0, 0};
 
   // get texture width/height
@@ -160,12 +462,34 @@ vec4f eval_texture(const texture_data& texture, const vec2f& uv, bool as_linear,
   }
 }
 
+// Evaluates an image at a point `uv`, blending mipmaps by level of detail.
+vec4f eval_texture(const texture_data& texture, const vec2f& uv, bool as_linear,
+    bool no_interpolation, bool clamp_to_edge, float lod) {
+  if (lod <= 0 || texture.mipmaps.empty())
+    return eval_texture_level(
+        texture, uv, as_linear, no_interpolation, clamp_to_edge);
+  auto level = [&](int level) -> const texture_data& {
+    return level == 0 ? texture : texture.mipmaps[level - 1];
+  };
+  auto levels = (int)texture.mipmaps.size();
+  if (lod >= levels)
+    return eval_texture_level(
+        level(levels), uv, as_linear, no_interpolation, clamp_to_edge);
+  auto lower  = (int)lod;
+  auto alpha  = lod - lower;
+  auto color0 = eval_texture_level(
+      level(lower), uv, as_linear, no_interpolation, clamp_to_edge);
+  auto color1 = eval_texture_level(
+      level(lower + 1), uv, as_linear, no_interpolation, clamp_to_edge);
+  return color0 * (1 - alpha) + color1 * alpha;
+}
+
 // Helpers
 vec4f eval_texture(const scene_data& scene, int texture, const vec2f& uv,
-    bool ldr_as_linear, bool no_interpolation, bool clamp_to_edge) {
+    bool ldr_as_linear, bool no_interpolation, bool clamp_to_edge, float lod) {
   if (texture == invalidid) return {1, 1, 1, 1};
-  return eval_texture(
-      scene.textures[texture], uv, ldr_as_linear, no_interpolation);
+  return eval_texture(scene.textures[texture], uv, ldr_as_linear,
+      no_interpolation, false, lod);
 }
 
 // conversion from image
@@ -180,6 +504,203 @@ texture_data image_to_texture(const image_data& image) {
   return texture;
 }
 
+// Build texture mipmaps with a box filter.
+void make_texture_mipmaps(texture_data& texture) {
+  texture.mipmaps.clear();
+  if (texture.width == 0 || texture.height == 0) return;
+  auto as_linear = !texture.linear;
+  auto source    = &texture;
+  while (source->width > 1 || source->height > 1) {
+    auto mipmap   = texture_data{};
+    mipmap.width  = max(source->width / 2, 1);
+    mipmap.height = max(source->height / 2, 1);
+    mipmap.linear = texture.linear;
+    auto pixels   = vector<vec4f>(mipmap.width * mipmap.height);
+    for (auto j = 0; j < mipmap.height; j++) {
+      for (auto i = 0; i < mipmap.width; i++) {
+        auto i0 = min(i * 2, source->width - 1);
+        auto i1 = min(i * 2 + 1, source->width - 1);
+        auto j0 = min(j * 2, source->height - 1);
+        auto j1 = min(j * 2 + 1, source->height - 1);
+        auto color = (lookup_texture(*source, i0, j0, as_linear) +
+                         lookup_texture(*source, i1, j0, as_linear) +
+                         lookup_texture(*source, i0, j1, as_linear) +
+                         lookup_texture(*source, i1, j1, as_linear)) /
+                     4;
+        pixels[j * mipmap.width + i] = as_linear ? rgb_to_srgb(color) : color;
+      }
+    }
+    if (is_float_texture(texture)) {
+      mipmap.pixelsf = std::move(pixels);
+    } else {
+      mipmap.pixelsb.resize(pixels.size());
+      float_to_byte(mipmap.pixelsb, pixels);
+    }
+    texture.mipmaps.push_back(std::move(mipmap));
+    source = &texture.mipmaps.back();
+  }
+}
+// Convert a texture, and its mipmaps, to compact storage.
+bool compress_texture(texture_data& texture, texture_compression compression) {
+  auto half = compression == texture_compression::half ||
+              compression == texture_compression::all;
+  auto bc1  = compression == texture_compression::bc1 ||
+              compression == texture_compression::all;
+  for (auto& mipmap : texture.mipmaps) compress_texture(mipmap, compression);
+  if (half && !texture.pixelsf.empty()) {
+    for (auto& pixel : texture.pixelsf) {
+      if (pixel.w != 1 || max(abs(xyz(pixel))) > half_max) return false;
+    }
+    texture.pixelsh.resize(texture.pixelsf.size() * 3);
+    for (auto idx = (size_t)0; idx < texture.pixelsf.size(); idx++) {
+      auto& pixel                  = texture.pixelsf[idx];
+      texture.pixelsh[idx * 3 + 0] = float_to_half(pixel.x);
+      texture.pixelsh[idx * 3 + 1] = float_to_half(pixel.y);
+      texture.pixelsh[idx * 3 + 2] = float_to_half(pixel.z);
+    }
+    texture.pixelsf = {};
+    return true;
+  } else if (bc1 && !texture.pixelsb.empty()) {
+    for (auto& pixel : texture.pixelsb) {
+      if (pixel.w != 255) return false;
+    }
+    auto columns = (texture.width + 3) / 4, rows = (texture.height + 3) / 4;
+    texture.blocks.resize((size_t)columns * rows);
+    for (auto bj = 0; bj < rows; bj++) {
+      for (auto bi = 0; bi < columns; bi++) {
+        auto pixels = array<vec4b, 16>{};
+        for (auto k = 0; k < 16; k++) {
+          auto i    = min(bi * 4 + k % 4, texture.width - 1);
+          auto j    = min(bj * 4 + k / 4, texture.height - 1);
+          pixels[k] = texture.pixelsb[(size_t)j * texture.width + i];
+        }
+        texture.blocks[bj * columns + bi] = byte_to_bc1(pixels);
+      }
+    }
+    texture.pixelsb = {};
+    return true;
+  } else {
+    return false;
+  }
+}
+void compress_textures(
+    scene_data& scene, texture_compression compression, bool noparallel) {
+  if (compression == texture_compression::none) return;
+  if (noparallel) {
+    for (auto& texture : scene.textures) compress_texture(texture, compression);
+  } else {
+    parallel_for(scene.textures.size(), [&](size_t idx) {
+      compress_texture(scene.textures[idx], compression);
+    });
+  }
+}
+
+// Bytes used by the pixels of scene textures.
+int64_t get_texture_bytes(const scene_data& scene) {
+  auto bytes = [](auto& bytes, const texture_data& texture) -> int64_t {
+    auto size = (int64_t)(texture.pixelsf.size() * sizeof(vec4f) +
+                          texture.pixelsb.size() * sizeof(vec4b) +
+                          texture.pixelsh.size() * sizeof(uint16_t) +
+                          texture.blocks.size() * sizeof(uint64_t));
+    for (auto& mipmap : texture.mipmaps) size += bytes(bytes, mipmap);
+    return size;
+  };
+  auto size = (int64_t)0;
+  for (auto& texture : scene.textures) size += bytes(bytes, texture);
+  return size;
+}
+
+// Write the tiles of a texture and its mipmaps to the cache file, and
+// release their pixels.
+template <typename T>
+static bool write_texture_tiles(const shared_ptr<texture_cache>& cache,
+    texture_data& texture, vector<T>& pixels, string& error) {
+  auto tiles    = std::make_shared<texture_tiles>();
+  tiles->cache  = cache;
+  tiles->offset = cache->size;
+  tiles->floats = std::is_same_v<T, vec4f>;
+  auto tile     = vector<T>(texture_tile_size * texture_tile_size);
+  for (auto tj = 0; tj < texture.height; tj += texture_tile_size) {
+    for (auto ti = 0; ti < texture.width; ti += texture_tile_size) {
+      for (auto j = 0; j < texture_tile_size; j++) {
+        for (auto i = 0; i < texture_tile_size; i++) {
+          auto pi = min(ti + i, texture.width - 1);
+          auto pj = min(tj + j, texture.height - 1);
+          tile[j * texture_tile_size + i] = pixels[pj * texture.width + pi];
+        }
+      }
+      if (std::fwrite(tile.data(), sizeof(T), tile.size(), cache->file) !=
+          tile.size()) {
+        error = "cannot write texture cache";
+        return false;
+      }
+      cache->size += (int64_t)(tile.size() * sizeof(T));
+    }
+  }
+  pixels        = {};
+  texture.tiles = tiles;
+  return true;
+}
+static bool write_texture_tiles(const shared_ptr<texture_cache>& cache,
+    texture_data& texture, string& error) {
+  if (texture.width == 0 || texture.height == 0 || texture.tiles) return true;
+  if (!texture.pixelsf.empty()) {
+    if (!write_texture_tiles(cache, texture, texture.pixelsf, error))
+      return false;
+  } else if (!texture.pixelsb.empty()) {
+    if (!write_texture_tiles(cache, texture, texture.pixelsb, error))
+      return false;
+  }
+  for (auto& mipmap : texture.mipmaps) {
+    if (!write_texture_tiles(cache, mipmap, error)) return false;
+  }
+  return true;
+}
+
+// Move the pixels of all scene textures to a cache of tiles.
+bool make_texture_cache(scene_data& scene, int64_t budget, string& error) {
+  static auto cache_id = std::atomic<int64_t>{0};
+  auto        cache    = std::make_shared<texture_cache>();
+  cache->id            = cache_id++;
+  cache->budget        = budget;
+  cache->file          = std::tmpfile();
+  if (!cache->file) {
+    error = "cannot create texture cache";
+    return false;
+  }
+  for (auto& texture : scene.textures) {
+    if (!write_texture_tiles(cache, texture, error)) return false;
+  }
+  if (std::fflush(cache->file) != 0) {
+    error = "cannot write texture cache";
+    return false;
+  }
+  return true;
+}
+
+// Texture cache statistics.
+texture_cache_stats get_texture_cache_stats(const scene_data& scene) {
+  for (auto& texture : scene.textures) {
+    if (!texture.tiles) continue;
+    auto& cache  = *texture.tiles->cache;
+    auto  lock   = std::lock_guard{cache.mutex};
+    auto  stats  = cache.stats;
+    stats.budget = cache.budget;
+    stats.size   = cache.size;
+    return stats;
+  }
+  return {};
+}
+
+void make_texture_mipmaps(scene_data& scene, bool noparallel) {
+  if (noparallel) {
+    for (auto& texture : scene.textures) make_texture_mipmaps(texture);
+  } else {
+    parallel_for(scene.textures.size(),
+        [&](size_t idx) { make_texture_mipmaps(scene.textures[idx]); });
+  }
+}
+
 }  // namespace yocto
 
 // -----------------------------------------------------------------------------
@@ -378,6 +899,36 @@ vec2f eval_texcoord(const scene_data& scene, const instance_data& instance,
   }
 }
 
+// Ratio between lengths in texcoord and world space on an element, computed
+// from their areas, or zero if the shape has no texcoords.
+static float eval_texcoord_scale(
+    const scene_data& scene, const instance_data& instance, int element) {
+  auto& shape = scene.shapes[instance.shape];
+  if (shape.texcoords.empty()) return 0;
+  auto uv_area = [&](int i0, int i1, int i2) {
+    auto& uv0 = shape.texcoords[i0];
+    return abs(cross(shape.texcoords[i1] - uv0, shape.texcoords[i2] - uv0)) /
+           2;
+  };
+  auto world_area = [&](int i0, int i1, int i2) {
+    return triangle_area(
+        transform_point(instance.frame, shape.positions[i0]),
+        transform_point(instance.frame, shape.positions[i1]),
+        transform_point(instance.frame, shape.positions[i2]));
+  };
+  auto uv = 0.0f, world = 0.0f;
+  if (!shape.triangles.empty()) {
+    auto t = shape.triangles[element];
+    uv     = uv_area(t.x, t.y, t.z);
+    world  = world_area(t.x, t.y, t.z);
+  } else if (!shape.quads.empty()) {
+    auto q = shape.quads[element];
+    uv     = uv_area(q.x, q.y, q.z) + uv_area(q.x, q.z, q.w);
+    world  = world_area(q.x, q.y, q.z) + world_area(q.x, q.z, q.w);
+  }
+  return world > 0 ? sqrt(uv / world) : 0;
+}
+
 #if 0
 // Shape element normal.
 static pair<vec3f, vec3f> eval_tangents(
@@ -527,19 +1078,40 @@ vec4f eval_color(const scene_data& scene, const instance_data& instance,
 
 // Evaluate material
 material_point eval_material(const scene_data& scene,
-    const instance_data& instance, int element, const vec2f& uv) {
+    const instance_data& instance, int element, const vec2f& uv,
+    float width) {
   auto& material = scene.materials[instance.material];
   auto  texcoord = eval_texcoord(scene, instance, element, uv);
 
+  // footprint in texture space, from the ratio of texcoord and world areas,
+  // only needed if some texture of the material has mipmaps
+  auto has_mipmaps = [&](int texture) {
+    return texture != invalidid && !scene.textures[texture].mipmaps.empty();
+  };
+  auto footprint = 0.0f;
+  if (width > 0 &&
+      (has_mipmaps(material.emission_tex) || has_mipmaps(material.color_tex) ||
+          has_mipmaps(material.roughness_tex) ||
+          has_mipmaps(material.scattering_tex))) {
+    auto scale = eval_texcoord_scale(scene, instance, element);
+    footprint  = width * scale;
+  }
+  auto lod = [&](int texture) {
+    if (footprint <= 0 || texture == invalidid) return 0.0f;
+    auto& data = scene.textures[texture];
+    return log2(footprint * max(data.width, data.height));
+  };
+
   // evaluate textures
-  auto emission_tex = eval_texture(
-      scene, material.emission_tex, texcoord, true);
-  auto color_shp     = eval_color(scene, instance, element, uv);
-  auto color_tex     = eval_texture(scene, material.color_tex, texcoord, true);
-  auto roughness_tex = eval_texture(
-      scene, material.roughness_tex, texcoord, false);
-  auto scattering_tex = eval_texture(
-      scene, material.scattering_tex, texcoord, true);
+  auto emission_tex = eval_texture(scene, material.emission_tex, texcoord,
+      true, false, false, lod(material.emission_tex));
+  auto color_shp = eval_color(scene, instance, element, uv);
+  auto color_tex = eval_texture(scene, material.color_tex, texcoord, true,
+      false, false, lod(material.color_tex));
+  auto roughness_tex  = eval_texture(scene, material.roughness_tex, texcoord,
+      false, false, false, lod(material.roughness_tex));
+  auto scattering_tex = eval_texture(scene, material.scattering_tex, texcoord,
+      true, false, false, lod(material.scattering_tex));
 
   // material point
   auto point         = material_point{};
@@ -927,7 +1499,9 @@ vector<string> scene_validation(const scene_data& scene, bool notextures) {
   auto check_empty_textures = [&errs](const scene_data& scene) {
     for (auto idx = 0; idx < (int)scene.textures.size(); idx++) {
       auto& texture = scene.textures[idx];
-      if (texture.pixelsf.empty() && texture.pixelsb.empty()) {
+      if (texture.pixelsf.empty() && texture.pixelsb.empty() &&
+          texture.pixelsh.empty() && texture.blocks.empty() &&
+          !texture.tiles) {
         errs.push_back("empty texture " + scene.texture_names[idx]);
       }
     }
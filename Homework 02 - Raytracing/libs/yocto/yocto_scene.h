@@ -54,6 +54,7 @@ namespace yocto {
 
 // using directives
 using std::pair;
+using std::shared_ptr;
 using std::string;
 using std::vector;
 
@@ -90,14 +91,24 @@ struct camera_data {
   float   aperture     = 0;
 };
 
+// Tiled storage of a texture, shared with the texture cache.
+struct texture_tiles;
+
 // Texture data as array of float or byte pixels. Textures can be stored in
-// linear or non linear color space.
+// linear or non linear color space. Textures may also hold a pyramid of
+// mipmaps, from half the resolution down to one pixel, built on request.
+// Tiled textures have no pixels, and are read through the texture cache.
+// Compressed textures store their pixels as RGB half floats or BC1 blocks.
 struct texture_data {
-  int           width   = 0;
-  int           height  = 0;
-  bool          linear  = false;
-  vector<vec4f> pixelsf = {};
-  vector<vec4b> pixelsb = {};
+  int                       width   = 0;
+  int                       height  = 0;
+  bool                      linear  = false;
+  vector<vec4f>             pixelsf = {};
+  vector<vec4b>             pixelsb = {};
+  vector<uint16_t>          pixelsh = {};  // rgb half floats
+  vector<uint64_t>          blocks  = {};  // bc1 blocks of 4x4 pixels
+  vector<texture_data>      mipmaps = {};
+  shared_ptr<texture_tiles> tiles   = {};
 };
 
 // Material type
@@ -221,6 +232,13 @@ namespace yocto {
 ray3f eval_camera(
     const camera_data& camera, const vec2f& image_uv, const vec2f& lens_uv);
 
+// Width of the footprint of a pixel on the surface seen by a camera rendered
+// at the given resolution, at the given position and normal. The footprint
+// grows with the distance from the camera and at grazing angles. Used to
+// filter textures.
+float eval_camera_footprint(const camera_data& camera, int resolution,
+    const vec3f& position, const vec3f& normal);
+
 }  // namespace yocto
 
 // -----------------------------------------------------------------------------
@@ -228,13 +246,14 @@ ray3f eval_camera(
 // -----------------------------------------------------------------------------
 namespace yocto {
 
-// Evaluates a texture
+// Evaluates a texture. A positive level of detail, given as the log2 of
+// the footprint in pixels, blends the two closest mipmaps, if present.
 vec4f eval_texture(const texture_data& texture, const vec2f& uv,
     bool as_linear = false, bool no_interpolation = false,
-    bool clamp_to_edge = false);
+    bool clamp_to_edge = false, float lod = 0);
 vec4f eval_texture(const scene_data& scene, int texture, const vec2f& uv,
     bool as_linear = false, bool no_interpolation = false,
-    bool clamp_to_edge = false);
+    bool clamp_to_edge = false, float lod = 0);
 
 // pixel access
 vec4f lookup_texture(
@@ -243,6 +262,54 @@ vec4f lookup_texture(
 // conversion from image
 texture_data image_to_texture(const image_data& image);
 
+// Build texture mipmaps with a box filter. Non-linear textures are filtered
+// in linear color space.
+void make_texture_mipmaps(texture_data& texture);
+void make_texture_mipmaps(scene_data& scene, bool noparallel = false);
+
+// Compact texture storage. Half stores float textures as RGB half floats,
+// 6 bytes per pixel. BC1 stores byte textures in blocks of 4x4 pixels made
+// of two RGB565 endpoints and 2 bits per pixel, 0.5 bytes per pixel. Both
+// drop alpha, so only opaque textures are converted. Half is also skipped for
+// textures with values beyond the half range, 65504. All uses both.
+enum struct texture_compression { none, half, bc1, all };
+
+// Texture compression names
+const auto texture_compression_names = vector<string>{
+    "none", "half", "bc1", "all"};
+
+// Convert a texture, and its mipmaps, to compact storage, returning whether
+// it was converted. Compressed textures are decoded on each lookup, and
+// cannot be saved or tiled.
+bool compress_texture(texture_data& texture, texture_compression compression);
+void compress_textures(scene_data& scene, texture_compression compression,
+    bool noparallel = false);
+
+// Bytes used by the pixels of scene textures and their mipmaps, excluding
+// tiled ones.
+int64_t get_texture_bytes(const scene_data& scene);
+
+// Move the pixels of all scene textures, and their mipmaps, to a cache of
+// 64x64 tiles, backed by a temporary file. Tiles are read on first use and
+// evicted in least recently used order once the cache exceeds the budget.
+// Lookups are safe from multiple threads. Tiled textures cannot be saved.
+// Compressed textures are left in memory.
+bool make_texture_cache(scene_data& scene, int64_t budget, string& error);
+
+// Texture cache statistics. Hits and misses count the tiles requested from
+// the cache. Lookups that fall in the last tile used by a thread are not
+// counted, since they never reach the cache. Sizes are in bytes.
+struct texture_cache_stats {
+  int64_t hits      = 0;
+  int64_t misses    = 0;
+  int64_t evictions = 0;
+  int64_t resident  = 0;
+  int64_t peak      = 0;
+  int64_t budget    = 0;
+  int64_t size      = 0;
+};
+texture_cache_stats get_texture_cache_stats(const scene_data& scene);
+
 }  // namespace yocto
 
 // -----------------------------------------------------------------------------
@@ -308,9 +375,11 @@ vec3f eval_shading_normal(const scene_data& scene,
 vec4f eval_color(const scene_data& scene, const instance_data& instance,
     int element, const vec2f& uv);
 
-// Eval material to obtain emission, brdf and opacity.
+// Eval material to obtain emission, brdf and opacity. A positive width is
+// the footprint of the ray on the surface, used to filter textures.
 material_point eval_material(const scene_data& scene,
-    const instance_data& instance, int element, const vec2f& uv);
+    const instance_data& instance, int element, const vec2f& uv,
+    float width = 0);
 // check if a material has a volume
 bool is_volumetric(const scene_data& scene, const instance_data& instance);
 
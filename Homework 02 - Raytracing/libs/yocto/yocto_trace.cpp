@@ -29,6 +29,7 @@
 #include "yocto_trace.h"
 
 #include <algorithm>
+#include <chrono>
 #include <cstring>
 #include <memory>
 #include <stdexcept>
@@ -58,6 +59,206 @@ bvh_data make_bvh(const scene_data& scene, const trace_params& params) {
 
 }  // namespace yocto
 
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION FOR LIGHT TREE
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Merge two cones of directions, given as axis and cosine of the half-angle,
+// into the smallest cone that contains both. A cosine of -1 is the sphere.
+static pair<vec3f, float> merge_cones(
+    const pair<vec3f, float>& a, const pair<vec3f, float>& b) {
+  auto theta_a = acos(clamp(a.second, -1.0f, 1.0f));
+  auto theta_b = acos(clamp(b.second, -1.0f, 1.0f));
+  auto theta_d = angle(a.first, b.first);
+  if (min(theta_d + theta_b, pif) <= theta_a) return a;
+  if (min(theta_d + theta_a, pif) <= theta_b) return b;
+  auto theta_o = (theta_a + theta_d + theta_b) / 2;
+  if (theta_o >= pif) return {a.first, -1};
+  auto rotation_axis = cross(a.first, b.first);
+  if (length(rotation_axis) == 0) return {a.first, -1};
+  auto axis = transform_direction(
+      rotation_frame(normalize(rotation_axis), theta_o - theta_a), a.first);
+  return {axis, cos(theta_o)};
+}
+
+// Bounds of an instance light. The power is the emission times the area.
+static trace_light_node make_light_bounds(
+    const scene_data& scene, const trace_light& light) {
+  auto& instance = scene.instances[light.instance];
+  auto& shape    = scene.shapes[instance.shape];
+  auto& material = scene.materials[instance.material];
+  auto  bounds   = trace_light_node{};
+  auto  elements = (int)light.elements_cdf.size();
+  for (auto& position : shape.positions) {
+    bounds.bbox = merge(bounds.bbox, transform_point(instance.frame, position));
+  }
+  auto normal = vec3f{0, 0, 0};
+  for (auto element = 0; element < elements; element++) {
+    auto area = light.elements_cdf[element] -
+                (element != 0 ? light.elements_cdf[element - 1] : 0);
+    normal += eval_element_normal(scene, instance, element) * area;
+  }
+  if (length(normal) != 0) {
+    bounds.axis      = normalize(normal);
+    bounds.cos_theta = 1;
+    for (auto element = 0; element < elements; element++) {
+      bounds.cos_theta = min(bounds.cos_theta,
+          dot(bounds.axis, eval_element_normal(scene, instance, element)));
+    }
+  } else {
+    bounds.cos_theta = -1;
+  }
+  bounds.power = mean(material.emission) * light.elements_cdf.back();
+  return bounds;
+}
+
+// Build the light tree over the instance lights, splitting in the middle of
+// the largest axis of the light centers.
+static void make_light_tree(trace_lights& lights, const scene_data& scene) {
+  // bounds of each instance light
+  auto ids     = vector<int>{};
+  auto bounds  = vector<trace_light_node>(lights.lights.size());
+  auto centers = vector<vec3f>(lights.lights.size());
+  for (auto idx = 0; idx < (int)lights.lights.size(); idx++) {
+    if (lights.lights[idx].instance == invalidid) continue;
+    ids.push_back(idx);
+    bounds[idx]  = make_light_bounds(scene, lights.lights[idx]);
+    centers[idx] = center(bounds[idx].bbox);
+  }
+  if (ids.empty()) return;
+
+  // build nodes from a stack of node, start, end
+  lights.nodes.emplace_back();
+  auto stack = vector<vec3i>{{0, 0, (int)ids.size()}};
+  while (!stack.empty()) {
+    auto [nodeid, start, end] = stack.back();
+    stack.pop_back();
+
+    // compute bounds
+    auto node  = bounds[ids[start]];
+    auto cone  = pair{node.axis, node.cos_theta};
+    auto cbbox = invalidb3f;
+    for (auto idx = start; idx < end; idx++) {
+      auto& light_bounds = bounds[ids[idx]];
+      if (idx != start) {
+        node.bbox = merge(node.bbox, light_bounds.bbox);
+        node.power += light_bounds.power;
+        cone = merge_cones(cone, {light_bounds.axis, light_bounds.cos_theta});
+      }
+      cbbox = merge(cbbox, centers[ids[idx]]);
+    }
+    node.axis      = cone.first;
+    node.cos_theta = cone.second;
+    node.parent    = lights.nodes[nodeid].parent;
+
+    // make leaf
+    if (end - start == 1) {
+      node.internal                  = false;
+      node.start                     = ids[start];
+      lights.lights[ids[start]].node = nodeid;
+      lights.nodes[nodeid]           = node;
+      continue;
+    }
+
+    // split in the middle, or at the median if all centers are on one side
+    auto csize = cbbox.max - cbbox.min;
+    auto axis  = 0;
+    if (csize.y > csize[axis]) axis = 1;
+    if (csize.z > csize[axis]) axis = 2;
+    auto middle = (cbbox.max[axis] + cbbox.min[axis]) / 2;
+    auto mid    = (int)(std::partition(ids.data() + start, ids.data() + end,
+                         [&](int id) { return centers[id][axis] < middle; }) -
+                     ids.data());
+    if (mid == start || mid == end) {
+      mid = (start + end) / 2;
+      std::nth_element(ids.data() + start, ids.data() + mid, ids.data() + end,
+          [&](int a, int b) { return centers[a][axis] < centers[b][axis]; });
+    }
+
+    // make internal node
+    node.internal        = true;
+    node.start           = (int)lights.nodes.size();
+    lights.nodes[nodeid] = node;
+    lights.nodes.emplace_back().parent = nodeid;
+    lights.nodes.emplace_back().parent = nodeid;
+    stack.push_back({node.start + 0, start, mid});
+    stack.push_back({node.start + 1, mid, end});
+  }
+}
+
+// Importance of a light tree node for a point, that bounds the power the
+// lights below it emit toward the point. Lights emit on both sides, so the
+// angle to the normals is measured to the closest side. Follows the light
+// bounds of Conty Estevez and Kulla, as described in PBRT 4.
+static float light_importance(
+    const trace_light_node& node, const vec3f& position) {
+  auto pcenter  = center(node.bbox);
+  auto radius2  = distance_squared(node.bbox.max, pcenter);
+  auto dist2    = distance_squared(position, pcenter);
+  auto dist2_cl = max(dist2, length(node.bbox.max - node.bbox.min) / 2);
+  if (dist2 <= radius2) return node.power / dist2_cl;
+
+  // angles to the node axis, the normals cone and the node bounds
+  auto cos_w = abs(dot(node.axis, normalize(position - pcenter)));
+  auto sin_w = sqrt(max(1 - cos_w * cos_w, 0.0f));
+  auto cos_o = node.cos_theta;
+  auto sin_o = sqrt(max(1 - cos_o * cos_o, 0.0f));
+  auto cos_b = sqrt(max(1 - radius2 / dist2, 0.0f));
+  auto sin_b = sqrt(max(1 - cos_b * cos_b, 0.0f));
+
+  // cosine of the smallest angle between the point and the normals
+  auto cos_wo = cos_w > cos_o ? 1 : cos_w * cos_o + sin_w * sin_o;
+  auto sin_wo = cos_w > cos_o ? 0 : sin_w * cos_o - cos_w * sin_o;
+  auto cos_p  = cos_wo > cos_b ? 1 : cos_wo * cos_b + sin_wo * sin_b;
+  if (cos_p <= 0) return 0;
+  return node.power * cos_p / dist2_cl;
+}
+
+// Sample an instance light by importance, walking down the light tree and
+// reusing the random number at each level. Returns invalidid if no light
+// emits toward the point.
+static int sample_light_tree(
+    const trace_lights& lights, const vec3f& position, float rl) {
+  auto nodeid = 0;
+  while (lights.nodes[nodeid].internal) {
+    auto& node  = lights.nodes[nodeid];
+    auto  left  = light_importance(lights.nodes[node.start + 0], position);
+    auto  right = light_importance(lights.nodes[node.start + 1], position);
+    if (left + right == 0) return invalidid;
+    auto prob = left / (left + right);
+    if (rl < prob) {
+      nodeid = node.start + 0;
+      rl     = min(rl / prob, 1 - flt_eps);
+    } else {
+      nodeid = node.start + 1;
+      rl     = min((rl - prob) / (1 - prob), 1 - flt_eps);
+    }
+  }
+  return lights.nodes[nodeid].start;
+}
+
+// Probability of sampling an instance light with the light tree, computed
+// walking up from its leaf.
+static float sample_light_tree_pdf(
+    const trace_lights& lights, int light_id, const vec3f& position) {
+  auto prob   = 1.0f;
+  auto nodeid = lights.lights[light_id].node;
+  while (lights.nodes[nodeid].parent >= 0) {
+    auto  parentid = lights.nodes[nodeid].parent;
+    auto& parent   = lights.nodes[parentid];
+    auto  siblingid = parent.start + (parent.start == nodeid ? 1 : 0);
+    auto  importance = light_importance(lights.nodes[nodeid], position);
+    if (importance == 0) return 0;
+    prob *= importance /
+            (importance + light_importance(lights.nodes[siblingid], position));
+    nodeid = parentid;
+  }
+  return prob;
+}
+
+}  // namespace yocto
+
 // -----------------------------------------------------------------------------
 // IMPLEMENTATION FOR PATH TRACING
 // -----------------------------------------------------------------------------
@@ -99,6 +300,18 @@ namespace yocto {
   return eval_material(scene, scene.instances[intersection.instance],
       intersection.element, intersection.uv);
 }
+// Material at a path vertex. Textures are filtered over the pixel footprint
+// for camera rays, and evaluated at full detail for deeper bounces.
+[[maybe_unused]] static material_point eval_material(const scene_data& scene,
+    const bvh_intersection& intersection, const vec3f& position,
+    const vec3f& normal, int bounce, const trace_params& params) {
+  auto width = bounce == 0 ? eval_camera_footprint(scene.cameras[params.camera],
+                                 params.resolution, position, normal)
+                           : 0.0f;
+  count_bvh_shades();
+  return eval_material(scene, scene.instances[intersection.instance],
+      intersection.element, intersection.uv, width);
+}
 [[maybe_unused]] static bool is_volumetric(
     const scene_data& scene, const bvh_intersection& intersection) {
   return is_volumetric(scene, scene.instances[intersection.instance]);
@@ -299,15 +512,36 @@ static ray3f sample_camera(const camera_data& camera, const vec2i& ij,
   }
 }
 
-// Sample lights wrt solid angle
-static vec3f sample_lights(const scene_data& scene, const trace_lights& lights,
-    const vec3f& position, float rl, float rel, const vec2f& ruv) {
-  auto  light_id = sample_uniform((int)lights.lights.size(), rl);
-  auto& light    = lights.lights[light_id];
+// Sample a light element with the alias table. The alias choice uses ruv.x,
+// that is then rescaled so that ruv can be reused within the element.
+static int sample_light_element(
+    const trace_light& light, float rel, vec2f& ruv) {
+  auto& alias   = light.elements_alias;
+  auto  bin     = clamp((int)(rel * alias.size()), 0, (int)alias.size() - 1);
+  auto  prob    = alias[bin].first;
+  auto  element = sample_alias(alias, rel, ruv.x);
+  ruv.x = ruv.x < prob ? ruv.x / prob : (ruv.x - prob) / (1 - prob);
+  ruv.x = clamp(ruv.x, 0.0f, 1 - flt_eps);
+  return element;
+}
+
+// Environment cells of a light, as columns and rows.
+static vec2i get_light_cells(
+    const trace_light& light, const texture_data& texture) {
+  return {(texture.width + light.cellsize - 1) / light.cellsize,
+      (texture.height + light.cellsize - 1) / light.cellsize};
+}
+
+// Sample a light wrt solid angle
+static vec3f sample_light(const scene_data& scene, const trace_light& light,
+    const vec3f& position, float rel, const vec2f& ruv_) {
+  auto ruv = ruv_;
   if (light.instance != invalidid) {
     auto& instance  = scene.instances[light.instance];
     auto& shape     = scene.shapes[instance.shape];
-    auto  element   = sample_discrete(light.elements_cdf, rel);
+    auto  element   = light.elements_alias.empty()
+                          ? sample_discrete(light.elements_cdf, rel)
+                          : sample_light_element(light, rel, ruv);
     auto  uv        = (!shape.triangles.empty()) ? sample_triangle(ruv) : ruv;
     auto  lposition = eval_position(scene, instance, element, uv);
     return normalize(lposition - position);
@@ -315,9 +549,21 @@ static vec3f sample_lights(const scene_data& scene, const trace_lights& lights,
     auto& environment = scene.environments[light.environment];
     if (environment.emission_tex != invalidid) {
       auto& emission_tex = scene.textures[environment.emission_tex];
-      auto  idx          = sample_discrete(light.elements_cdf, rel);
-      auto  uv = vec2f{((idx % emission_tex.width) + 0.5f) / emission_tex.width,
-          ((idx / emission_tex.width) + 0.5f) / emission_tex.height};
+      auto  uv           = vec2f{0, 0};
+      if (light.elements_alias.empty()) {
+        auto idx = sample_discrete(light.elements_cdf, rel);
+        uv = vec2f{((idx % emission_tex.width) + 0.5f) / emission_tex.width,
+            ((idx / emission_tex.width) + 0.5f) / emission_tex.height};
+      } else {
+        // pick a cell, then a point uniformly within its texels
+        auto cells = get_light_cells(light, emission_tex);
+        auto idx   = sample_light_element(light, rel, ruv);
+        auto ij    = vec2i{idx % cells.x, idx / cells.x} * light.cellsize;
+        auto size  = vec2i{min(light.cellsize, emission_tex.width - ij.x),
+            min(light.cellsize, emission_tex.height - ij.y)};
+        uv = vec2f{(ij.x + ruv.x * size.x) / emission_tex.width,
+            (ij.y + ruv.y * size.y) / emission_tex.height};
+      }
       return transform_direction(environment.frame,
           {cos(uv.x * 2 * pif) * sin(uv.y * pif), cos(uv.y * pif),
               sin(uv.x * 2 * pif) * sin(uv.y * pif)});
@@ -329,58 +575,151 @@ static vec3f sample_lights(const scene_data& scene, const trace_lights& lights,
   }
 }
 
+// Sample lights wrt solid angle. With a light tree, picks uniformly between
+// the environments and the tree, that samples instances by importance.
+static vec3f sample_lights(const scene_data& scene, const trace_lights& lights,
+    const vec3f& position, float rl, float rel, const vec2f& ruv) {
+  if (lights.nodes.empty()) {
+    auto light_id = sample_uniform((int)lights.lights.size(), rl);
+    return sample_light(scene, lights.lights[light_id], position, rel, ruv);
+  }
+  auto num_instances    = lights.instance_lights;
+  auto num_environments = (int)lights.lights.size() - num_instances;
+  auto choice           = sample_uniform(num_environments + 1, rl);
+  if (choice < num_environments) {
+    return sample_light(
+        scene, lights.lights[num_instances + choice], position, rel, ruv);
+  }
+  auto rtree    = min(rl * (num_environments + 1) - choice, 1 - flt_eps);
+  auto light_id = sample_light_tree(lights, position, rtree);
+  if (light_id == invalidid) return {0, 0, 0};
+  return sample_light(scene, lights.lights[light_id], position, rel, ruv);
+}
+
+// Pdf of an instance light hit at a point
+static float sample_light_pdf(const scene_data& scene,
+    const trace_light& light, const bvh_intersection& intersection,
+    const vec3f& position, const vec3f& direction) {
+  auto& instance  = scene.instances[light.instance];
+  auto  lposition = eval_position(
+      scene, instance, intersection.element, intersection.uv);
+  auto lnormal = eval_element_normal(scene, instance, intersection.element);
+  // prob triangle * area triangle = area triangle mesh
+  auto area = light.elements_cdf.back();
+  return distance_squared(lposition, position) /
+         (abs(dot(lnormal, direction)) * area);
+}
+
+// Pdf of an environment light
+static float sample_light_pdf(const scene_data& scene,
+    const trace_light& light, const vec3f& direction) {
+  auto& environment = scene.environments[light.environment];
+  if (environment.emission_tex != invalidid) {
+    auto& emission_tex = scene.textures[environment.emission_tex];
+    auto  wl = transform_direction(inverse(environment.frame), direction);
+    auto  texcoord = vec2f{
+        atan2(wl.z, wl.x) / (2 * pif), acos(clamp(wl.y, -1.0f, 1.0f)) / pif};
+    if (texcoord.x < 0) texcoord.x += 1;
+    auto i = clamp(
+        (int)(texcoord.x * emission_tex.width), 0, emission_tex.width - 1);
+    auto j = clamp(
+        (int)(texcoord.y * emission_tex.height), 0, emission_tex.height - 1);
+    if (!light.elements_alias.empty()) {
+      // cells are sampled uniformly in uv, so use the exact sine
+      auto cells = get_light_cells(light, emission_tex);
+      auto ij    = vec2i{i, j} / light.cellsize;
+      auto size  = vec2i{
+          min(light.cellsize, emission_tex.width - ij.x * light.cellsize),
+          min(light.cellsize, emission_tex.height - ij.y * light.cellsize)};
+      auto prob = sample_discrete_pdf(
+                      light.elements_cdf, ij.y * cells.x + ij.x) /
+                  light.elements_cdf.back();
+      auto angle = (2 * pif * size.x / emission_tex.width) *
+                   (pif * size.y / emission_tex.height) *
+                   max(sin(pif * texcoord.y), flt_eps);
+      return prob / angle;
+    }
+    auto prob  = sample_discrete_pdf(
+                    light.elements_cdf, j * emission_tex.width + i) /
+                light.elements_cdf.back();
+    auto angle = (2 * pif / emission_tex.width) * (pif / emission_tex.height) *
+                 sin(pif * (j + 0.5f) / emission_tex.height);
+    return prob / angle;
+  } else {
+    return 1 / (4 * pif);
+  }
+}
+
 // Sample lights pdf
 static float sample_lights_pdf(const scene_data& scene, const bvh_data& bvh,
     const trace_lights& lights, const vec3f& position, const vec3f& direction) {
-  auto pdf = 0.0f;
-  for (auto& light : lights.lights) {
-    if (light.instance != invalidid) {
-      auto& instance = scene.instances[light.instance];
-      // check all intersection
-      auto lpdf          = 0.0f;
-      auto next_position = position;
-      for (auto bounce = 0; bounce < 100; bounce++) {
-        auto intersection = intersect_bvh(
-            bvh, scene, light.instance, {next_position, direction});
-        if (!intersection.hit) break;
-        // accumulate pdf
-        auto lposition = eval_position(
-            scene, instance, intersection.element, intersection.uv);
-        auto lnormal = eval_element_normal(
-            scene, instance, intersection.element);
-        // prob triangle * area triangle = area triangle mesh
-        auto area = light.elements_cdf.back();
-        lpdf += distance_squared(lposition, position) /
-                (abs(dot(lnormal, direction)) * area);
-        // continue
-        next_position = lposition + direction * 1e-3f;
-      }
-      pdf += lpdf;
-    } else if (light.environment != invalidid) {
-      auto& environment = scene.environments[light.environment];
-      if (environment.emission_tex != invalidid) {
-        auto& emission_tex = scene.textures[environment.emission_tex];
-        auto  wl = transform_direction(inverse(environment.frame), direction);
-        auto  texcoord = vec2f{atan2(wl.z, wl.x) / (2 * pif),
-            acos(clamp(wl.y, -1.0f, 1.0f)) / pif};
-        if (texcoord.x < 0) texcoord.x += 1;
-        auto i = clamp(
-            (int)(texcoord.x * emission_tex.width), 0, emission_tex.width - 1);
-        auto j    = clamp((int)(texcoord.y * emission_tex.height), 0,
-            emission_tex.height - 1);
-        auto prob = sample_discrete_pdf(
-                        light.elements_cdf, j * emission_tex.width + i) /
-                    light.elements_cdf.back();
-        auto angle = (2 * pif / emission_tex.width) *
-                     (pif / emission_tex.height) *
-                     sin(pif * (j + 0.5f) / emission_tex.height);
-        pdf += prob / angle;
-      } else {
-        pdf += 1 / (4 * pif);
+  if (lights.nodes.empty()) {
+    auto pdf = 0.0f;
+    for (auto& light : lights.lights) {
+      if (light.instance != invalidid) {
+        // check all intersection
+        auto lpdf          = 0.0f;
+        auto next_position = position;
+        for (auto bounce = 0; bounce < 100; bounce++) {
+          auto intersection = intersect_bvh(
+              bvh, scene, light.instance, {next_position, direction});
+          if (!intersection.hit) break;
+          // accumulate pdf
+          lpdf += sample_light_pdf(
+              scene, light, intersection, position, direction);
+          // continue
+          next_position = eval_position(scene,
+                              scene.instances[light.instance],
+                              intersection.element, intersection.uv) +
+                          direction * 1e-3f;
+        }
+        pdf += lpdf;
+      } else if (light.environment != invalidid) {
+        pdf += sample_light_pdf(scene, light, direction);
       }
     }
+    pdf *= sample_uniform_pdf((int)lights.lights.size());
+    return pdf;
   }
-  pdf *= sample_uniform_pdf((int)lights.lights.size());
+
+  // with a light tree, walk the ray down the tree, as a bvh over the light
+  // bounds, and intersect only the instance lights it reaches, weighting each
+  // hit by the probability of picking its light in the tree
+  auto num_instances    = lights.instance_lights;
+  auto num_environments = (int)lights.lights.size() - num_instances;
+  auto pdf              = 0.0f;
+  for (auto idx = num_instances; idx < (int)lights.lights.size(); idx++) {
+    pdf += sample_light_pdf(scene, lights.lights[idx], direction);
+  }
+  auto ray        = ray3f{position, direction};
+  auto node_stack = array<int, 128>{};
+  auto node_cur   = 0;
+  node_stack[node_cur++] = 0;
+  while (node_cur != 0) {
+    auto& node = lights.nodes[node_stack[--node_cur]];
+    if (!intersect_bbox(ray, node.bbox)) continue;
+    if (node.internal) {
+      node_stack[node_cur++] = node.start + 0;
+      node_stack[node_cur++] = node.start + 1;
+      continue;
+    }
+    // check all intersections with the light
+    auto& light         = lights.lights[node.start];
+    auto  lpdf          = 0.0f;
+    auto  next_position = position;
+    for (auto bounce = 0; bounce < 100; bounce++) {
+      auto intersection = intersect_bvh(
+          bvh, scene, light.instance, {next_position, direction});
+      if (!intersection.hit) break;
+      lpdf += sample_light_pdf(scene, light, intersection, position, direction);
+      next_position = eval_position(scene, scene.instances[light.instance],
+                          intersection.element, intersection.uv) +
+                      direction * 1e-3f;
+    }
+    if (lpdf != 0)
+      pdf += sample_light_tree_pdf(lights, node.start, position) * lpdf;
+  }
+  pdf *= sample_uniform_pdf(num_environments + 1);
   return pdf;
 }
 
@@ -435,7 +774,8 @@ static trace_result trace_path(const scene_data& scene, const bvh_data& bvh,
       auto outgoing = -ray.d;
       auto position = eval_shading_position(scene, intersection, outgoing);
       auto normal   = eval_shading_normal(scene, intersection, outgoing);
-      auto material = eval_material(scene, intersection);
+      auto material = eval_material(
+          scene, intersection, position, normal, bounce, params);
 
       // correct roughness
       if (params.nocaustics) {
@@ -582,7 +922,8 @@ static trace_result trace_pathdirect(const scene_data& scene,
       auto outgoing = -ray.d;
       auto position = eval_shading_position(scene, intersection, outgoing);
       auto normal   = eval_shading_normal(scene, intersection, outgoing);
-      auto material = eval_material(scene, intersection);
+      auto material = eval_material(
+          scene, intersection, position, normal, bounce, params);
 
       // correct roughness
       if (params.nocaustics) {
@@ -761,7 +1102,8 @@ static trace_result trace_pathmis(const scene_data& scene, const bvh_data& bvh,
       auto outgoing = -ray.d;
       auto position = eval_shading_position(scene, intersection, outgoing);
       auto normal   = eval_shading_normal(scene, intersection, outgoing);
-      auto material = eval_material(scene, intersection);
+      auto material = eval_material(
+          scene, intersection, position, normal, bounce, params);
 
       // correct roughness
       if (params.nocaustics) {
@@ -917,7 +1259,8 @@ static trace_result trace_naive(const scene_data& scene, const bvh_data& bvh,
     auto outgoing = -ray.d;
     auto position = eval_shading_position(scene, intersection, outgoing);
     auto normal   = eval_shading_normal(scene, intersection, outgoing);
-    auto material = eval_material(scene, intersection);
+    auto material = eval_material(
+        scene, intersection, position, normal, bounce, params);
 
     // handle opacity
     if (material.opacity < 1 && rand1f(rng) >= material.opacity) {
@@ -969,9 +1312,11 @@ static trace_result trace_naive(const scene_data& scene, const bvh_data& bvh,
   return {radiance, hit, hit_albedo, hit_normal};
 }
 
-// Eyelight for quick previewing.
+// Eyelight for quick previewing. The first intersection is given, so that
+// camera rays can be intersected in packets.
 static trace_result trace_eyelight(const scene_data& scene, const bvh_data& bvh,
-    const trace_lights& lights, const ray3f& ray_, rng_state& rng,
+    const trace_lights& lights, const ray3f& ray_,
+    const bvh_intersection& intersection_, rng_state& rng,
     const trace_params& params) {
   // initialize
   auto radiance   = vec3f{0, 0, 0};
@@ -981,11 +1326,13 @@ static trace_result trace_eyelight(const scene_data& scene, const bvh_data& bvh,
   auto hit_albedo = vec3f{0, 0, 0};
   auto hit_normal = vec3f{0, 0, 0};
   auto opbounce   = 0;
+  auto first      = true;
 
   // trace  path
   for (auto bounce = 0; bounce < max(params.bounces, 4); bounce++) {
     // intersect next point
-    auto intersection = intersect_bvh(bvh, scene, ray);
+    auto intersection = first ? intersection_ : intersect_bvh(bvh, scene, ray);
+    first             = false;
     if (!intersection.hit) {
       if (bounce > 0 || !params.envhidden)
         radiance += weight * eval_environment(scene, ray.d);
@@ -996,7 +1343,8 @@ static trace_result trace_eyelight(const scene_data& scene, const bvh_data& bvh,
     auto outgoing = -ray.d;
     auto position = eval_shading_position(scene, intersection, outgoing);
     auto normal   = eval_shading_normal(scene, intersection, outgoing);
-    auto material = eval_material(scene, intersection);
+    auto material = eval_material(
+        scene, intersection, position, normal, bounce, params);
 
     // handle opacity
     if (material.opacity < 1 && rand1f(rng) >= material.opacity) {
@@ -1035,6 +1383,12 @@ static trace_result trace_eyelight(const scene_data& scene, const bvh_data& bvh,
 
   return {radiance, hit, hit_albedo, hit_normal};
 }
+static trace_result trace_eyelight(const scene_data& scene, const bvh_data& bvh,
+    const trace_lights& lights, const ray3f& ray, rng_state& rng,
+    const trace_params& params) {
+  return trace_eyelight(
+      scene, bvh, lights, ray, intersect_bvh(bvh, scene, ray), rng, params);
+}
 
 // Eyelight with ambient occlusion for quick previewing.
 static trace_result trace_eyelightao(const scene_data& scene,
@@ -1063,7 +1417,8 @@ static trace_result trace_eyelightao(const scene_data& scene,
     auto outgoing = -ray.d;
     auto position = eval_shading_position(scene, intersection, outgoing);
     auto normal   = eval_shading_normal(scene, intersection, outgoing);
-    auto material = eval_material(scene, intersection);
+    auto material = eval_material(
+        scene, intersection, position, normal, bounce, params);
 
     // handle opacity
     if (material.opacity < 1 && rand1f(rng) >= material.opacity) {
@@ -1296,6 +1651,7 @@ static sampler_func get_trace_sampler_func(const trace_params& params) {
     case trace_sampler_type::eyelightao: return trace_eyelightao;
     case trace_sampler_type::furnace: return trace_furnace;
     case trace_sampler_type::falsecolor: return trace_falsecolor;
+    case trace_sampler_type::wavefront: return trace_pathmis;
     default: {
       throw std::runtime_error("sampler unknown");
       return nullptr;
@@ -1314,6 +1670,7 @@ bool is_sampler_lit(const trace_params& params) {
     case trace_sampler_type::eyelightao: return false;
     case trace_sampler_type::furnace: return true;
     case trace_sampler_type::falsecolor: return false;
+    case trace_sampler_type::wavefront: return true;
     default: {
       throw std::runtime_error("sampler unknown");
       return false;
@@ -1321,17 +1678,27 @@ bool is_sampler_lit(const trace_params& params) {
   }
 }
 
-// Trace a block of samples
-void trace_sample(trace_state& state, const scene_data& scene,
-    const bvh_data& bvh, const trace_lights& lights, int i, int j,
+// Format the wavefront stage counters
+string format_wavefront_stats(const trace_wavefront_stats& stats) {
+  auto text = string{};
+  for (auto& [name, stage] : vector<pair<string, trace_stage_stats>>{
+           {"camera", stats.camera}, {"extend", stats.extend},
+           {"shade", stats.shade}, {"shadow", stats.shadow},
+           {"accumulate", stats.accumulate}}) {
+    auto rate = (int64_t)(stage.rays / max(stage.time, 1e-9));
+    if (!text.empty()) text += ", ";
+    text += name + " " + std::to_string(stage.rays) + " rays " +
+            std::to_string(stage.time) + "s " + std::to_string(rate) +
+            " rays/s";
+  }
+  return text;
+}
+
+// Accumulate the result of a sample for pixel idx
+static void accumulate_sample(trace_state& state, int idx, const ray3f& ray,
+    const trace_result& result, const scene_data& scene,
     const trace_params& params) {
-  auto& camera  = scene.cameras[params.camera];
-  auto  sampler = get_trace_sampler_func(params);
-  auto  idx     = state.width * j + i;
-  auto  ray     = sample_camera(camera, {i, j}, {state.width, state.height},
-      rand2f(state.rngs[idx]), rand2f(state.rngs[idx]), params.tentfilter);
-  auto [radiance, hit, albedo, normal] = sampler(
-      scene, bvh, lights, ray, state.rngs[idx], params);
+  auto [radiance, hit, albedo, normal] = result;
   if (!isfinite(radiance)) radiance = {0, 0, 0};
   if (max(radiance) > params.clamp)
     radiance = radiance * (params.clamp / max(radiance));
@@ -1348,6 +1715,396 @@ void trace_sample(trace_state& state, const scene_data& scene,
   }
 }
 
+// Trace a block of samples
+void trace_sample(trace_state& state, const scene_data& scene,
+    const bvh_data& bvh, const trace_lights& lights, int i, int j,
+    const trace_params& params) {
+  [[maybe_unused]] auto timer = bvh_sample_timer{1};
+  auto& camera                = scene.cameras[params.camera];
+  auto  sampler               = get_trace_sampler_func(params);
+  auto  idx     = state.width * j + i;
+  auto  ray     = sample_camera(camera, {i, j}, {state.width, state.height},
+      rand2f(state.rngs[idx]), rand2f(state.rngs[idx]), params.tentfilter);
+  auto  result  = sampler(scene, bvh, lights, ray, state.rngs[idx], params);
+  accumulate_sample(state, idx, ray, result, scene, params);
+}
+
+// Trace a sample for the pixels i, ..., i + count - 1 of row j with the
+// eyelight sampler, intersecting the camera rays as a packet. Gives the same
+// results as calling trace_sample on each pixel.
+static void trace_eyelight_packet(trace_state& state, const scene_data& scene,
+    const bvh_data& bvh, const trace_lights& lights, int i, int j, int count,
+    const trace_params& params) {
+  [[maybe_unused]] auto timer = bvh_sample_timer{count};
+  auto& camera                = scene.cameras[params.camera];
+  auto  rays                  = array<ray3f, 4>{};
+  auto  intersections = array<bvh_intersection, 4>{};
+  for (auto lane = 0; lane < 4; lane++) {
+    if (lane < count) {
+      auto idx   = state.width * j + i + lane;
+      rays[lane] = sample_camera(camera, {i + lane, j},
+          {state.width, state.height}, rand2f(state.rngs[idx]),
+          rand2f(state.rngs[idx]), params.tentfilter);
+    } else {
+      rays[lane] = rays[count - 1];
+    }
+  }
+  intersect_bvh_packet(bvh, scene, rays, intersections);
+  for (auto lane = 0; lane < count; lane++) {
+    auto idx    = state.width * j + i + lane;
+    auto result = trace_eyelight(scene, bvh, lights, rays[lane],
+        intersections[lane], state.rngs[idx], params);
+    accumulate_sample(state, idx, rays[lane], result, scene, params);
+  }
+}
+
+// Run a wavefront kernel over count items and add its counters
+template <typename Func>
+static void run_wavefront_kernel(trace_stage_stats& stats, int count,
+    const trace_params& params, Func&& func) {
+  auto start = std::chrono::steady_clock::now();
+  if (params.noparallel) {
+    for (auto idx = 0; idx < count; idx++) func(idx);
+  } else {
+    parallel_for(count, std::forward<Func>(func));
+  }
+  stats.time += std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start)
+                    .count();
+}
+
+// Shade one bounce of a path. Mirrors an iteration of trace_pathmis, but
+// stores the mis rays in the shadow queue instead of tracing them.
+static void shade_wavefront(trace_wavefront& wavefront, const scene_data& scene,
+    const bvh_data& bvh, const trace_lights& lights, int idx, rng_state& rng,
+    const trace_params& params) {
+  auto& ray          = wavefront.rays[idx];
+  auto& weight       = wavefront.weights[idx];
+  auto& radiance     = wavefront.radiance[idx];
+  auto  intersection = wavefront.intersections[idx];
+  auto  bounce       = wavefront.bounces[idx];
+  wavefront.shadow_weights[idx * 2 + 0] = {0, 0, 0};
+  wavefront.shadow_weights[idx * 2 + 1] = {0, 0, 0};
+  wavefront.extend[idx]                 = true;
+
+  // MIS helpers
+  auto mis_heuristic = [](float this_pdf, float other_pdf) {
+    return (this_pdf * this_pdf) /
+           (this_pdf * this_pdf + other_pdf * other_pdf);
+  };
+
+  // handle miss
+  if (!intersection.hit) {
+    if ((bounce > 0 || !params.envhidden) && wavefront.emission[idx])
+      radiance += weight * eval_environment(scene, ray.d);
+    wavefront.alive[idx] = false;
+    return;
+  }
+
+  // handle transmission if inside a volume
+  auto in_volume = false;
+  if (wavefront.in_volume[idx]) {
+    auto& vsdf     = wavefront.volumes[idx];
+    auto  distance = sample_transmittance(
+        vsdf.density, intersection.distance, rand1f(rng), rand1f(rng));
+    weight *= eval_transmittance(vsdf.density, distance) /
+              sample_transmittance_pdf(
+                  vsdf.density, distance, intersection.distance);
+    in_volume             = distance < intersection.distance;
+    intersection.distance = distance;
+  }
+
+  // switch between surface and volume
+  if (!in_volume) {
+    // prepare shading point
+    auto outgoing = -ray.d;
+    auto position = eval_shading_position(scene, intersection, outgoing);
+    auto normal   = eval_shading_normal(scene, intersection, outgoing);
+    auto material = eval_material(
+        scene, intersection, position, normal, bounce, params);
+
+    // correct roughness
+    if (params.nocaustics) {
+      wavefront.roughness[idx] = max(
+          material.roughness, wavefront.roughness[idx]);
+      material.roughness = wavefront.roughness[idx];
+    }
+
+    // handle opacity, without counting the bounce
+    if (material.opacity < 1 && rand1f(rng) >= material.opacity) {
+      if (wavefront.opbounces[idx]++ > 128) wavefront.alive[idx] = false;
+      ray = {position + ray.d * 1e-2f, ray.d};
+      return;
+    }
+
+    // set hit variables
+    if (bounce == 0) {
+      wavefront.hits[idx]    = true;
+      wavefront.albedo[idx]  = material.color;
+      wavefront.normals[idx] = normal;
+    }
+
+    // accumulate emission
+    if (wavefront.emission[idx]) {
+      radiance += weight * eval_emission(material, normal, outgoing);
+    }
+
+    // next direction
+    auto incoming = vec3f{0, 0, 0};
+    if (!is_delta(material)) {
+      // direct with MIS, queued for the shadow stage
+      for (auto sample_light : {true, false}) {
+        incoming = sample_light ? sample_lights(scene, lights, position,
+                                      rand1f(rng), rand1f(rng), rand2f(rng))
+                                : sample_bsdfcos(material, normal, outgoing,
+                                      rand1f(rng), rand2f(rng));
+        if (incoming == vec3f{0, 0, 0}) break;
+        auto bsdfcos   = eval_bsdfcos(material, normal, outgoing, incoming);
+        auto light_pdf = sample_lights_pdf(
+            scene, bvh, lights, position, incoming);
+        auto bsdf_pdf = sample_bsdfcos_pdf(
+            material, normal, outgoing, incoming);
+        auto mis_weight = sample_light
+                              ? mis_heuristic(light_pdf, bsdf_pdf) / light_pdf
+                              : mis_heuristic(bsdf_pdf, light_pdf) / bsdf_pdf;
+        if (bsdfcos != vec3f{0, 0, 0} && mis_weight != 0) {
+          auto slot                       = idx * 2 + (sample_light ? 0 : 1);
+          wavefront.shadow_rays[slot]    = {position, incoming};
+          wavefront.shadow_weights[slot] = weight * bsdfcos * mis_weight;
+        }
+      }
+
+      // indirect
+      weight *= eval_bsdfcos(material, normal, outgoing, incoming) /
+                sample_bsdfcos_pdf(material, normal, outgoing, incoming);
+      wavefront.emission[idx] = false;
+    } else {
+      incoming = sample_delta(material, normal, outgoing, rand1f(rng));
+      weight *= eval_delta(material, normal, outgoing, incoming) /
+                sample_delta_pdf(material, normal, outgoing, incoming);
+      wavefront.emission[idx] = true;
+    }
+
+    // update volume stack
+    if (is_volumetric(scene, intersection) &&
+        dot(normal, outgoing) * dot(normal, incoming) < 0) {
+      if (!wavefront.in_volume[idx]) {
+        wavefront.volumes[idx]   = eval_material(scene, intersection);
+        wavefront.in_volume[idx] = true;
+      } else {
+        wavefront.in_volume[idx] = false;
+      }
+    }
+
+    // setup next iteration
+    ray = {position, incoming};
+  } else {
+    // prepare shading point
+    auto  outgoing = -ray.d;
+    auto  position = ray.o + ray.d * intersection.distance;
+    auto& vsdf     = wavefront.volumes[idx];
+
+    // next direction
+    auto incoming = vec3f{0, 0, 0};
+    if (rand1f(rng) < 0.5f) {
+      incoming = sample_scattering(vsdf, outgoing, rand1f(rng), rand2f(rng));
+    } else {
+      incoming = sample_lights(
+          scene, lights, position, rand1f(rng), rand1f(rng), rand2f(rng));
+    }
+    weight *=
+        eval_scattering(vsdf, outgoing, incoming) /
+        (0.5f * sample_scattering_pdf(vsdf, outgoing, incoming) +
+            0.5f * sample_lights_pdf(scene, bvh, lights, position, incoming));
+    wavefront.emission[idx] = true;
+
+    // setup next iteration
+    ray = {position, incoming};
+  }
+
+  // check weight
+  if (weight == vec3f{0, 0, 0} || !isfinite(weight)) {
+    wavefront.alive[idx] = false;
+    return;
+  }
+
+  // russian roulette
+  if (bounce > 3) {
+    auto rr_prob = min((float)0.99, max(weight));
+    if (rand1f(rng) >= rr_prob) {
+      wavefront.alive[idx] = false;
+      return;
+    }
+    weight *= 1 / rr_prob;
+  }
+
+  // next bounce
+  wavefront.bounces[idx] = bounce + 1;
+  if (bounce + 1 >= params.bounces) wavefront.alive[idx] = false;
+}
+
+// Trace the shadow rays of a path, adding their emission. The bsdf ray is
+// also the next path segment, so its intersection is kept for the path.
+static void shadow_wavefront(trace_wavefront& wavefront,
+    const scene_data& scene, const bvh_data& bvh, int idx) {
+  for (auto slot = idx * 2; slot < idx * 2 + 2; slot++) {
+    if (wavefront.shadow_weights[slot] == vec3f{0, 0, 0}) continue;
+    auto& ray          = wavefront.shadow_rays[slot];
+    auto  intersection = intersect_bvh(bvh, scene, ray);
+    auto  emission     = vec3f{0, 0, 0};
+    if (!intersection.hit) {
+      emission = eval_environment(scene, ray.d);
+    } else {
+      auto& instance = scene.instances[intersection.instance];
+      auto  material = eval_material(
+          scene, instance, intersection.element, intersection.uv);
+      emission = eval_emission(material,
+          eval_shading_normal(
+              scene, instance, intersection.element, intersection.uv, -ray.d),
+          -ray.d);
+    }
+    wavefront.radiance[idx] += wavefront.shadow_weights[slot] * emission;
+    if (slot == idx * 2 + 1) {
+      wavefront.intersections[idx] = intersection;
+      wavefront.extend[idx]        = false;
+    }
+  }
+}
+
+// Trace one sample for all pixels with a wavefront path tracer. Active paths
+// are kept in a queue and advanced one bounce at a time by separate kernels
+// that extend the paths, shade them sorted by material, trace their shadow
+// rays and, at the end, accumulate them into the image. Returns early, without
+// accumulating, if `stop` is set between bounces.
+static void trace_wavefront_sample(trace_state& state,
+    trace_wavefront& wavefront, const scene_data& scene, const bvh_data& bvh,
+    const trace_lights& lights, const trace_params& params,
+    const atomic<bool>* stop) {
+  auto& camera = scene.cameras[params.camera];
+  auto& stats  = state.wavefront;
+  auto  size   = state.width * state.height;
+
+  // generate camera paths
+  wavefront.queue.resize(size);
+  run_wavefront_kernel(stats.camera, size, params, [&](int idx) {
+    [[maybe_unused]] auto timer = bvh_sample_timer{1};
+    auto& rng                   = state.rngs[idx];
+    wavefront.cameras[idx] = sample_camera(camera,
+        {idx % state.width, idx / state.width}, {state.width, state.height},
+        rand2f(rng), rand2f(rng), params.tentfilter);
+    wavefront.rays[idx]      = wavefront.cameras[idx];
+    wavefront.radiance[idx]  = {0, 0, 0};
+    wavefront.weights[idx]   = {1, 1, 1};
+    wavefront.roughness[idx] = 0;
+    wavefront.bounces[idx]   = 0;
+    wavefront.opbounces[idx] = 0;
+    wavefront.emission[idx]  = true;
+    wavefront.extend[idx]    = true;
+    wavefront.alive[idx]     = params.bounces > 0;
+    wavefront.in_volume[idx] = false;
+    wavefront.hits[idx]      = false;
+    wavefront.albedo[idx]    = {0, 0, 0};
+    wavefront.normals[idx]   = {0, 0, 0};
+    wavefront.queue[idx]     = idx;
+  });
+  stats.camera.rays += size;
+  if (params.bounces <= 0) wavefront.queue.clear();
+
+  // advance the paths one bounce at a time
+  while (!wavefront.queue.empty()) {
+    if (stop != nullptr && *stop) return;
+    auto count = (int)wavefront.queue.size();
+
+    // extend
+    run_wavefront_kernel(stats.extend, count, params, [&](int k) {
+      [[maybe_unused]] auto timer = bvh_sample_timer{0};
+      auto idx                    = wavefront.queue[k];
+      if (!wavefront.extend[idx]) return;
+      wavefront.intersections[idx] = intersect_bvh(
+          bvh, scene, wavefront.rays[idx]);
+    });
+    for (auto idx : wavefront.queue) stats.extend.rays += wavefront.extend[idx];
+
+    // sort by material with a counting sort, misses first
+    auto material_key = [&](int idx) {
+      auto& intersection = wavefront.intersections[idx];
+      return intersection.hit
+                 ? scene.instances[intersection.instance].material + 1
+                 : 0;
+    };
+    wavefront.counts.assign(scene.materials.size() + 2, 0);
+    for (auto idx : wavefront.queue) wavefront.counts[material_key(idx) + 1]++;
+    for (auto key = 1; key < (int)wavefront.counts.size(); key++) {
+      wavefront.counts[key] += wavefront.counts[key - 1];
+    }
+    wavefront.sorted.resize(count);
+    for (auto idx : wavefront.queue) {
+      wavefront.sorted[wavefront.counts[material_key(idx)]++] = idx;
+    }
+
+    // shade
+    run_wavefront_kernel(stats.shade, count, params, [&](int k) {
+      [[maybe_unused]] auto timer = bvh_sample_timer{0};
+      auto idx                    = wavefront.sorted[k];
+      shade_wavefront(
+          wavefront, scene, bvh, lights, idx, state.rngs[idx], params);
+    });
+    stats.shade.rays += count;
+
+    // shadow
+    run_wavefront_kernel(stats.shadow, count, params, [&](int k) {
+      [[maybe_unused]] auto timer = bvh_sample_timer{0};
+      shadow_wavefront(wavefront, scene, bvh, wavefront.sorted[k]);
+    });
+
+    // compact the queue, keeping the material order
+    wavefront.queue.clear();
+    for (auto idx : wavefront.sorted) {
+      for (auto slot = idx * 2; slot < idx * 2 + 2; slot++) {
+        stats.shadow.rays += wavefront.shadow_weights[slot] != vec3f{0, 0, 0};
+      }
+      if (wavefront.alive[idx]) wavefront.queue.push_back(idx);
+    }
+  }
+
+  // accumulate
+  run_wavefront_kernel(stats.accumulate, size, params, [&](int idx) {
+    accumulate_sample(state, idx, wavefront.cameras[idx],
+        {wavefront.radiance[idx], (bool)wavefront.hits[idx],
+            wavefront.albedo[idx], wavefront.normals[idx]},
+        scene, params);
+  });
+  stats.accumulate.rays += size;
+}
+
+// Size the wavefront path states for the image. The arrays are kept in the
+// state, so they are allocated only when the image size changes.
+static void init_wavefront(
+    trace_wavefront& wavefront, const trace_state& state) {
+  auto size = (size_t)state.width * (size_t)state.height;
+  if (wavefront.cameras.size() == size) return;
+  wavefront.cameras.resize(size);
+  wavefront.rays.resize(size);
+  wavefront.intersections.resize(size);
+  wavefront.radiance.resize(size);
+  wavefront.weights.resize(size);
+  wavefront.roughness.resize(size);
+  wavefront.bounces.resize(size);
+  wavefront.opbounces.resize(size);
+  wavefront.emission.resize(size);
+  wavefront.extend.resize(size);
+  wavefront.alive.resize(size);
+  wavefront.in_volume.resize(size);
+  wavefront.volumes.resize(size);
+  wavefront.hits.resize(size);
+  wavefront.albedo.resize(size);
+  wavefront.normals.resize(size);
+  wavefront.shadow_rays.resize(size * 2);
+  wavefront.shadow_weights.resize(size * 2);
+  wavefront.queue.reserve(size);
+  wavefront.sorted.reserve(size);
+}
+
 // Init a sequence of random number generators.
 trace_state make_state(const scene_data& scene, const trace_params& params) {
   auto& camera = scene.cameras[params.camera];
@@ -1379,7 +2136,8 @@ static trace_light& add_light(trace_lights& lights) {
 
 // Init trace lights
 trace_lights make_lights(const scene_data& scene, const trace_params& params) {
-  auto lights = trace_lights{};
+  auto lights      = trace_lights{};
+  lights.instances = vector<int>(scene.instances.size(), invalidid);
 
   for (auto handle = 0; handle < scene.instances.size(); handle++) {
     auto& instance = scene.instances[handle];
@@ -1387,9 +2145,10 @@ trace_lights make_lights(const scene_data& scene, const trace_params& params) {
     if (material.emission == vec3f{0, 0, 0}) continue;
     auto& shape = scene.shapes[instance.shape];
     if (shape.triangles.empty() && shape.quads.empty()) continue;
-    auto& light       = add_light(lights);
-    light.instance    = handle;
-    light.environment = invalidid;
+    lights.instances[handle] = (int)lights.lights.size();
+    auto& light              = add_light(lights);
+    light.instance           = handle;
+    light.environment        = invalidid;
     if (!shape.triangles.empty()) {
       light.elements_cdf = vector<float>(shape.triangles.size());
       for (auto idx = 0; idx < light.elements_cdf.size(); idx++) {
@@ -1408,17 +2167,39 @@ trace_lights make_lights(const scene_data& scene, const trace_params& params) {
         if (idx != 0) light.elements_cdf[idx] += light.elements_cdf[idx - 1];
       }
     }
+    if (params.lightsalias) {
+      light.elements_alias = make_alias_table(light.elements_cdf);
+    }
   }
+  lights.instance_lights = (int)lights.lights.size();
   for (auto handle = 0; handle < scene.environments.size(); handle++) {
     auto& environment = scene.environments[handle];
     if (environment.emission == vec3f{0, 0, 0}) continue;
     auto& light       = add_light(lights);
     light.instance    = invalidid;
     light.environment = handle;
-    if (environment.emission_tex != invalidid) {
+    if (environment.emission_tex != invalidid && params.lightsalias) {
+      // sum the texels of each cell, weighted by their solid angle
+      auto& texture      = scene.textures[environment.emission_tex];
+      light.cellsize     = max(params.envcellsize, 1);
+      auto cells         = get_light_cells(light, texture);
+      light.elements_cdf = vector<float>(cells.x * cells.y, 0);
+      for (auto j = 0; j < texture.height; j++) {
+        auto th = (j + 0.5f) * pif / texture.height;
+        for (auto i = 0; i < texture.width; i++) {
+          auto cell = (j / light.cellsize) * cells.x + i / light.cellsize;
+          light.elements_cdf[cell] += max(lookup_texture(texture, i, j)) *
+                                      sin(th);
+        }
+      }
+      for (auto idx = (size_t)1; idx < light.elements_cdf.size(); idx++) {
+        light.elements_cdf[idx] += light.elements_cdf[idx - 1];
+      }
+      light.elements_alias = make_alias_table(light.elements_cdf);
+    } else if (environment.emission_tex != invalidid) {
       auto& texture      = scene.textures[environment.emission_tex];
       light.elements_cdf = vector<float>(texture.width * texture.height);
-      for (auto idx = 0; idx < light.elements_cdf.size(); idx++) {
+      for (auto idx = 0; idx < (int)light.elements_cdf.size(); idx++) {
         auto ij    = vec2i{idx % texture.width, idx / texture.width};
         auto th    = (ij.y + 0.5f) * pif / texture.height;
         auto value = lookup_texture(texture, ij.x, ij.y);
@@ -1428,6 +2209,9 @@ trace_lights make_lights(const scene_data& scene, const trace_params& params) {
     }
   }
 
+  // build the light tree over the instance lights
+  if (params.lighttree) make_light_tree(lights, scene);
+
   // handle progress
   return lights;
 }
@@ -1437,29 +2221,64 @@ image_data trace_image(const scene_data& scene, const trace_params& params) {
   auto bvh    = make_bvh(scene, params);
   auto lights = make_lights(scene, params);
   auto state  = make_state(scene, params);
-  for (auto sample = 0; sample < params.samples; sample++) {
+  while (state.samples < params.samples) {
     trace_samples(state, scene, bvh, lights, params);
   }
   return get_render(state);
 }
 
 // Progressively compute an image by calling trace_samples multiple times.
+// Each call adds up to `params.batch` samples per pixel in a single parallel
+// dispatch. Each pixel has its own rng, so the result does not depend on the
+// batch size.
 void trace_samples(trace_state& state, const scene_data& scene,
     const bvh_data& bvh, const trace_lights& lights,
-    const trace_params& params) {
+    const trace_params& params, const atomic<bool>* stop) {
   if (state.samples >= params.samples) return;
-  if (params.noparallel) {
+  auto nsamples = clamp(params.batch, 1, params.samples - state.samples);
+  auto stopped  = [stop]() { return stop != nullptr && (bool)*stop; };
+  if (params.sampler == trace_sampler_type::wavefront) {
+    init_wavefront(state.paths, state);
+    for (auto sample = 0; sample < nsamples; sample++) {
+      if (stopped()) return;
+      trace_wavefront_sample(
+          state, state.paths, scene, bvh, lights, params, stop);
+    }
+  } else if (params.sampler == trace_sampler_type::eyelight) {
+    auto trace_row = [&](int j) {
+      for (auto sample = 0; sample < nsamples; sample++) {
+        if (stopped()) return;
+        for (auto i = 0; i < state.width; i += 4) {
+          trace_eyelight_packet(
+              state, scene, bvh, lights, i, j, min(4, state.width - i), params);
+        }
+      }
+    };
+    if (params.noparallel) {
+      for (auto j = 0; j < state.height; j++) trace_row(j);
+    } else {
+      parallel_for(state.height, trace_row);
+    }
+  } else if (params.noparallel) {
     for (auto j = 0; j < state.height; j++) {
       for (auto i = 0; i < state.width; i++) {
-        trace_sample(state, scene, bvh, lights, i, j, params);
+        for (auto sample = 0; sample < nsamples; sample++) {
+          if (stopped()) return;
+          trace_sample(state, scene, bvh, lights, i, j, params);
+        }
       }
     }
   } else {
     parallel_for(state.width, state.height, [&](int i, int j) {
-      trace_sample(state, scene, bvh, lights, i, j, params);
+      for (auto sample = 0; sample < nsamples; sample++) {
+        if (stopped()) return;
+        trace_sample(state, scene, bvh, lights, i, j, params);
+      }
     });
   }
-  state.samples += 1;
+  if (stopped()) return;
+  state.samples += nsamples;
+  collect_bvh_counters(state.counters);
 }
 
 // Check image type
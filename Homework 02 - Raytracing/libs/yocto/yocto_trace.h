@@ -79,6 +79,7 @@ enum struct trace_sampler_type {
   eyelightao,  // eyelight with ambient occlusion
   furnace,     // furnace test
   falsecolor,  // false color rendering
+  wavefront,   // path tracing with mis, one bounce at a time over the image
 };
 // Type of false color visualization
 enum struct trace_falsecolor_type {
@@ -107,6 +108,9 @@ struct trace_params {
   uint64_t              seed           = trace_default_seed;
   bool                  embreebvh      = false;
   bool                  highqualitybvh = false;
+  bool                  lighttree      = false;
+  bool                  lightsalias    = false;
+  int                   envcellsize    = 1;
   bool                  noparallel     = false;
   int                   pratio         = 8;
   float                 exposure       = 0;
@@ -126,30 +130,105 @@ image_data trace_image(const scene_data& scene, const trace_params& params);
 namespace yocto {
 
 // Scene lights used during rendering. These are created automatically.
+// Elements are sampled with the alias table if present, or with the cdf.
+// Environments are sampled by cells of cellsize texels per side.
 struct trace_light {
-  int           instance     = invalidid;
-  int           environment  = invalidid;
-  vector<float> elements_cdf = {};
+  int                      instance       = invalidid;
+  int                      environment    = invalidid;
+  vector<float>            elements_cdf   = {};
+  vector<pair<float, int>> elements_alias = {};
+  int                      cellsize       = 1;
+  int                      node = invalidid;  // leaf in the light tree
 };
 
-// Scene lights
+// Node of the light tree. Bounds the positions, the emitted power and the
+// cone of normals of the instance lights below it. Internal nodes have their
+// children at start and start + 1, leaves store the light index in start.
+struct trace_light_node {
+  bbox3f bbox      = invalidb3f;
+  vec3f  axis      = {0, 0, 1};
+  float  cos_theta = 1;
+  float  power     = 0;
+  int    start     = 0;
+  int    parent    = -1;
+  bool   internal  = false;
+};
+
+// Scene lights. With a light tree, instance lights are sampled by their
+// importance for the shaded point, and environments uniformly with the tree
+// as a whole. Without it, all lights are sampled uniformly. Instance lights
+// are stored first, followed by the environments.
 struct trace_lights {
-  vector<trace_light> lights = {};
+  vector<trace_light>      lights          = {};
+  vector<trace_light_node> nodes           = {};  // light tree
+  vector<int>              instances       = {};  // light of each instance
+  int                      instance_lights = 0;   // number of instance lights
 };
 
 // Check is a sampler requires lights
 bool is_sampler_lit(const trace_params& params);
 
+// Counters of a wavefront stage, as rays traced or paths processed, and the
+// time spent in the stage in seconds.
+struct trace_stage_stats {
+  int64_t rays = 0;
+  double  time = 0;
+};
+
+// Counters of the wavefront stages, summed over all samples. Camera ray
+// generation is counted apart from the extend stage.
+struct trace_wavefront_stats {
+  trace_stage_stats camera     = {};
+  trace_stage_stats extend     = {};
+  trace_stage_stats shade      = {};
+  trace_stage_stats shadow     = {};
+  trace_stage_stats accumulate = {};
+};
+
+// Format the wavefront stage counters on one line, with the rays, the time
+// and the rate of each stage, in the style of format_bvh_counters.
+string format_wavefront_stats(const trace_wavefront_stats& stats);
+
+// Path states of a wavefront, as arrays indexed by pixel, since each pixel
+// has at most one path in flight. Each path has two shadow rays, for the
+// light and the bsdf samples of mis, with a zero weight if not traced.
+struct trace_wavefront {
+  vector<ray3f>            cameras        = {};
+  vector<ray3f>            rays           = {};
+  vector<bvh_intersection> intersections  = {};
+  vector<vec3f>            radiance       = {};
+  vector<vec3f>            weights        = {};
+  vector<float>            roughness      = {};
+  vector<int>              bounces        = {};
+  vector<int>              opbounces      = {};
+  vector<uint8_t>          emission       = {};  // accumulate emission next
+  vector<uint8_t>          extend         = {};  // intersect the ray next
+  vector<uint8_t>          alive          = {};
+  vector<uint8_t>          in_volume      = {};
+  vector<material_point>   volumes        = {};
+  vector<uint8_t>          hits           = {};
+  vector<vec3f>            albedo         = {};
+  vector<vec3f>            normals        = {};
+  vector<ray3f>            shadow_rays    = {};
+  vector<vec3f>            shadow_weights = {};
+  vector<int>              queue          = {};  // active paths
+  vector<int>              sorted         = {};  // active paths by material
+  vector<int>              counts         = {};
+};
+
 // Trace state
 struct trace_state {
-  int               width   = 0;
-  int               height  = 0;
-  int               samples = 0;
-  vector<vec4f>     image   = {};
-  vector<vec3f>     albedo  = {};
-  vector<vec3f>     normal  = {};
-  vector<int>       hits    = {};
-  vector<rng_state> rngs    = {};
+  int                   width     = 0;
+  int                   height    = 0;
+  int                   samples   = 0;
+  vector<vec4f>         image     = {};
+  vector<vec3f>         albedo    = {};
+  vector<vec3f>         normal    = {};
+  vector<int>           hits      = {};
+  vector<rng_state>     rngs      = {};
+  trace_wavefront_stats wavefront = {};
+  trace_wavefront       paths     = {};  // wavefront sampler buffers
+  bvh_counters          counters  = {};  // with YOCTO_STATS
 };
 
 // Initialize state.
@@ -161,10 +240,12 @@ trace_lights make_lights(const scene_data& scene, const trace_params& params);
 // Build the bvh acceleration structure.
 bvh_data make_bvh(const scene_data& scene, const trace_params& params);
 
-// Progressively computes an image.
+// Progressively computes an image. Adds `params.batch` samples per call.
+// If `stop` is given and set during the call, returns as soon as the current
+// samples are done, leaving a partial batch that should be discarded.
 void trace_samples(trace_state& state, const scene_data& scene,
     const bvh_data& bvh, const trace_lights& lights,
-    const trace_params& params);
+    const trace_params& params, const atomic<bool>* stop = nullptr);
 void trace_sample(trace_state& state, const scene_data& scene,
     const bvh_data& bvh, const trace_lights& lights, int i, int j,
     const trace_params& params);
@@ -198,7 +279,7 @@ namespace yocto {
 
 // trace sampler names
 inline const auto trace_sampler_names = vector<string>{"path", "pathdirect",
-    "pathmis", "naive", "eyelight", "eyelightao", "furnace", "falsecolor"};
+    "pathmis", "naive", "eyelight", "eyelightao", "furnace", "falsecolor", "wavefront"};
 
 // false color names
 inline const auto trace_falsecolor_names = vector<string>{"position", "normal",
@@ -215,7 +296,8 @@ inline const auto trace_sampler_labels =
         {trace_sampler_type::eyelight, "eyelight"},
         {trace_sampler_type::eyelightao, "eyelightao"},
         {trace_sampler_type::furnace, "furnace"},
-        {trace_sampler_type::falsecolor, "falsecolor"}};
+        {trace_sampler_type::falsecolor, "falsecolor"},
+        {trace_sampler_type::wavefront, "wavefront"}};
 
 // false color labels
 inline const auto trace_falsecolor_labels =
@@ -522,15 +522,9 @@ void view_scene(const string& title, const string& name, scene_data& scene,
 
     // start renderer
     render_worker = std::async(std::launch::async, [&]() {
-      for (auto sample = 0; sample < params.samples; sample += params.batch) {
+      while (state.samples < params.samples) {
         if (render_stop) return;
-        parallel_for(state.width, state.height, [&](int i, int j) {
-          for (auto s = 0; s < params.batch; s++) {
-            if (render_stop) return;
-            trace_sample(state, scene, bvh, lights, i, j, params);
-          }
-        });
-        state.samples += params.batch;
+        trace_samples(state, scene, bvh, lights, params, &render_stop);
         if (!render_stop) {
           auto lock      = std::lock_guard{render_mutex};
           render_current = state.samples;
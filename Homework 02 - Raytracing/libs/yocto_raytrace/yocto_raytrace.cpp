@@ -28,10 +28,15 @@
 
 #include "yocto_raytrace.h"
 
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+
 #include <yocto/yocto_cli.h>
 #include <yocto/yocto_geometry.h>
 #include <yocto/yocto_parallel.h>
 #include <yocto/yocto_sampling.h>
+#include <yocto/yocto_sceneio.h>
 #include <yocto/yocto_shading.h>
 #include <yocto/yocto_shape.h>
 
@@ -96,6 +101,16 @@ namespace yocto {
         return r_zero + (1 - r_zero) * pow((1 - cosine), 5);
     }
 
+// Width of the footprint of a ray at its intersection, used to filter
+// textures. Only camera rays are tracked, deeper bounces use full detail.
+// Without mipmaps there is nothing to filter, so no footprint is computed.
+static float eval_footprint(const scene_data& scene, const vec3f& position,
+    const vec3f& normal, int bounce, const raytrace_params& params) {
+  if (!params.mipmaps || bounce != 0) return 0;
+  return eval_camera_footprint(
+      scene.cameras[params.camera], params.resolution, position, normal);
+}
+
 // Raytrace renderer.
     static vec4f shade_raytrace(const scene_data& scene, const bvh_scene& bvh, const ray3f& ray, int bounce, rng_state& rng, const raytrace_params& params) {
         // YOUR CODE GOES HERE ----
@@ -104,10 +119,11 @@ namespace yocto {
             //Ricaviamo instance, shape e materiale dall'intersezione
             auto& instance = scene.instances[intersection.instance];
             auto& shape = scene.shapes[instance.shape];
-            auto& material = eval_material(scene, instance, intersection.element, intersection.uv);
+            count_bvh_shades();
             //Ricaviamo come da traccia posizione, normale e radiance
             auto position = transform_point(instance.frame, eval_position(shape, intersection.element, intersection.uv));
             auto normal = transform_direction(instance.frame, eval_normal(shape, intersection.element, intersection.uv));
+            auto material = eval_material(scene, instance, intersection.element, intersection.uv, eval_footprint(scene, position, normal, bounce, params));
             auto radiance = rgb_to_rgba(material.emission);
 
             //-----------------------
@@ -250,6 +266,161 @@ namespace yocto {
         return rgb_to_rgba(eval_environment(scene, ray.d));
     }
 
+// Iterative path tracing. Follows the same shading rules of shade_raytrace,
+// but carries a throughput weight and a single continuation ray per path, so
+// that the cost per sample grows linearly with the number of bounces. Where
+// shade_raytrace recurses twice, one of the two continuations is picked at
+// random and its weight doubled, which leaves the estimate unchanged.
+static vec4f shade_pathtrace(const scene_data& scene, const bvh_scene& bvh,
+    const ray3f& ray_, int bounce_, rng_state& rng,
+    const raytrace_params& params) {
+  // initialize
+  auto radiance = vec4f{0, 0, 0, 0};
+  auto weight   = vec4f{1, 1, 1, 1};
+  auto ray      = ray_;
+  auto opbounce = 0;
+
+  // trace path
+  for (auto bounce = bounce_; true; bounce++) {
+    // intersect next point
+    auto intersection = intersect_bvh(bvh, scene, ray);
+    if (!intersection.hit) {
+      radiance += weight * rgb_to_rgba(eval_environment(scene, ray.d));
+      break;
+    }
+
+    // prepare shading point
+    auto& instance = scene.instances[intersection.instance];
+    auto& shape    = scene.shapes[instance.shape];
+    count_bvh_shades();
+    auto position = transform_point(instance.frame,
+        eval_position(shape, intersection.element, intersection.uv));
+    auto normal   = transform_direction(instance.frame,
+        eval_normal(shape, intersection.element, intersection.uv));
+    auto material = eval_material(scene, instance, intersection.element,
+        intersection.uv,
+        eval_footprint(scene, position, normal, bounce, params));
+
+    // accumulate emission
+    radiance += weight * rgb_to_rgba(material.emission);
+
+    // handle opacity, that continues the ray in addition to scattering
+    auto passthrough = rand1f(rng) < 1 - material.opacity;
+    if (passthrough && opbounce++ > 128) break;
+    if (bounce >= params.bounces) {
+      if (!passthrough) break;
+      ray = {position, ray.d};
+      continue;
+    }
+    if (passthrough) {
+      weight *= 2;
+      if (rand1f(rng) < 0.5f) {
+        ray = {position, ray.d};
+        continue;
+      }
+    }
+
+    // flip normal toward the viewer
+    if (!shape.points.empty()) {
+      normal = -ray.d;
+    } else if (!shape.lines.empty()) {
+      normal = orthonormalize(-ray.d, normal);
+    } else if (!shape.triangles.empty()) {
+      if (dot(-ray.d, normal) < 0) normal = -normal;
+    }
+
+    // next direction
+    auto incoming = vec3f{0, 0, 0};
+    if (params.wet && material.type != material_type::transparent) {
+      auto exponent   = 2 / pow(material.roughness, 2);
+      auto wet_normal = sample_hemisphere_cospower(
+          exponent, normal, rand2f(rng));
+      if (material.roughness == 0) {
+        incoming = reflect(-ray.d, wet_normal);
+      } else {
+        auto halfway = sample_hemisphere_cospower(
+            exponent, wet_normal, rand2f(rng));
+        incoming = reflect(-ray.d, halfway);
+      }
+      weight *= rgb_to_rgba(material.color) *
+                shade_wet(material.color, intersection.uv, params) *
+                (instance.material == 0 ? 0.75f : 0.30f);
+    } else if (material.type == material_type::matte) {
+      // pick either the uniform or the cosine lobe of shade_raytrace
+      if (rand1f(rng) < 0.5f) {
+        incoming = sample_hemisphere(normal, rand2f(rng));
+        weight *= 2 * (2 * pi) * rgb_to_rgba(material.color) / pi *
+                  dot(normal, incoming);
+      } else {
+        incoming = sample_hemisphere_cos(normal, rand2f(rng));
+        weight *= 2 * rgb_to_rgba(material.color) / pi * dot(normal, incoming);
+      }
+    } else if (material.type == material_type::reflective) {
+      auto exponent     = 2 / pow(material.roughness, 2);
+      auto metal_normal = sample_hemisphere_cospower(
+          exponent, normal, rand2f(rng));
+      if (material.roughness == 0) {
+        incoming = reflect(-ray.d, metal_normal);
+      } else {
+        auto halfway = sample_hemisphere_cospower(
+            exponent, metal_normal, rand2f(rng));
+        incoming = reflect(-ray.d, halfway);
+      }
+      weight *= rgb_to_rgba(material.color);
+    } else if (material.type == material_type::glossy) {
+      auto exponent = 2 / pow(material.roughness, 2);
+      auto halfway  = sample_hemisphere_cospower(exponent, normal, rand2f(rng));
+      if (rand1f(rng) < fresnel_schlick(vec3f{0.04}, halfway, -ray.d).x) {
+        incoming = reflect(-ray.d, halfway);
+      } else {
+        incoming = sample_hemisphere_cos(normal, rand2f(rng));
+        weight *= rgb_to_rgba(material.color);
+      }
+    } else if (material.type == material_type::transparent) {
+      if (rand1f(rng) < fresnel_schlick(vec3f{0.04}, normal, -ray.d).x) {
+        incoming = reflect(-ray.d, normal);
+      } else {
+        incoming = ray.d;
+        weight *= rgb_to_rgba(material.color);
+      }
+    } else if (material.type == material_type::refractive) {
+      if (rand1f(rng) < fresnel_schlick(vec3f{0.04}, normal, -ray.d).x) {
+        incoming = reflect(-ray.d, normal);
+      } else {
+        auto cos_theta = fmin(dot(-ray.d, normal), 1.0);
+        auto sin_theta = sqrt(1.0 - pow(cos_theta, 2));
+        if (dot(normal, -ray.d) < 0) {
+          material.ior = 1.0f / material.ior;
+          normal       = -normal;
+        }
+        if (material.ior * sin_theta <= 1 ||
+            reflectance(cos_theta, material.ior) < rand1f(rng)) {
+          incoming = refract(-ray.d, normal, material.ior);
+          weight *= rgb_to_rgba(material.color);
+        } else {
+          incoming = reflect(-ray.d, normal);
+        }
+      }
+    } else {
+      break;
+    }
+
+    // check weight
+    if (weight == vec4f{0, 0, 0, 0} || !isfinite(weight)) break;
+
+    // russian roulette
+    if (bounce >= params.roulette) {
+      auto rr_prob = min(0.99f, max(xyz(weight)));
+      if (rand1f(rng) >= rr_prob) break;
+      weight *= 1 / rr_prob;
+    }
+
+    // setup next iteration
+    ray = {position, incoming};
+  }
+
+  return radiance;
+}
 // Matte renderer.
 static vec4f shade_matte(const scene_data& scene, const bvh_scene& bvh, const ray3f& ray, int bounce, rng_state& rng, const raytrace_params& params) {
     // YOUR CODE GOES HERE ----
@@ -257,7 +428,8 @@ static vec4f shade_matte(const scene_data& scene, const bvh_scene& bvh, const ra
     if (intersection.hit) {
         auto& instance = scene.instances[intersection.instance];
         auto& shape = scene.shapes[instance.shape];
-        auto& material = eval_material(scene, instance, intersection.element, intersection.uv);
+        count_bvh_shades();
+        auto material = eval_material(scene, instance, intersection.element, intersection.uv);
         //Ricaviamo come da traccia posizione e normale
         auto position = transform_point(instance.frame, eval_position(shape, intersection.element, intersection.uv));
         auto normal = transform_direction(instance.frame, eval_normal(shape, intersection.element, intersection.uv));
@@ -272,10 +444,10 @@ static vec4f shade_matte(const scene_data& scene, const bvh_scene& bvh, const ra
     return rgb_to_rgba(eval_environment(scene, ray.d));
 }
 
-// Eyelight renderer.
-static vec4f shade_eyelight(const scene_data& scene, const bvh_scene& bvh, const ray3f& ray, int bounce, rng_state& rng, const raytrace_params& params) {
-    // YOUR CODE GOES HERE ----
-    bvh_intersection intersection = intersect_bvh(bvh, scene, ray);
+// Eyelight renderer. The shading of the eyelight, normal and color
+// renderers is split from the intersection, so that raytrace_samples can
+// intersect packets of primary rays at once.
+static vec4f shade_eyelight(const scene_data& scene, const ray3f& ray, const bvh_intersection& intersection) {
     if (intersection.hit) {
         //Ricaviamo instance e shape dall'intersezione
         auto& instance = scene.instances[intersection.instance];
@@ -289,10 +461,12 @@ static vec4f shade_eyelight(const scene_data& scene, const bvh_scene& bvh, const
     }
     return {0.0f};
 }
-
-static vec4f shade_normal(const scene_data& scene, const bvh_scene& bvh,  const ray3f& ray, int bounce, rng_state& rng, const raytrace_params& params) {
+static vec4f shade_eyelight(const scene_data& scene, const bvh_scene& bvh, const ray3f& ray, int bounce, rng_state& rng, const raytrace_params& params) {
     // YOUR CODE GOES HERE ----
-    auto intersection = intersect_bvh(bvh, scene, ray);
+    return shade_eyelight(scene, ray, intersect_bvh(bvh, scene, ray));
+}
+
+static vec4f shade_normal(const scene_data& scene, const ray3f& ray, const bvh_intersection& intersection) {
     if (intersection.hit) {
         //Ricaviamo instance e shape dall'intersezione
         auto& instance = scene.instances[intersection.instance];
@@ -302,6 +476,10 @@ static vec4f shade_normal(const scene_data& scene, const bvh_scene& bvh,  const
     }
     return {0.0f};
 }
+static vec4f shade_normal(const scene_data& scene, const bvh_scene& bvh,  const ray3f& ray, int bounce, rng_state& rng, const raytrace_params& params) {
+    // YOUR CODE GOES HERE ----
+    return shade_normal(scene, ray, intersect_bvh(bvh, scene, ray));
+}
 
 static vec4f shade_texcoord(const scene_data& scene, const bvh_scene& bvh, const ray3f& ray, int bounce, rng_state& rng, const raytrace_params& params) {
     // YOUR CODE GOES HERE ----
@@ -316,17 +494,20 @@ static vec4f shade_texcoord(const scene_data& scene, const bvh_scene& bvh, const
     return {0.0f};
 }
 
-static vec4f shade_color(const scene_data& scene, const bvh_scene& bvh, const ray3f& ray, int bounce, rng_state& rng, const raytrace_params& params) {
-    // YOUR CODE GOES HERE ----
-    auto intersection = intersect_bvh(bvh, scene, ray);
+static vec4f shade_color(const scene_data& scene, const ray3f& ray, const bvh_intersection& intersection) {
     if (intersection.hit) {
         //Ricaviamo instance dall'intersezione
         auto& instance = scene.instances[intersection.instance];
+        count_bvh_shades();
         //Effettuiamo un "lookup" del colore del materiale attraverso gli indici presenti in instance
         return rgb_to_rgba(eval_material(scene, instance, intersection.element, intersection.uv).color);
     }
     return {0.0f};
 }
+static vec4f shade_color(const scene_data& scene, const bvh_scene& bvh, const ray3f& ray, int bounce, rng_state& rng, const raytrace_params& params) {
+    // YOUR CODE GOES HERE ----
+    return shade_color(scene, ray, intersect_bvh(bvh, scene, ray));
+}
 
 // Trace a single ray from the camera using the given algorithm.
 using raytrace_shader_func = vec4f (*)(const scene_data& scene,
@@ -335,6 +516,7 @@ using raytrace_shader_func = vec4f (*)(const scene_data& scene,
 static raytrace_shader_func get_shader(const raytrace_params& params) {
   switch (params.shader) {
     case raytrace_shader_type::raytrace: return shade_raytrace;
+    case raytrace_shader_type::pathtrace: return shade_pathtrace;
     case raytrace_shader_type::matte: return shade_matte;
     case raytrace_shader_type::eyelight: return shade_eyelight;
     case raytrace_shader_type::normal: return shade_normal;
@@ -347,9 +529,39 @@ static raytrace_shader_func get_shader(const raytrace_params& params) {
   }
 }
 
+// Shade a camera ray given its first intersection. Only the shaders that
+// do not trace further rays have one, and they are used with packets.
+using raytrace_packet_shader_func = vec4f (*)(const scene_data& scene,
+    const ray3f& ray, const bvh_intersection& intersection);
+static raytrace_packet_shader_func get_packet_shader(
+    const raytrace_params& params) {
+  switch (params.shader) {
+    case raytrace_shader_type::eyelight: return shade_eyelight;
+    case raytrace_shader_type::normal: return shade_normal;
+    case raytrace_shader_type::color: return shade_color;
+    default: return nullptr;
+  }
+}
+
+// Check the params that the command line ranges cannot express.
+bool check_params(const raytrace_params& params, string& error) {
+  if (params.bvhwidth != 2 && params.bvhwidth != 4 && params.bvhwidth != 8) {
+    error = "bvh width should be 2, 4 or 8";
+    return false;
+  }
+  auto& region = params.region;
+  if (region != vec4i{0, 0, 0, 0} &&
+      (region.x >= region.z || region.y >= region.w)) {
+    error = "region should have x0 < x1 and y0 < y1";
+    return false;
+  }
+  return true;
+}
+
 // Build the bvh acceleration structure.
 bvh_scene make_bvh(const scene_data& scene, const raytrace_params& params) {
-  return make_bvh(scene, false, false, params.noparallel);
+  return make_bvh(scene, params.highqualitybvh, false, params.noparallel,
+      params.bvhwidth, params.trianglecache);
 }
 
 // Init a sequence of random number generators.
@@ -358,63 +570,438 @@ raytrace_state make_state(
   auto& camera = scene.cameras[params.camera];
   auto  state  = raytrace_state{};
   if (camera.aspect >= 1) {
-    state.width  = params.resolution;
-    state.height = (int)round(params.resolution / camera.aspect);
+    state.frame = {
+        params.resolution, (int)round(params.resolution / camera.aspect)};
   } else {
-    state.height = params.resolution;
-    state.width  = (int)round(params.resolution * camera.aspect);
+    state.frame = {
+        (int)round(params.resolution * camera.aspect), params.resolution};
+  }
+  auto& region = params.region;
+  if (region != vec4i{0, 0, 0, 0}) {
+    if (region.x >= region.z || region.y >= region.w)
+      throw std::invalid_argument{"region should have x0 < x1 and y0 < y1"};
+    state.offset = {clamp(region.x, 0, state.frame.x),
+        clamp(region.y, 0, state.frame.y)};
+    state.width  = clamp(region.z, 0, state.frame.x) - state.offset.x;
+    state.height = clamp(region.w, 0, state.frame.y) - state.offset.y;
+    if (state.width <= 0 || state.height <= 0)
+      throw std::invalid_argument{"region outside the frame of size " +
+                                  std::to_string(state.frame.x) + "x" +
+                                  std::to_string(state.frame.y)};
+  } else {
+    state.offset = {0, 0};
+    state.width  = state.frame.x;
+    state.height = state.frame.y;
   }
   state.samples = 0;
   state.image.assign(state.width * state.height, {0, 0, 0, 0});
   state.hits.assign(state.width * state.height, 0);
+  state.mean.assign(state.width * state.height, 0);
+  state.m2.assign(state.width * state.height, 0);
   state.rngs.assign(state.width * state.height, {});
+  // seeds are drawn for all frame pixels, keeping the ones in the region
   auto rng_ = make_rng(1301081);
-  for (auto& rng : state.rngs) {
-    rng = make_rng(961748941ull, rand1i(rng_, 1 << 31) / 2 + 1);
+  for (auto j = 0; j < state.frame.y; j++) {
+    for (auto i = 0; i < state.frame.x; i++) {
+      auto seed = rand1i(rng_, 1 << 31) / 2 + 1;
+      auto ri = i - state.offset.x, rj = j - state.offset.y;
+      if (ri < 0 || ri >= state.width || rj < 0 || rj >= state.height)
+        continue;
+      state.rngs[rj * state.width + ri] = make_rng(961748941ull, seed);
+    }
   }
   return state;
 }
 
+// Split the region rendered by state in square tiles, sorted in Morton order
+// so that tiles handed out close in time are also close on the image. Tiles
+// are aligned to the frame, and returned in region coordinates.
+static vector<vec4i> make_tiles(const raytrace_state& state, int tile_size) {
+  auto morton = [](int x, int y) {
+    auto spread = [](uint32_t v) {
+      v = (v | (v << 8)) & 0x00ff00ffu;
+      v = (v | (v << 4)) & 0x0f0f0f0fu;
+      v = (v | (v << 2)) & 0x33333333u;
+      v = (v | (v << 1)) & 0x55555555u;
+      return v;
+    };
+    return spread((uint32_t)x) | (spread((uint32_t)y) << 1);
+  };
+  tile_size   = max(tile_size, 1);
+  auto& start = state.offset;
+  auto  end   = state.offset + vec2i{state.width, state.height};
+  auto  tiles = vector<vec4i>{};
+  for (auto ty = start.y / tile_size; ty * tile_size < end.y; ty++) {
+    for (auto tx = start.x / tile_size; tx * tile_size < end.x; tx++) {
+      tiles.push_back({max(tx * tile_size, start.x) - start.x,
+          max(ty * tile_size, start.y) - start.y,
+          min((tx + 1) * tile_size, end.x) - start.x,
+          min((ty + 1) * tile_size, end.y) - start.y});
+    }
+  }
+  std::sort(tiles.begin(), tiles.end(), [&](const vec4i& a, const vec4i& b) {
+    return morton((a.x + start.x) / tile_size, (a.y + start.y) / tile_size) <
+           morton((b.x + start.x) / tile_size, (b.y + start.y) / tile_size);
+  });
+  return tiles;
+}
+
+// Add a sample to pixel idx, updating its luminance statistics.
+static void accumulate_sample(raytrace_state& state, int idx, vec4f radiance) {
+  if (!isfinite(radiance)) radiance = {0, 0, 0};
+  state.image[idx] += radiance;
+  state.hits[idx] += 1;
+  auto value = luminance(xyz(radiance));
+  auto delta = value - state.mean[idx];
+  state.mean[idx] += delta / state.hits[idx];
+  state.m2[idx] += delta * (value - state.mean[idx]);
+}
+
+// Check whether all pixels of a tile have converged. The relative error
+// of a pixel is the standard error of its mean luminance over the mean
+// itself, with dark pixels compared to a small floor instead. Pixels of a
+// tile always have the same number of samples, that is checked only at
+// multiples of the warm-up count. Stopping whole tiles, instead of single
+// pixels, avoids darkening pixels whose bright samples are rare.
+static bool is_converged(const raytrace_state& state, const vec4i& tile,
+    const raytrace_params& params) {
+  auto count  = state.hits[state.width * tile.y + tile.x];
+  auto warmup = max(params.adaptivewarmup, 2);
+  if (params.adaptive <= 0 || count < warmup || count % warmup != 0)
+    return false;
+  for (auto j = tile.y; j < tile.w; j++) {
+    for (auto i = tile.x; i < tile.z; i++) {
+      auto idx   = state.width * j + i;
+      auto error = sqrt(state.m2[idx] / (float)(count - 1) / (float)count);
+      if (error > params.adaptive * max(state.mean[idx], 0.001f)) return false;
+    }
+  }
+  return true;
+}
+
+// Trace a single sample for pixel i, j.
+static void raytrace_sample(raytrace_state& state, const scene_data& scene,
+    const bvh_scene& bvh, raytrace_shader_func shader, int i, int j,
+    const raytrace_params& params) {
+  [[maybe_unused]] auto timer = bvh_sample_timer{1};
+  auto& camera                = scene.cameras[params.camera];
+  auto  idx                   = state.width * j + i;
+  auto  puv    = params.samples == 1 ? vec2f{0.5f, 0.5f}
+                                     : rand2f(state.rngs[idx]);
+  auto  ray    = eval_camera(camera,
+      {(state.offset.x + i + puv.x) / state.frame.x,
+          (state.offset.y + j + puv.y) / state.frame.y});
+  auto  radiance = shader(scene, bvh, ray, 0, state.rngs[idx], params);
+  accumulate_sample(state, idx, radiance);
+}
+
+// Trace a single sample for the pixels i, ..., i + count - 1 of row j,
+// intersecting the camera rays as a packet. Consumes the same random
+// numbers as raytrace_sample, so the two give the same image.
+static void raytrace_packet(raytrace_state& state, const scene_data& scene,
+    const bvh_scene& bvh, raytrace_packet_shader_func shader, int i, int j,
+    int count, const raytrace_params& params) {
+  [[maybe_unused]] auto timer = bvh_sample_timer{count};
+  auto& camera                = scene.cameras[params.camera];
+  auto  rays          = array<ray3f, 8>{};
+  auto  intersections = array<bvh_intersection, 8>{};
+  for (auto lane = 0; lane < 8; lane++) {
+    auto idx   = state.width * j + i + min(lane, count - 1);
+    auto puv   = params.samples == 1 || lane >= count
+                     ? vec2f{0.5f, 0.5f}
+                     : rand2f(state.rngs[idx]);
+    rays[lane] = eval_camera(camera,
+        {(state.offset.x + i + min(lane, count - 1) + puv.x) / state.frame.x,
+            (state.offset.y + j + puv.y) / state.frame.y});
+  }
+  intersect_bvh_packet(bvh, scene, rays, intersections);
+  for (auto lane = 0; lane < count; lane++) {
+    auto idx = state.width * j + i + lane;
+    accumulate_sample(
+        state, idx, shader(scene, rays[lane], intersections[lane]));
+  }
+}
+
+// Ray of a sorted wave, carrying the pixel it contributes to and the weight
+// of its contribution to that pixel.
+struct raytrace_wave_ray {
+  ray3f ray    = {};
+  vec4f weight = {1, 1, 1, 1};
+  int   idx    = 0;
+  int   bounce = 0;
+};
+
+// Sort key of a ray, made of the octant of its direction followed by the
+// Morton code of its origin, quantized on a 10 bits grid over bounds.
+static uint32_t ray_sort_key(const ray3f& ray, const bbox3f& bounds) {
+  auto spread = [](uint32_t v) {
+    v = (v | (v << 16)) & 0x030000ffu;
+    v = (v | (v << 8)) & 0x0300f00fu;
+    v = (v | (v << 4)) & 0x030c30c3u;
+    v = (v | (v << 2)) & 0x09249249u;
+    return v;
+  };
+  auto octant = (uint32_t)(ray.d.x < 0) | ((uint32_t)(ray.d.y < 0) << 1) |
+                ((uint32_t)(ray.d.z < 0) << 2);
+  auto uvw    = clamp((ray.o - bounds.min) / max(size(bounds), 1e-6f), 0, 1);
+  auto grid   = vec3i{(int)(uvw.x * 1023), (int)(uvw.y * 1023),
+      (int)(uvw.z * 1023)};
+  return (octant << 30) | spread((uint32_t)grid.x) |
+         (spread((uint32_t)grid.y) << 1) | (spread((uint32_t)grid.z) << 2);
+}
+
+// Shade a ray of the wave given its intersection, following the rules of
+// shade_raytrace. Emission and environment are added to the pixel radiance,
+// while the rays that shade_raytrace would trace recursively are added to
+// the next wave, with their weight multiplied by the one of this ray.
+static void shade_raytrace_wave(const scene_data& scene,
+    const raytrace_wave_ray& wray, const bvh_intersection& intersection,
+    vector<vec4f>& radiance, vector<raytrace_wave_ray>& next,
+    rng_state& rng, const raytrace_params& params) {
+  auto& ray    = wray.ray;
+  auto  weight = wray.weight;
+  auto  bounce = wray.bounce;
+  auto  trace  = [&](const vec3f& position, const vec3f& incoming,
+                   const vec4f& scale) {
+    next.push_back({{position, incoming}, weight * scale, wray.idx,
+        bounce + 1});
+  };
+  if (!intersection.hit) {
+    radiance[wray.idx] += weight * rgb_to_rgba(eval_environment(scene, ray.d));
+    return;
+  }
+
+  // prepare shading point
+  auto& instance = scene.instances[intersection.instance];
+  auto& shape    = scene.shapes[instance.shape];
+  count_bvh_shades();
+  auto position = transform_point(instance.frame,
+      eval_position(shape, intersection.element, intersection.uv));
+  auto normal   = transform_direction(instance.frame,
+      eval_normal(shape, intersection.element, intersection.uv));
+  auto material = eval_material(scene, instance, intersection.element,
+      intersection.uv,
+      eval_footprint(scene, position, normal, bounce, params));
+
+  // materials not handled by shade_raytrace return the environment
+  auto passthrough = rand1f(rng) < 1 - material.opacity;
+  auto wet = params.wet && material.type != material_type::transparent;
+  if (bounce < params.bounces && !wet &&
+      material.type != material_type::matte &&
+      material.type != material_type::reflective &&
+      material.type != material_type::glossy &&
+      material.type != material_type::transparent &&
+      material.type != material_type::refractive) {
+    radiance[wray.idx] += weight * rgb_to_rgba(eval_environment(scene, ray.d));
+    return;
+  }
+
+  // emission and opacity
+  radiance[wray.idx] += weight * rgb_to_rgba(material.emission);
+  if (passthrough) trace(position, ray.d, {1, 1, 1, 1});
+  if (bounce >= params.bounces) return;
+
+  // flip normal toward the viewer
+  if (!shape.points.empty()) {
+    normal = -ray.d;
+  } else if (!shape.lines.empty()) {
+    normal = orthonormalize(-ray.d, normal);
+  } else if (!shape.triangles.empty()) {
+    if (dot(-ray.d, normal) < 0) normal = -normal;
+  }
+
+  // scatter
+  auto color = rgb_to_rgba(material.color);
+  if (wet) {
+    auto exponent   = 2 / pow(material.roughness, 2);
+    auto wet_normal = sample_hemisphere_cospower(exponent, normal, rand2f(rng));
+    auto incoming   = vec3f{0, 0, 0};
+    if (material.roughness == 0) {
+      incoming = reflect(-ray.d, wet_normal);
+    } else {
+      auto halfway = sample_hemisphere_cospower(
+          exponent, wet_normal, rand2f(rng));
+      incoming = reflect(-ray.d, halfway);
+    }
+    trace(position, incoming,
+        color * shade_wet(material.color, intersection.uv, params) *
+            (instance.material == 0 ? 0.75f : 0.30f));
+  } else if (material.type == material_type::matte) {
+    auto indirect = sample_hemisphere(normal, rand2f(rng));
+    trace(position, indirect,
+        (2 * pi) * color / pi * dot(normal, indirect));
+    auto incoming = sample_hemisphere_cos(normal, rand2f(rng));
+    trace(position, incoming, color / pi * dot(normal, incoming));
+  } else if (material.type == material_type::reflective) {
+    auto exponent     = 2 / pow(material.roughness, 2);
+    auto metal_normal = sample_hemisphere_cospower(
+        exponent, normal, rand2f(rng));
+    if (material.roughness == 0) {
+      trace(position, reflect(-ray.d, metal_normal), color);
+    } else {
+      auto halfway = sample_hemisphere_cospower(
+          exponent, metal_normal, rand2f(rng));
+      trace(position, reflect(-ray.d, halfway), color);
+    }
+  } else if (material.type == material_type::glossy) {
+    auto exponent = 2 / pow(material.roughness, 2);
+    auto halfway  = sample_hemisphere_cospower(exponent, normal, rand2f(rng));
+    if (rand1f(rng) < fresnel_schlick(vec3f{0.04}, halfway, -ray.d).x) {
+      trace(position, reflect(-ray.d, halfway), {1, 1, 1, 1});
+    } else {
+      trace(position, sample_hemisphere_cos(normal, rand2f(rng)), color);
+    }
+  } else if (material.type == material_type::transparent) {
+    if (rand1f(rng) < fresnel_schlick(vec3f{0.04}, normal, -ray.d).x) {
+      trace(position, reflect(-ray.d, normal), {1, 1, 1, 1});
+    } else {
+      trace(position, ray.d, color);
+    }
+  } else if (material.type == material_type::refractive) {
+    if (rand1f(rng) < fresnel_schlick(vec3f{0.04}, normal, -ray.d).x) {
+      trace(position, reflect(-ray.d, normal), {1, 1, 1, 1});
+    } else {
+      auto cos_theta = fmin(dot(-ray.d, normal), 1.0);
+      auto sin_theta = sqrt(1.0 - pow(cos_theta, 2));
+      if (dot(normal, -ray.d) < 0) {
+        material.ior = 1.0f / material.ior;
+        normal       = -normal;
+      }
+      if (material.ior * sin_theta <= 1 ||
+          reflectance(cos_theta, material.ior) < rand1f(rng)) {
+        trace(position, refract(-ray.d, normal, material.ior), color);
+      } else {
+        trace(position, reflect(-ray.d, normal), {1, 1, 1, 1});
+      }
+    }
+  }
+}
+
+// Trace a single sample for all pixels of a tile with shade_raytrace rules,
+// one bounce at a time. All rays of a bounce are collected first, sorted by
+// direction octant and origin Morton code, and intersected in packets in
+// that order, so that consecutive rays visit the same bvh nodes. The image
+// has the same expected value of raytrace_sample, but random numbers are
+// consumed in a different order.
+static void raytrace_sorted(raytrace_state& state, const scene_data& scene,
+    const bvh_scene& bvh, const vec4i& tile, const raytrace_params& params) {
+  [[maybe_unused]] auto timer = bvh_sample_timer{
+      (tile.z - tile.x) * (tile.w - tile.y)};
+  auto& camera        = scene.cameras[params.camera];
+  auto  radiance      = vector<vec4f>(state.width * (tile.w - tile.y));
+  auto  wave          = vector<raytrace_wave_ray>{};
+  auto  next          = vector<raytrace_wave_ray>{};
+  auto  sorted        = vector<raytrace_wave_ray>{};
+  auto  keys          = vector<std::pair<uint32_t, int>>{};
+  auto  intersections = vector<bvh_intersection>{};
+
+  // camera rays, indexed by pixel within the tile rows
+  for (auto j = tile.y; j < tile.w; j++) {
+    for (auto i = tile.x; i < tile.z; i++) {
+      auto idx = state.width * j + i;
+      auto puv = params.samples == 1 ? vec2f{0.5f, 0.5f}
+                                     : rand2f(state.rngs[idx]);
+      auto ray = eval_camera(camera,
+          {(state.offset.x + i + puv.x) / state.frame.x,
+              (state.offset.y + j + puv.y) / state.frame.y});
+      wave.push_back({ray, {1, 1, 1, 1}, idx - state.width * tile.y, 0});
+    }
+  }
+
+  // trace one bounce at a time
+  while (!wave.empty()) {
+    // sort secondary rays, camera rays are already coherent
+    if (wave.front().bounce > 0) {
+      auto bounds = invalidb3f;
+      for (auto& wray : wave) bounds = merge(bounds, wray.ray.o);
+      keys.resize(wave.size());
+      for (auto idx = 0; idx < (int)wave.size(); idx++) {
+        keys[idx] = {ray_sort_key(wave[idx].ray, bounds), idx};
+      }
+      std::sort(keys.begin(), keys.end());
+      sorted.resize(wave.size());
+      for (auto idx = 0; idx < (int)wave.size(); idx++) {
+        sorted[idx] = wave[keys[idx].second];
+      }
+      std::swap(wave, sorted);
+    }
+
+    // intersect in packets
+    intersections.resize(wave.size());
+    for (auto start = 0; start < (int)wave.size(); start += 8) {
+      auto count   = min(8, (int)wave.size() - start);
+      auto rays    = array<ray3f, 8>{};
+      auto results = array<bvh_intersection, 8>{};
+      for (auto lane = 0; lane < 8; lane++) {
+        rays[lane] = wave[start + min(lane, count - 1)].ray;
+      }
+      intersect_bvh_packet(bvh, scene, rays, results);
+      for (auto lane = 0; lane < count; lane++) {
+        intersections[start + lane] = results[lane];
+      }
+    }
+
+    // shade, collecting the next wave
+    next.clear();
+    for (auto idx = 0; idx < (int)wave.size(); idx++) {
+      auto pixel = wave[idx].idx + state.width * tile.y;
+      shade_raytrace_wave(scene, wave[idx], intersections[idx], radiance, next,
+          state.rngs[pixel], params);
+    }
+    std::swap(wave, next);
+  }
+
+  for (auto j = tile.y; j < tile.w; j++) {
+    for (auto i = tile.x; i < tile.z; i++) {
+      auto idx = state.width * j + i;
+      accumulate_sample(state, idx, radiance[idx - state.width * tile.y]);
+    }
+  }
+}
+
 // Progressively compute an image by calling trace_samples multiple times.
+// Each call adds up to `params.batch` samples per pixel, working on tiles
+// of `params.tilesize` pixels. Since every pixel keeps its own rng, the
+// result does not depend on the tile size, the batch size or threading.
+// With adaptive sampling, converged tiles are skipped, so the result
+// depends on the tile size too.
 void raytrace_samples(raytrace_state& state, const scene_data& scene,
     const bvh_scene& bvh, const raytrace_params& params) {
   if (state.samples >= params.samples) return;
-  auto& camera = scene.cameras[params.camera];
-  auto  shader = get_shader(params);
-  state.samples += 1;
-  if (params.samples == 1) {
-    for (auto idx = 0; idx < state.width * state.height; idx++) {
-      auto i = idx % state.width, j = idx / state.width;
-      auto u = (i + 0.5f) / state.width, v = (j + 0.5f) / state.height;
-      auto ray      = eval_camera(camera, {u, v});
-      auto radiance = shader(scene, bvh, ray, 0, state.rngs[idx], params);
-      if (!isfinite(radiance)) radiance = {0, 0, 0};
-      state.image[idx] += radiance;
-      state.hits[idx] += 1;
-    }
-  } else if (params.noparallel) {
-    for (auto idx = 0; idx < state.width * state.height; idx++) {
-      auto i = idx % state.width, j = idx / state.width;
-      auto u        = (i + rand1f(state.rngs[idx])) / state.width,
-           v        = (j + rand1f(state.rngs[idx])) / state.height;
-      auto ray      = eval_camera(camera, {u, v});
-      auto radiance = shader(scene, bvh, ray, 0, state.rngs[idx], params);
-      if (!isfinite(radiance)) radiance = {0, 0, 0};
-      state.image[idx] += radiance;
-      state.hits[idx] += 1;
+  auto shader        = get_shader(params);
+  auto packet_shader = get_packet_shader(params);
+  auto sorted        = params.sortrays &&
+                params.shader == raytrace_shader_type::raytrace;
+  auto nsamples      = clamp(params.batch, 1, params.samples - state.samples);
+  auto tiles         = make_tiles(state, params.tilesize);
+  auto render_tile   = [&](const vec4i& tile) {
+    for (auto sample = 0; sample < nsamples; sample++) {
+      if (is_converged(state, tile, params)) break;
+      if (sorted) {
+        raytrace_sorted(state, scene, bvh, tile, params);
+        continue;
+      }
+      for (auto j = tile.y; j < tile.w; j++) {
+        if (packet_shader) {
+          for (auto i = tile.x; i < tile.z; i += 8) {
+            raytrace_packet(state, scene, bvh, packet_shader, i, j,
+                min(8, tile.z - i), params);
+          }
+        } else {
+          for (auto i = tile.x; i < tile.z; i++) {
+            raytrace_sample(state, scene, bvh, shader, i, j, params);
+          }
+        }
+      }
     }
+  };
+  if (params.noparallel) {
+    for (auto& tile : tiles) render_tile(tile);
   } else {
-    parallel_for(state.width * state.height, [&](int idx) {
-      auto i = idx % state.width, j = idx / state.width;
-      auto u        = (i + rand1f(state.rngs[idx])) / state.width,
-           v        = (j + rand1f(state.rngs[idx])) / state.height;
-      auto ray      = eval_camera(camera, {u, v});
-      auto radiance = shader(scene, bvh, ray, 0, state.rngs[idx], params);
-      if (!isfinite(radiance)) radiance = {0, 0, 0};
-      state.image[idx] += radiance;
-      state.hits[idx] += 1;
-    });
+    parallel_for(tiles.size(), [&](size_t idx) { render_tile(tiles[idx]); });
   }
+  state.samples += nsamples;
+  collect_bvh_counters(state.counters);
 }
 
 // Check image type
@@ -427,6 +1014,13 @@ static void check_image(
         linear ? "expected linear image" : "expected srgb image"};
 }
 
+// Total number of samples traced
+int64_t get_samples(const raytrace_state& state) {
+  auto samples = (int64_t)0;
+  for (auto hits : state.hits) samples += hits;
+  return samples;
+}
+
 // Get resulting render
 color_image get_render(const raytrace_state& state) {
   auto image = make_image(state.width, state.height, true);
@@ -435,10 +1029,196 @@ color_image get_render(const raytrace_state& state) {
 }
 void get_render(color_image& image, const raytrace_state& state) {
   check_image(image, state.width, state.height, true);
-  auto scale = 1.0f / (float)state.samples;
   for (auto idx = 0; idx < state.width * state.height; idx++) {
+    auto scale        = 1.0f / (float)max(state.hits[idx], 1);
     image.pixels[idx] = state.image[idx] * scale;
   }
 }
 
 }  // namespace yocto
+
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION FOR STATE IO
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Checkpoint header. Arrays follow in the order of raytrace_state, stored
+// as raw values in the byte order of the machine.
+static const auto state_magic   = array<char, 4>{'Y', 'R', 'T', 'S'};
+static const auto state_version = 4;
+
+// FNV-1a hash of raw bytes
+static uint64_t hash_bytes(uint64_t hash, const void* values, size_t size) {
+  auto bytes = (const byte*)values;
+  for (auto idx = (size_t)0; idx < size; idx++) {
+    hash = (hash ^ (uint64_t)bytes[idx]) * 0x100000001b3ull;
+  }
+  return hash;
+}
+template <typename T>
+static uint64_t hash_values(uint64_t hash, const vector<T>& values) {
+  auto size = values.size();
+  hash      = hash_bytes(hash, &size, sizeof(size));
+  return hash_bytes(hash, values.data(), values.size() * sizeof(T));
+}
+
+// Hash of the params that change the rendered image. The sample count is
+// left out so that a render can be resumed with more samples. Ray sorting
+// changes the order of random numbers, and the bvh params can change which
+// of two equally distant hits is found, so they are all included.
+static uint64_t hash_params(const raytrace_params& params) {
+  auto hash = 0xcbf29ce484222325ull;
+  auto add  = [&hash](const auto& value) {
+    hash = hash_bytes(hash, &value, sizeof(value));
+  };
+  add(params.camera);
+  add(params.resolution);
+  add(params.shader);
+  add(params.bounces);
+  add(params.roulette);
+  add(params.tilesize);
+  add(params.sortrays);
+  add(params.highqualitybvh);
+  add(params.bvhwidth);
+  add(params.trianglecache);
+  add(params.mipmaps);
+  add(params.compression);
+  add(params.adaptive);
+  add(params.adaptivewarmup);
+  add(params.region);
+  add(params.wet);
+  return hash;
+}
+
+// Hash of the scene data. Structs with padding are hashed by field.
+static uint64_t hash_scene(const scene_data& scene) {
+  auto hash = 0xcbf29ce484222325ull;
+  auto add  = [&hash](const auto& value) {
+    hash = hash_bytes(hash, &value, sizeof(value));
+  };
+  for (auto& camera : scene.cameras) {
+    add(camera.frame);
+    add(camera.orthographic);
+    add(camera.lens);
+    add(camera.film);
+    add(camera.aspect);
+    add(camera.focus);
+    add(camera.aperture);
+  }
+  hash = hash_values(hash, scene.instances);
+  hash = hash_values(hash, scene.environments);
+  hash = hash_values(hash, scene.materials);
+  for (auto& shape : scene.shapes) {
+    hash = hash_values(hash, shape.points);
+    hash = hash_values(hash, shape.lines);
+    hash = hash_values(hash, shape.triangles);
+    hash = hash_values(hash, shape.quads);
+    hash = hash_values(hash, shape.positions);
+    hash = hash_values(hash, shape.normals);
+    hash = hash_values(hash, shape.texcoords);
+    hash = hash_values(hash, shape.colors);
+    hash = hash_values(hash, shape.radius);
+  }
+  for (auto& texture : scene.textures) {
+    add(texture.width);
+    add(texture.height);
+    add(texture.linear);
+    hash = hash_values(hash, texture.pixelsf);
+    hash = hash_values(hash, texture.pixelsb);
+    hash = hash_values(hash, texture.pixelsh);
+    hash = hash_values(hash, texture.blocks);
+  }
+  return hash;
+}
+
+// Save the rendering state
+bool save_state(const string& filename, const raytrace_state& state,
+    const scene_data& scene, const raytrace_params& params, string& error) {
+  auto data  = vector<byte>{};
+  auto write = [&data](const void* values, size_t size) {
+    auto bytes = (const byte*)values;
+    data.insert(data.end(), bytes, bytes + size);
+  };
+  auto write_array = [&write](const auto& values) {
+    write(values.data(), values.size() * sizeof(values[0]));
+  };
+  auto header = array<int, 8>{state_version, state.width, state.height,
+      state.samples, state.frame.x, state.frame.y, state.offset.x,
+      state.offset.y};
+  write(state_magic.data(), state_magic.size());
+  auto hashes = array<uint64_t, 2>{hash_params(params), hash_scene(scene)};
+  write(header.data(), sizeof(header));
+  write(hashes.data(), sizeof(hashes));
+  write_array(state.image);
+  write_array(state.hits);
+  write_array(state.mean);
+  write_array(state.m2);
+  write_array(state.rngs);
+
+  // write to a temporary file and replace the checkpoint
+  auto tmpname = filename + ".tmp";
+  if (!save_binary(tmpname, data, error)) return false;
+  auto ec = std::error_code{};
+  std::filesystem::rename(
+      std::filesystem::u8path(tmpname), std::filesystem::u8path(filename), ec);
+  if (ec) {
+    error = filename + ": " + ec.message();
+    return false;
+  }
+  return true;
+}
+
+// Load the rendering state
+bool load_state(const string& filename, raytrace_state& state,
+    const scene_data& scene, const raytrace_params& params, string& error) {
+  auto data = vector<byte>{};
+  if (!load_binary(filename, data, error)) return false;
+  auto format_error = [filename, &error]() {
+    error = filename + ": parse error";
+    return false;
+  };
+  auto offset = (size_t)0;
+  auto read   = [&data, &offset](void* values, size_t size) {
+    if (offset + size > data.size()) return false;
+    memcpy(values, data.data() + offset, size);
+    offset += size;
+    return true;
+  };
+  auto read_array = [&read](auto& values) {
+    return read(values.data(), values.size() * sizeof(values[0]));
+  };
+  auto magic  = array<char, 4>{};
+  auto header = array<int, 8>{};
+  auto hashes = array<uint64_t, 2>{};
+  if (!read(magic.data(), magic.size())) return format_error();
+  if (!read(header.data(), sizeof(header))) return format_error();
+  if (magic != state_magic || header[0] != state_version)
+    return format_error();
+  if (!read(hashes.data(), sizeof(hashes))) return format_error();
+  if (hashes[0] != hash_params(params)) {
+    error = filename + ": checkpoint was rendered with different params";
+    return false;
+  }
+  if (hashes[1] != hash_scene(scene)) {
+    error = filename + ": checkpoint was rendered from a different scene";
+    return false;
+  }
+  if (header[1] != state.width || header[2] != state.height ||
+      header[4] != state.frame.x || header[5] != state.frame.y ||
+      header[6] != state.offset.x || header[7] != state.offset.y) {
+    error = filename + ": checkpoint has a different image region";
+    return false;
+  }
+  auto loaded    = state;
+  loaded.samples = header[3];
+  if (!read_array(loaded.image)) return format_error();
+  if (!read_array(loaded.hits)) return format_error();
+  if (!read_array(loaded.mean)) return format_error();
+  if (!read_array(loaded.m2)) return format_error();
+  if (!read_array(loaded.rngs)) return format_error();
+  if (offset != data.size()) return format_error();
+  state = std::move(loaded);
+  return true;
+}
+
+}  // namespace yocto
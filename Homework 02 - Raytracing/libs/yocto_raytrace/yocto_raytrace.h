@@ -52,14 +52,24 @@
 // -----------------------------------------------------------------------------
 namespace yocto {
 
-// Rendering state
+// Rendering state. Width and height are the size of the rendered region,
+// that starts at `offset` in a frame of size `frame`. Hits count the samples
+// of each pixel, that differ from `samples` when adaptive sampling stops
+// converged tiles. Mean and m2 track
+// the running mean and the sum of squared deviations of the luminance of
+// the pixel samples, following Welford's algorithm.
 struct raytrace_state {
-  int               width   = 0;
-  int               height  = 0;
-  int               samples = 0;
-  vector<vec4f>     image   = {};
-  vector<int>       hits    = {};
-  vector<rng_state> rngs    = {};
+  int               width    = 0;
+  int               height   = 0;
+  int               samples  = 0;
+  vec2i             frame    = {0, 0};
+  vec2i             offset   = {0, 0};
+  vector<vec4f>     image    = {};
+  vector<int>       hits     = {};
+  vector<float>     mean     = {};
+  vector<float>     m2       = {};
+  vector<rng_state> rngs     = {};
+  bvh_counters      counters = {};  // with YOCTO_STATS
 };
 
 }  // namespace yocto
@@ -71,46 +81,96 @@ namespace yocto {
 
 // Type of tracing algorithm
 enum struct raytrace_shader_type {
-  raytrace,  // path tracing
-  matte,     // matte only rendering
-  eyelight,  // eyelight rendering
-  normal,    // normals
-  texcoord,  // texcoords
-  color,     // colors
+  raytrace,   // path tracing
+  pathtrace,  // iterative path tracing
+  matte,      // matte only rendering
+  eyelight,   // eyelight rendering
+  normal,     // normals
+  texcoord,   // texcoords
+  color,      // colors
 };
 
 // Options for trace functions
 struct raytrace_params {
-  int                  camera     = 0;
-  int                  resolution = 720;
-  raytrace_shader_type shader     = raytrace_shader_type::raytrace;
-  int                  samples    = 512;
-  int                  bounces    = 4;
-  bool                 noparallel = false;
-  int                  pratio     = 8;
-  float                exposure   = 0;
-  bool                 filmic     = false;
-  bool                 wet        = false;
+  int                  camera         = 0;
+  int                  resolution     = 720;
+  raytrace_shader_type shader         = raytrace_shader_type::raytrace;
+  int                  samples        = 512;
+  int                  bounces        = 4;
+  int                  roulette       = 3;
+  int                  tilesize       = 32;
+  int                  batch          = 1;
+  bool                 sortrays       = false;
+  bool                 highqualitybvh = false;
+  int                  bvhwidth       = 2;
+  bool                 trianglecache  = false;
+  bool                 mipmaps        = false;
+  texture_compression  compression    = texture_compression::none;
+  int                  texturecache   = 0;  // megabytes, 0 to disable
+  float                adaptive       = 0;
+  int                  adaptivewarmup = 16;
+  vec4i                region         = {0, 0, 0, 0};
+  bool                 noparallel     = false;
+  int                  pratio         = 8;
+  float                exposure       = 0;
+  bool                 filmic         = false;
+  bool                 wet            = false;
 };
 
 const auto raytrace_shader_names = vector<string>{
-    "raytrace", "matte", "eyelight", "normal", "texcoord", "color"};
-
-// Initialize state.
+    "raytrace", "pathtrace", "matte", "eyelight", "normal", "texcoord",
+    "color"};
+
+// Check the params that the command line ranges cannot express, such as a
+// bvh width of 2, 4 or 8 or a region with x0 < x1 and y0 < y1. Returns false
+// and sets the error if invalid.
+bool check_params(const raytrace_params& params, string& error);
+
+// Initialize state. A non-empty `params.region`, given as the pixel bounds
+// x0, y0, x1, y1 with x1 and y1 excluded, crops the render to that part of
+// the frame. Pixels are seeded from their frame position, so renders of
+// disjoint regions can be stitched into the full frame render. Throws
+// std::invalid_argument for a region that is inverted or outside the frame.
 raytrace_state make_state(
     const scene_data& scene, const raytrace_params& params);
 
 // Build the bvh acceleration structure.
 bvh_scene make_bvh(const scene_data& scene, const raytrace_params& params);
 
-// Progressively computes an image.
+// Progressively computes an image. Adds `params.batch` samples per call.
+// When `params.adaptive` is positive, tiles stop sampling after
+// `params.adaptivewarmup` samples once the relative standard error of the
+// luminance of all their pixels is below it. With `params.sortrays`, the
+// raytrace shader traces each tile one bounce at a time, sorting the rays of
+// a bounce by direction and origin before intersecting them.
 void raytrace_samples(raytrace_state& state, const scene_data& scene,
     const bvh_scene& bvh, const raytrace_params& params);
 
+// Total number of samples traced
+int64_t get_samples(const raytrace_state& state);
+
 // Get resulting render
 color_image get_render(const raytrace_state& state);
 void        get_render(color_image& render, const raytrace_state& state);
 
 }  // namespace yocto
 
+// -----------------------------------------------------------------------------
+// STATE IO
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Save/load the rendering state to a binary checkpoint, so that a render can
+// be resumed bit-exactly. Saving writes a temporary file first, so that an
+// interrupted save does not overwrite the previous checkpoint. The checkpoint
+// stores a hash of the scene and of the params that change the image, i.e.
+// all but the sample count and the performance options. Loading checks that
+// both hashes and the region match the given scene, params and state.
+bool save_state(const string& filename, const raytrace_state& state,
+    const scene_data& scene, const raytrace_params& params, string& error);
+bool load_state(const string& filename, raytrace_state& state,
+    const scene_data& scene, const raytrace_params& params, string& error);
+
+}  // namespace yocto
+
 #endif
@@ -0,0 +1,2 @@
+./bin/ybench --make-references --output out/bench.json
+./bin/ybench --output out/bench.json